@@ -0,0 +1,19 @@
+# Minify and gzip a portal asset, run with
+#   cmake -DINPUT=<file> -DOUTPUT=<file.gz> -P gzip_asset.cmake
+#
+# Minifying only drops indentation, blank lines and whole-line // comments,
+# which is safe for the inline CSS and JavaScript of the portal page.
+
+file(READ "${INPUT}" content)
+string(REGEX REPLACE "[ \t\r]*\n[ \t]*" "\n" content "${content}")
+string(REGEX REPLACE "\n//[^\n]*" "" content "${content}")
+string(REGEX REPLACE "\n+" "\n" content "${content}")
+string(STRIP "${content}" content)
+
+get_filename_component(name "${INPUT}" NAME)
+get_filename_component(output_dir "${OUTPUT}" DIRECTORY)
+set(minified "${output_dir}/${name}")
+file(WRITE "${minified}" "${content}")
+
+# The raw format with gzip compression is a plain .gz of the single file
+file(ARCHIVE_CREATE OUTPUT "${OUTPUT}" PATHS "${minified}" FORMAT raw COMPRESSION GZip COMPRESSION_LEVEL 9)
@@ -0,0 +1,163 @@
+#include "dns_server.h"
+
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <lwip/sockets.h>
+
+#define TAG "DnsServer"
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_PACKET  512
+#define DNS_TYPE_A      1
+#define DNS_TYPE_ANY    255
+#define DNS_ANSWER_TTL  60
+#define DNS_POLL_MS     250
+
+DnsServer::DnsServer() {
+    stopped_ = xSemaphoreCreateBinary();
+}
+
+DnsServer::~DnsServer() {
+    Stop();
+    vSemaphoreDelete(stopped_);
+}
+
+void DnsServer::Start(esp_ip4_addr_t address) {
+    if (running_.exchange(true)) {
+        return;
+    }
+    // A task that failed to bind may still be on its way out
+    Join();
+    address_ = address;
+    if (xTaskCreate([](void* arg) {
+        auto server = static_cast<DnsServer*>(arg);
+        server->Run();
+        // The server may be destroyed as soon as this is given
+        xSemaphoreGive(server->stopped_);
+        vTaskDelete(NULL);
+    }, "dns_server", 3072, this, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create task");
+        running_ = false;
+        return;
+    }
+    task_started_ = true;
+}
+
+void DnsServer::Stop() {
+    running_ = false;
+    Join();
+}
+
+void DnsServer::Join() {
+    if (task_started_) {
+        xSemaphoreTake(stopped_, portMAX_DELAY);
+        task_started_ = false;
+    }
+}
+
+void DnsServer::Run() {
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to create socket");
+        running_ = false;
+        return;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "Failed to bind port %d", port_);
+        close(fd);
+        running_ = false;
+        return;
+    }
+
+    // Wake up regularly to notice Stop()
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = DNS_POLL_MS * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ESP_LOGI(TAG, "DNS server started on port %d", port_);
+
+    uint8_t query[DNS_MAX_PACKET];
+    uint8_t response[DNS_MAX_PACKET];
+    while (running_) {
+        struct sockaddr_in client;
+        socklen_t client_length = sizeof(client);
+        int length = recvfrom(fd, query, sizeof(query), 0, (struct sockaddr*)&client, &client_length);
+        if (length <= 0) {
+            continue;
+        }
+        int response_length = BuildResponse(query, length, response, sizeof(response));
+        if (response_length > 0) {
+            sendto(fd, response, response_length, 0, (struct sockaddr*)&client, client_length);
+        }
+    }
+
+    close(fd);
+    ESP_LOGI(TAG, "DNS server stopped");
+}
+
+// Copies the first question and answers it with our address. Other record
+// types get an empty answer so that clients fall back to IPv4.
+int DnsServer::BuildResponse(const uint8_t* query, int length, uint8_t* response, int size) {
+    if (length < DNS_HEADER_SIZE) {
+        return -1;
+    }
+    uint16_t flags = (query[2] << 8) | query[3];
+    uint16_t question_count = (query[4] << 8) | query[5];
+    // Standard queries only
+    if ((flags & 0x8000) || ((flags >> 11) & 0x0F) != 0 || question_count == 0) {
+        return -1;
+    }
+
+    // Skip the name of the first question
+    int pos = DNS_HEADER_SIZE;
+    while (pos < length && query[pos] != 0) {
+        if (query[pos] & 0xC0) {
+            return -1;
+        }
+        pos += query[pos] + 1;
+    }
+    pos += 1 + 4;
+    if (pos > length) {
+        return -1;
+    }
+    uint16_t type = (query[pos - 4] << 8) | query[pos - 3];
+    bool answer = type == DNS_TYPE_A || type == DNS_TYPE_ANY;
+    if (pos + (answer ? 16 : 0) > size) {
+        return -1;
+    }
+
+    memcpy(response, query, pos);
+    // Response, authoritative, recursion desired copied from the query and available
+    flags = 0x8400 | (flags & 0x0100) | 0x0080;
+    response[2] = flags >> 8;
+    response[3] = flags & 0xFF;
+    response[4] = 0;
+    response[5] = 1;
+    response[6] = 0;
+    response[7] = answer ? 1 : 0;
+    memset(response + 8, 0, 4);
+    if (!answer) {
+        return pos;
+    }
+
+    uint8_t* p = response + pos;
+    // Name as a pointer to the question
+    *p++ = 0xC0;
+    *p++ = DNS_HEADER_SIZE;
+    *p++ = 0;
+    *p++ = DNS_TYPE_A;
+    *p++ = 0;
+    *p++ = 1;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = DNS_ANSWER_TTL;
+    *p++ = 0;
+    *p++ = 4;
+    memcpy(p, &address_.addr, 4);
+    return pos + 16;
+}
@@ -0,0 +1,308 @@
+#include "form_parser.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Value of each hex digit, -1 for any other character
+struct HexTable {
+    int8_t value[256];
+
+    constexpr HexTable() : value() {
+        for (int i = 0; i < 256; i++) {
+            value[i] = -1;
+        }
+        for (int i = 0; i < 10; i++) {
+            value['0' + i] = i;
+        }
+        for (int i = 0; i < 6; i++) {
+            value['a' + i] = 10 + i;
+            value['A' + i] = 10 + i;
+        }
+    }
+};
+static constexpr HexTable kHexTable;
+
+int FormParser::UrlDecode(const char* src, size_t length, char* dst, size_t size) {
+    size_t out = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (out + 1 >= size) {
+            return -1;
+        }
+        char c = src[i];
+        if (c == '%') {
+            if (length - i < 3) {
+                return -1;
+            }
+            int high = kHexTable.value[(unsigned char)src[i + 1]];
+            int low = kHexTable.value[(unsigned char)src[i + 2]];
+            // An escaped NUL would silently cut the C string short
+            if ((high | low) < 0 || (high | low) == 0) {
+                return -1;
+            }
+            c = (char)((high << 4) | low);
+            i += 2;
+        } else if (c == '+') {
+            c = ' ';
+        }
+        dst[out++] = c;
+    }
+    if (size > 0) {
+        dst[out] = '\0';
+    }
+    return out;
+}
+
+FormParser::FormParser(Format format, FormField* fields, size_t field_count)
+    : format_(format), fields_(fields), field_count_(field_count) {
+    state_ = format == Format::Json ? State::ObjectStart : State::Key;
+    for (size_t i = 0; i < field_count_; i++) {
+        fields_[i].length = 0;
+        fields_[i].present = false;
+        fields_[i].value[0] = '\0';
+    }
+}
+
+bool FormParser::Feed(const char* data, size_t length) {
+    for (size_t i = 0; i < length && !error_; i++) {
+        if (format_ == Format::Json) {
+            error_ = !FeedJson(data[i]);
+        } else {
+            error_ = !FeedUrlEncoded(data[i]);
+        }
+    }
+    return !error_;
+}
+
+bool FormParser::Finish() {
+    if (error_) {
+        return false;
+    }
+    if (format_ == Format::Json) {
+        return state_ == State::Done;
+    }
+    if (state_ == State::Value) {
+        return EndValue();
+    }
+    return true;
+}
+
+bool FormParser::FeedUrlEncoded(char c) {
+    if (state_ == State::Key) {
+        if (c == '=') {
+            BeginValue();
+            state_ = State::Value;
+        } else if (c == '&') {
+            // A key without a value is ignored
+            key_length_ = 0;
+            key_overflow_ = false;
+        } else {
+            return PutString(c, true);
+        }
+        return true;
+    }
+
+    if (c == '&') {
+        state_ = State::Key;
+        return EndValue();
+    }
+    return PutString(c, false);
+}
+
+bool FormParser::FeedJson(char c) {
+    bool space = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    switch (state_) {
+    case State::ObjectStart:
+        if (space) {
+            return true;
+        }
+        state_ = State::KeyStart;
+        return c == '{';
+    case State::KeyStart:
+        if (space) {
+            return true;
+        }
+        if (c == '}') {
+            state_ = State::Done;
+            return true;
+        }
+        key_length_ = 0;
+        key_overflow_ = false;
+        state_ = State::KeyString;
+        return c == '"';
+    case State::KeyString:
+        if (c == '"' && escape_ == 0) {
+            state_ = State::Colon;
+            return true;
+        }
+        return FeedString(c, true);
+    case State::Colon:
+        if (space) {
+            return true;
+        }
+        BeginValue();
+        state_ = State::ValueStart;
+        return c == ':';
+    case State::ValueStart:
+        if (space) {
+            return true;
+        }
+        if (c == '"') {
+            state_ = State::ValueString;
+            return true;
+        }
+        // Fields are strings, other fields may hold numbers, true, false or null
+        if (field_ != nullptr || c == '{' || c == '[') {
+            return false;
+        }
+        state_ = State::Scalar;
+        return true;
+    case State::ValueString:
+        if (c == '"' && escape_ == 0) {
+            state_ = State::AfterValue;
+            return EndValue();
+        }
+        return FeedString(c, false);
+    case State::Scalar:
+        if (c == ',' || c == '}') {
+            state_ = c == ',' ? State::KeyStart : State::Done;
+            return EndValue();
+        }
+        return c != '"' && c != '{' && c != '[';
+    case State::AfterValue:
+        if (space) {
+            return true;
+        }
+        if (c == ',') {
+            state_ = State::KeyStart;
+            return true;
+        }
+        state_ = State::Done;
+        return c == '}';
+    case State::Done:
+        return space;
+    default:
+        return false;
+    }
+}
+
+bool FormParser::FeedString(char c, bool is_key) {
+    if (escape_ == 'u') {
+        int digit = kHexTable.value[(unsigned char)c];
+        if (digit < 0) {
+            return false;
+        }
+        unicode_ = (unicode_ << 4) | digit;
+        if (++unicode_digits_ < 4) {
+            return true;
+        }
+        escape_ = 0;
+        // Surrogate pairs are not supported, SSIDs outside the BMP are rare. An escaped
+        // NUL is rejected as in UrlDecode.
+        if (unicode_ == 0 || (unicode_ >= 0xD800 && unicode_ <= 0xDFFF)) {
+            return false;
+        }
+        if (unicode_ < 0x80) {
+            return PutString(unicode_, is_key);
+        }
+        if (unicode_ < 0x800) {
+            return PutString(0xC0 | (unicode_ >> 6), is_key) &&
+                PutString(0x80 | (unicode_ & 0x3F), is_key);
+        }
+        return PutString(0xE0 | (unicode_ >> 12), is_key) &&
+            PutString(0x80 | ((unicode_ >> 6) & 0x3F), is_key) &&
+            PutString(0x80 | (unicode_ & 0x3F), is_key);
+    }
+
+    if (escape_ != 0) {
+        escape_ = 0;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            return PutString(c, is_key);
+        case 'b':
+            return PutString('\b', is_key);
+        case 'f':
+            return PutString('\f', is_key);
+        case 'n':
+            return PutString('\n', is_key);
+        case 'r':
+            return PutString('\r', is_key);
+        case 't':
+            return PutString('\t', is_key);
+        case 'u':
+            escape_ = 'u';
+            unicode_ = 0;
+            unicode_digits_ = 0;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    if (c == '\\') {
+        escape_ = '\\';
+        return true;
+    }
+    if ((unsigned char)c < 0x20) {
+        return false;
+    }
+    return PutString(c, is_key);
+}
+
+bool FormParser::PutString(char c, bool is_key) {
+    if (is_key) {
+        if (key_length_ < sizeof(key_) - 1) {
+            key_[key_length_++] = c;
+        } else {
+            key_overflow_ = true;
+        }
+        return true;
+    }
+    if (field_ == nullptr) {
+        return true;
+    }
+    if (field_->length >= field_->size - 1) {
+        return false;
+    }
+    field_->value[field_->length++] = c;
+    return true;
+}
+
+void FormParser::BeginValue() {
+    key_[key_length_] = '\0';
+    field_ = nullptr;
+    if (key_overflow_) {
+        return;
+    }
+    for (size_t i = 0; i < field_count_; i++) {
+        if (strcmp(fields_[i].name, key_) == 0) {
+            // The last occurrence wins
+            field_ = &fields_[i];
+            field_->length = 0;
+            field_->present = true;
+            break;
+        }
+    }
+}
+
+bool FormParser::EndValue() {
+    FormField* field = field_;
+    field_ = nullptr;
+    key_length_ = 0;
+    key_overflow_ = false;
+    if (field == nullptr) {
+        return true;
+    }
+    field->value[field->length] = '\0';
+    if (format_ == Format::UrlEncoded) {
+        // Decoding never makes a value longer, so it is done in the field's own buffer
+        int length = UrlDecode(field->value, field->length, field->value, field->size);
+        if (length < 0) {
+            return false;
+        }
+        field->length = length;
+    }
+    return field->length <= field->max_length;
+}
+
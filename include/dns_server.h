@@ -0,0 +1,33 @@
+#ifndef _DNS_SERVER_H_
+#define _DNS_SERVER_H_
+
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "esp_netif_ip_addr.h"
+
+// Answers every A query with one address, so that phones joining the
+// configuration AP detect a captive portal and open the page themselves.
+class DnsServer {
+public:
+    DnsServer();
+    ~DnsServer();
+
+    void Start(esp_ip4_addr_t address);
+    // Returns once the task has closed the socket, within a quarter of a second
+    void Stop();
+
+private:
+    int port_ = 53;
+    esp_ip4_addr_t address_;
+    std::atomic<bool> running_ = false;
+    // Given by the task when it exits
+    SemaphoreHandle_t stopped_ = nullptr;
+    bool task_started_ = false;
+
+    void Run();
+    void Join();
+    int BuildResponse(const uint8_t* query, int length, uint8_t* response, int size);
+};
+
+#endif // _DNS_SERVER_H_
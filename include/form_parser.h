@@ -0,0 +1,69 @@
+#ifndef _FORM_PARSER_H_
+#define _FORM_PARSER_H_
+
+#include <cstddef>
+
+// A field to pick out of a submitted form. The parser writes the decoded,
+// NUL terminated value into the caller's buffer.
+struct FormField {
+    const char* name;
+    char* value;
+    // Size of the buffer, an x-www-form-urlencoded value has to fit before decoding
+    size_t size;
+    // Longest accepted value after decoding
+    size_t max_length;
+    size_t length = 0;
+    bool present = false;
+};
+
+// Parses an application/x-www-form-urlencoded or a flat JSON object body as it
+// arrives, so it can be fed straight from each httpd_req_recv call. Fields that
+// are not asked for are skipped without being stored.
+class FormParser {
+public:
+    enum class Format { UrlEncoded, Json };
+
+    FormParser(Format format, FormField* fields, size_t field_count);
+
+    // Returns false on malformed input or a value that does not fit
+    bool Feed(const char* data, size_t length);
+    // Call after the whole body was fed
+    bool Finish();
+
+    // Decode %XX escapes and '+' of an x-www-form-urlencoded value into dst, which
+    // may be src itself. Returns the decoded length without the NUL, or -1 on a
+    // truncated or invalid escape, an escaped NUL, or when dst is too small.
+    static int UrlDecode(const char* src, size_t length, char* dst, size_t size);
+
+private:
+    enum class State {
+        Key, Value,
+        // JSON only
+        ObjectStart, KeyStart, KeyString, Colon, ValueStart, ValueString, Scalar, AfterValue, Done,
+    };
+
+    Format format_;
+    FormField* fields_;
+    size_t field_count_;
+    State state_;
+    bool error_ = false;
+
+    char key_[16];
+    size_t key_length_ = 0;
+    bool key_overflow_ = false;
+    FormField* field_ = nullptr;
+
+    // JSON string escapes, escape_ is 'u' while reading the hex digits of \uXXXX
+    char escape_ = 0;
+    int unicode_digits_ = 0;
+    unsigned unicode_ = 0;
+
+    bool FeedUrlEncoded(char c);
+    bool FeedJson(char c);
+    bool FeedString(char c, bool is_key);
+    bool PutString(char c, bool is_key);
+    void BeginValue();
+    bool EndValue();
+};
+
+#endif // _FORM_PARSER_H_
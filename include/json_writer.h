@@ -0,0 +1,46 @@
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include <cstddef>
+
+// Streaming JSON writer. Output is collected in a caller-provided buffer and
+// handed to the sink whenever the buffer is full, so nothing is allocated and
+// a response goes out in a few large writes instead of one per value.
+class JsonWriter {
+public:
+    // Returns false to abort, later writes are then dropped
+    typedef bool (*Sink)(void* ctx, const char* data, size_t length);
+
+    JsonWriter(char* buffer, size_t size, Sink sink, void* ctx);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const char* key);
+    // Quotes and escapes the value, length is in bytes since SSIDs may contain NUL
+    void String(const char* value, size_t length);
+    void String(const char* value);
+    void Int(int value);
+    // Already serialized JSON, written as it is
+    void Raw(const char* data, size_t length);
+
+    // Hands the buffered output to the sink, call it once at the end
+    bool Flush();
+    bool ok() const { return ok_; }
+
+private:
+    char* buffer_;
+    size_t size_;
+    size_t length_ = 0;
+    Sink sink_;
+    void* ctx_;
+    bool ok_ = true;
+    bool need_comma_ = false;
+
+    void Separate();
+    void Put(char c);
+    void Write(const char* data, size_t length);
+};
+
+#endif // _JSON_WRITER_H_
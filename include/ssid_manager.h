@@ -0,0 +1,61 @@
+#ifndef _SSID_MANAGER_H_
+#define _SSID_MANAGER_H_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <optional>
+#include "esp_wifi_types.h"
+
+struct SsidItem {
+    std::string ssid;
+    std::string password;
+    std::string psk;
+    int priority = 0;
+    // Raised above all other networks on every successful connection, the most recently
+    // used network has the highest value and the least recently used the lowest
+    uint32_t last_success = 0;
+
+    // Last AP we associated with, used to skip the all-channel scan
+    uint8_t bssid[6] = {0};
+    uint8_t channel = 0;
+    wifi_auth_mode_t authmode = WIFI_AUTH_OPEN;
+};
+
+class SsidManager {
+public:
+    static SsidManager& GetInstance();
+    // Add or update a network. A new network gets priority 0, an update keeps its priority.
+    void AddSsid(const std::string& ssid, const std::string& password);
+    // Add or update a network with a priority, networks with a higher priority are preferred
+    void AddSsid(const std::string& ssid, const std::string& password, int priority);
+    void RemoveSsid(const std::string& ssid);
+    void Clear();
+    std::vector<SsidItem> GetSsidList();
+    // Counts the changes to the networks, not the APs and PSKs the station caches. Kept in
+    // RTC memory, so after a wake from deep sleep it is read without loading NVS.
+    static uint32_t GetGeneration();
+
+    // Called by the station after a successful connection. Only writes NVS if the AP
+    // changed or another network was used since.
+    void UpdateConnectedAp(const std::string& ssid, const wifi_ap_record_t& ap_info);
+    void UpdatePsk(const std::string& ssid, const std::string& psk);
+
+    // Delete copy constructor and assignment operator
+    SsidManager(const SsidManager&) = delete;
+    SsidManager& operator=(const SsidManager&) = delete;
+
+private:
+    SsidManager();
+    ~SsidManager();
+
+    std::mutex mutex_;
+    std::vector<SsidItem> ssid_list_;
+
+    SsidItem* Find(const std::string& ssid);
+    void AddOrUpdate(const std::string& ssid, const std::string& password, std::optional<int> priority);
+    void LoadFromNvs();
+    void SaveToNvs();
+};
+
+#endif // _SSID_MANAGER_H_
@@ -2,8 +2,43 @@
 #define _WIFI_CONFIGURATION_AP_H_
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include "esp_http_server.h"
 #include "esp_event.h"
+#include "esp_timer.h"
+#include "esp_netif.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "dns_server.h"
+
+// Credentials submitted from the portal, connected to by the worker task
+struct ProvisioningJob {
+    int id;
+    char ssid[33];
+    char password[65];
+};
+
+// An entry of the AP list shown on the portal
+struct ScanAp {
+    std::string ssid;
+    int8_t rssi;
+    uint8_t authmode;
+};
+
+// Load on the portal web server since the start
+struct WifiPortalStats {
+    uint32_t requests = 0;
+    int open_sockets = 0;
+    int max_open_sockets = 0;
+    int average_latency_ms = 0;
+    int max_latency_ms = 0;
+    uint32_t min_free_heap = 0;
+};
 
 class WifiConfigurationAp {
 public:
@@ -13,6 +48,12 @@ public:
 
     std::string GetSsid();
     std::string GetWebServerUrl();
+    // How often the AP list is refreshed while the portal is open
+    void SetScanInterval(int interval_ms) { scan_interval_ms_ = interval_ms; }
+    // Called on the worker task once WifiStation has taken over the new connection.
+    // Without a callback the device restarts after provisioning.
+    void SetProvisionedCallback(std::function<void()> callback) { provisioned_callback_ = callback; }
+    WifiPortalStats GetPortalStats();
 
     // Delete copy constructor and assignment operator
     WifiConfigurationAp(const WifiConfigurationAp&) = delete;
@@ -24,15 +65,78 @@ private:
     ~WifiConfigurationAp();
 
     httpd_handle_t server_ = NULL;
+    esp_netif_t* ap_netif_ = nullptr;
+    std::function<void()> provisioned_callback_;
     EventGroupHandle_t event_group_;
     std::string ssid_prefix_;
     esp_event_handler_instance_t instance_any_id_;
     esp_event_handler_instance_t instance_got_ip_;
+
+    // AP list shared by all /scan requests, refreshed in the background
+    std::mutex scan_mutex_;
+    // Replaced, never modified, so a request can send it after releasing the lock
+    std::shared_ptr<const std::string> scan_json_;
+    std::vector<ScanAp> scan_aps_;
+    int64_t scan_time_ = 0;
+    std::atomic<int64_t> scan_request_time_ = 0;
+    int scan_interval_ms_ = 10000;
+    esp_timer_handle_t scan_timer_ = nullptr;
+
+    // Open /events streams, only touched from the httpd task
+    std::vector<httpd_req_t*> event_clients_;
+    std::atomic<int> event_client_count_ = 0;
+    esp_err_t HandleEvents(httpd_req_t *req);
+    void PushEvent(std::string &&message);
+    // Response buffer, one TCP segment, only used from the httpd task
+    char send_buffer_[1436];
+    // Strong ETag of the embedded page
+    // Of the gzipped and the plain page
+    char index_etag_[24];
+    char index_plain_etag_[32];
+    esp_err_t SendIndex(httpd_req_t *req);
+    static esp_err_t RedirectToPortal(httpd_req_t *req);
+
+    // Captive portal DNS, runs as long as the AP
+    DnsServer dns_server_;
+
+    // Updated from the httpd task, read from anywhere
+    std::mutex portal_stats_mutex_;
+    WifiPortalStats portal_stats_;
+    int64_t latency_total_ms_ = 0;
+    esp_err_t HandleTimed(httpd_req_t *req, esp_err_t (WifiConfigurationAp::*handler)(httpd_req_t *req));
+    esp_err_t SendPortalStats(httpd_req_t *req);
+
+    // Progress of the last provisioning job, reported by /status
+    QueueHandle_t job_queue_ = nullptr;
+    std::mutex job_mutex_;
+    int job_id_ = 0;
+    bool job_busy_ = false;
+    const char* job_phase_ = "idle";
+    std::string job_ip_;
+    std::string job_error_;
+    uint16_t disconnect_reason_ = 0;
+    // From esp_wifi_connect() until its WIFI_EVENT_STA_DISCONNECTED has arrived
+    std::atomic<bool> sta_connecting_ = false;
+    // esp_timer times of the last attempt, handed to WifiStation with the connection
+    std::atomic<int64_t> attempt_time_ = 0;
+    std::atomic<int64_t> associated_time_ = 0;
+    std::atomic<int64_t> got_ip_time_ = 0;
+    // Given by the httpd task once the event streams got the result and were closed
+    SemaphoreHandle_t handover_flushed_ = nullptr;
+    void WorkerTask();
+    esp_err_t HandleSubmit(httpd_req_t *req);
+    esp_err_t SendJobStatus(httpd_req_t *req);
+    void SetJobPhase(const char* phase, const std::string& error = "");
+
+    void StartScan();
+    void UpdateScanResult();
+    esp_err_t SendScanResult(httpd_req_t *req);
     void StartAccessPoint();
     void StartWebServer();
     bool ConnectToWifi(const std::string &ssid, const std::string &password);
-    void Save(const std::string &ssid, const std::string &password);
-    static std::string UrlDecode(const std::string &url);
+    // Returns true if the connection was handed over and the portal is gone
+    bool Save(const std::string &ssid, const std::string &password);
+    bool HandOver();
 
     // Event handlers
     static void WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
@@ -0,0 +1,39 @@
+#ifndef _WIFI_FAST_WAKE_H_
+#define _WIFI_FAST_WAKE_H_
+
+// The record WifiStation keeps in RTC memory across deep sleep, see WifiStation::EnableFastWake()
+
+#include <cstdint>
+#include "esp_netif_ip_addr.h"
+
+#define WIFI_FAST_WAKE_MAGIC 0x57464b32
+
+struct WifiFastWakeState {
+    uint32_t magic;
+    // CRC32 of the fields after it
+    uint32_t crc;
+    // SsidManager::GetGeneration() when saved, the state is stale once the networks change
+    uint32_t networks_generation;
+    char ssid[33];
+    char password[65];
+    // 64 hex characters without NUL, empty if psk[0] is 0
+    char psk[64];
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t authmode;
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+    esp_ip4_addr_t dns;
+    // Unix time the lease was obtained from DHCP, 0 if the address must not be reused
+    int64_t lease_time;
+
+    // Sets the magic and the CRC, after every change
+    void Seal();
+    // RTC memory holds garbage after a power cycle, only a sealed state is used
+    bool IsValid() const;
+    // The address may be reused without DHCP at Unix time now
+    bool IsLeaseFresh(int64_t now, int lease_reuse_s) const;
+};
+
+#endif // _WIFI_FAST_WAKE_H_
@@ -0,0 +1,101 @@
+#ifndef _WIFI_POLICY_H_
+#define _WIFI_POLICY_H_
+
+// Decisions of WifiStation that do not call into the driver, FreeRTOS or NVS.
+// They only depend on the Wi-Fi types, so they can be built and exercised off-target.
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+#include "esp_wifi_types.h"
+#include "ssid_manager.h"
+
+// Shortest wait before a reconnect attempt other than the first, whatever the strategy returns
+#define WIFI_MIN_RECONNECT_DELAY_MS 200
+
+// Out of range values are clamped: delays to 0 and above, the multiplier to 1 and
+// above, the jitter to 0..100
+struct WifiReconnectPolicy {
+    int initial_delay_ms = 500;
+    int max_delay_ms = 60000;
+    int multiplier = 2;
+    // Random spread of each delay so devices behind the same AP do not retry in lockstep
+    int jitter_percent = 25;
+    // Attempts before the start is reported as failed
+    int max_attempts = 5;
+    // Keep retrying in the background after the start failed (not for the blocking Start)
+    bool background_retry = true;
+};
+
+struct WifiPhaseStats {
+    int count = 0;
+    int min_ms = 0;
+    int avg_ms = 0;
+    int p95_ms = 0;
+};
+
+// Activity declared by the application, drives the power save policy
+enum class WifiActivity {
+    Idle,
+    Interactive,
+    Streaming,
+};
+
+struct WifiPowerSavePolicy {
+    // Beacon intervals between wake-ups in WIFI_PS_MAX_MODEM, applied on the next association
+    uint16_t listen_interval = 10;
+    // Measured traffic above this turns power save off, below low_traffic it may go to MAX_MODEM
+    int high_traffic = 16 * 1024;  // bytes per second
+    int low_traffic = 1024;
+    // A deeper power save mode must be wanted this long before switching, to avoid flapping
+    int hold_time_ms = 10000;
+};
+
+enum class WifiDisconnectClass {
+    // Wrong credentials or security, retrying will not help
+    FailFast,
+    // The link dropped on an otherwise working network
+    RetryNow,
+    RetryWithBackoff,
+};
+
+WifiDisconnectClass ClassifyDisconnectReason(uint16_t reason);
+
+// What a reconnect strategy decides on. Times are passed in rather than read from a
+// clock, so a strategy gives the same answer on the device and in a simulation.
+struct WifiReconnectAttempt {
+    // From 1 since the link was lost or the start
+    int attempt = 1;
+    // wifi_err_reason_t of the last disconnect, 0 when no known network was found
+    uint16_t reason = 0;
+    WifiDisconnectClass disconnect_class = WifiDisconnectClass::RetryWithBackoff;
+    bool connected_once = false;
+    int down_ms = 0;
+};
+
+// Returns the delay in ms before the next attempt, 0 to connect at once, or a
+// negative value to use the default strategy. random is uniformly distributed.
+typedef std::function<int64_t(const WifiReconnectAttempt& attempt, uint32_t random)> WifiReconnectStrategy;
+
+// The default strategy: the first attempt after a lost link is immediate, all others back off
+int64_t GetDefaultReconnectDelayMs(const WifiReconnectPolicy& policy, const WifiReconnectAttempt& attempt, uint32_t random);
+
+// The delay chosen by a strategy, kept from retrying in a tight loop: only the first
+// attempt may be immediate, later ones wait at least WIFI_MIN_RECONNECT_DELAY_MS
+int64_t ClampReconnectDelayMs(int64_t delay_ms, int attempt);
+
+// Delay before reconnect attempt number attempt (from 1), spread by the jitter.
+// random is a uniformly distributed value such as esp_random().
+int64_t GetReconnectDelayMs(const WifiReconnectPolicy& policy, int attempt, uint32_t random);
+
+// The best known network in the scan records, highest priority first, then the strongest signal.
+// Returns the record index and sets network_index, or returns -1 if none was found.
+int SelectNetwork(const std::vector<SsidItem>& networks, const wifi_ap_record_t* records, int count, int* network_index);
+
+// Count, min, average and nearest rank 95th percentile, sorts the values
+WifiPhaseStats GetPhaseStats(std::vector<int>& values);
+
+// Power save mode wanted for the activity and the traffic rate in bytes per second
+wifi_ps_type_t GetWantedPowerSaveMode(const WifiPowerSavePolicy& policy, WifiActivity activity, int traffic_rate);
+
+#endif // _WIFI_POLICY_H_
@@ -0,0 +1,16 @@
+#ifndef _WIFI_PSK_H_
+#define _WIFI_PSK_H_
+
+#include <string>
+#include "esp_wifi_types.h"
+
+// Derive the WPA/WPA2 PMK from the passphrase (PBKDF2-SHA1, 4096 rounds) and
+// return it as the 64 hex characters accepted by wifi_config.sta.password.
+// Returns an empty string for open networks or an invalid passphrase.
+std::string WifiDerivePsk(const std::string &ssid, const std::string &password);
+
+// Whether a precomputed PSK can replace the passphrase for this auth mode.
+// SAE (WPA3) needs the passphrase itself.
+bool WifiPskSupported(wifi_auth_mode_t authmode);
+
+#endif // _WIFI_PSK_H_
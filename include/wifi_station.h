@@ -2,19 +2,152 @@
 #define _WIFI_STATION_H_
 
 #include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include "esp_event.h"
+#include "esp_timer.h"
+#include "esp_wifi_types.h"
+#include "esp_netif_ip_addr.h"
+#include "esp_netif.h"
+#include "ssid_manager.h"
+#include "wifi_policy.h"
+
+enum class WifiState {
+    Idle,
+    Scanning,
+    // Authentication, association and 4-way handshake
+    Connecting,
+    ObtainingIp,
+    Connected,
+    // Waiting for the next reconnect attempt
+    Backoff,
+    Failed,
+};
+
+enum class WifiStationResult {
+    Connected,
+    Failed,
+    Timeout,
+};
+
+struct WifiReconnectStats {
+    uint32_t attempts = 0;
+    uint32_t recoveries = 0;
+    int last_recover_time_ms = 0;
+    int max_recover_time_ms = 0;
+};
+
+// Link state sampled in the background, safe to read from any task
+struct WifiLinkInfo {
+    bool connected = false;
+    int8_t rssi = 0;
+    // Exponential moving average of the RSSI samples
+    int8_t rssi_average = 0;
+    uint8_t channel = 0;
+    uint8_t bssid[6] = {0};
+    esp_ip4_addr_t ip = {};
+    int64_t connected_time = 0;  // esp_timer time of the last connection
+};
+
+// A WifiLinkInfo in 32-bit words, so that readers racing the writer only ever see atomics
+#define LINK_INFO_WORDS ((sizeof(WifiLinkInfo) + 3) / 4)
+
+// Timing of the phases of one connection, -1 when a phase did not happen
+struct WifiConnectRecord {
+    // The scan that picks one of several known networks
+    int scan_ms = -1;
+    // From esp_wifi_connect() to the association: authentication, association and the 4-way
+    // handshake, plus the channel scan the driver runs itself when the AP is not cached.
+    // The driver does not report that scan apart.
+    int connect_ms = -1;
+    int dhcp_ms = -1;
+    // From the start or the loss of the link to the IP, including failed attempts
+    int total_ms = -1;
+    int attempts = 0;
+};
+
+struct WifiConnectStats {
+    WifiPhaseStats scan;
+    WifiPhaseStats connect;
+    WifiPhaseStats dhcp;
+    WifiPhaseStats total;
+};
+
+struct WifiPowerSaveStats {
+    // Time spent in each wifi_ps_type_t while the station was started
+    int64_t time_ms[3] = {0};
+    uint32_t switches = 0;
+    wifi_ps_type_t mode = WIFI_PS_MIN_MODEM;
+};
 
 class WifiStation {
 public:
     static WifiStation& GetInstance();
+    // Connect to this network only instead of the networks stored by SsidManager
     void SetAuth(const std::string &&ssid, const std::string &&password);
+    // Connect and block until an IP is obtained or all retries failed
     void Start();
-    bool IsConnected();
-    int8_t GetRssi();
-    std::string GetSsid() const { return ssid_; }
-    std::string GetIpAddress() const { return ip_address_; }
-    uint8_t GetChannel();
+    // Connect in the background. The callback runs once on the event or timer task with the
+    // outcome, never from within this call; Timeout is reported if no IP was obtained within
+    // timeout_ms (0 waits forever), Failed at once if there is no network to connect to.
+    // The station keeps retrying after a timeout until Stop() is called.
+    // Returns false without calling the callback if the station is already started.
+    bool StartAsync(std::function<void(WifiStationResult result)> callback, int timeout_ms = 0);
+    // Take over the connection made by WifiConfigurationAp without restarting the driver.
+    // The esp_timer times of esp_wifi_connect(), STA_CONNECTED and the IP go into the
+    // connect record, 0 if unknown. Returns false if the station has no IP or is already started.
+    bool AdoptConnection(int64_t attempt_time = 0, int64_t associated_time = 0, int64_t got_ip_time = 0);
+    void Stop();
+    // Keep the network, AP, PSK and DHCP lease in RTC memory. After a wake from deep sleep
+    // the next start connects without scanning, as long as the networks of SsidManager (or
+    // SetAuth) are unchanged. It reuses the IP without DHCP for lease_reuse_s seconds after it
+    // was obtained, unless another host answers an ARP probe for it. If the network is not
+    // reachable the start goes on with the known networks. Call before Start().
+    void EnableFastWake(int lease_reuse_s = 600);
+    // Forget the state kept for fast wake, the next start connects as after a power on
+    void ClearFastWake();
+    // Milliseconds from the start of the application (esp_timer) to the first IP, 0 until then.
+    // The ROM and the bootloader run before and are not included.
+    int GetWakeToIpTime() const { return wake_to_ip_ms_; }
+    void SetReconnectPolicy(const WifiReconnectPolicy& policy) { reconnect_policy_ = policy; }
+    // Replace the backoff of the policy, max_attempts and background_retry still apply
+    void SetReconnectStrategy(WifiReconnectStrategy strategy) { reconnect_strategy_ = std::move(strategy); }
+    WifiReconnectStats GetReconnectStats();
+    // Number of disconnects per wifi_err_reason_t since boot
+    std::map<uint16_t, uint32_t> GetDisconnectReasons();
+    uint16_t GetLastDisconnectReason() const { return last_disconnect_reason_; }
+    // The most recent connections, oldest first
+    std::vector<WifiConnectRecord> GetConnectRecords();
+    WifiConnectStats GetConnectStats();
+    bool IsConnected() const { return state_ == WifiState::Connected; }
+    WifiState GetState() const { return state_; }
+    static const char* GetStateName(WifiState state);
+    // The callback runs on the event or timer task on every state change and must not block.
+    // Subscribers get the changes one at a time and in order, a change made from a callback
+    // is delivered after the current one. Failed is reported when a start runs out of attempts,
+    // also when background_retry then goes on to Backoff. Returns an id for Unsubscribe().
+    int Subscribe(std::function<void(WifiState old_state, WifiState new_state)> callback);
+    void Unsubscribe(int id);
+    int8_t GetRssi() const { return GetLinkInfo().rssi; }
+    std::string GetSsid() const { return network_.ssid; }
+    std::string GetIpAddress() const;
+    uint8_t GetChannel() const { return GetLinkInfo().channel; }
+    // Lock-free copy of the last link sample, never calls into the driver
+    WifiLinkInfo GetLinkInfo() const;
+    // Milliseconds since the link came up, 0 while disconnected
+    int GetLinkUptime() const;
+    // Fixed power save mode, disables the policy. Called before Start() it applies from the start.
     void SetPowerSaveMode(bool enabled);
+    // Pick the power save mode from the declared activity and the reported traffic
+    void SetPowerSavePolicy(const WifiPowerSavePolicy& policy);
+    void SetActivity(WifiActivity activity);
+    // Count bytes sent or received by the application for the traffic rate
+    void ReportTraffic(size_t bytes) { traffic_bytes_ += bytes; }
+    WifiPowerSaveStats GetPowerSaveStats();
 
 private:
     WifiStation();
@@ -23,10 +156,94 @@ private:
     WifiStation& operator=(const WifiStation&) = delete;
 
     EventGroupHandle_t event_group_;
-    std::string ssid_;
-    std::string password_;
-    std::string ip_address_;
+    std::atomic<WifiState> state_ = WifiState::Idle;
+    // Held while a change is delivered, recursive for changes made by subscribers
+    std::recursive_mutex state_mutex_;
+    std::deque<std::pair<WifiState, WifiState>> pending_transitions_;
+    bool delivering_ = false;
+    std::mutex subscribers_mutex_;
+    std::map<int, std::function<void(WifiState old_state, WifiState new_state)>> subscribers_;
+    int next_subscriber_id_ = 0;
+    SsidItem auth_network_;
+    // Networks to choose from in this start and the one selected
+    std::vector<SsidItem> networks_;
+    SsidItem network_;
+    bool use_cached_ap_ = false;
+    esp_netif_t* sta_netif_ = nullptr;
+
+    std::mutex fast_wake_mutex_;
+    bool fast_wake_enabled_ = false;
+    int lease_reuse_s_ = 600;
+    bool fast_wake_ = false;
+    // Reusing the fast wake lease, set once the probe after the association went unanswered
+    std::atomic<bool> static_ip_ = false;
+    esp_netif_ip_info_t reused_ip_info_ = {};
+    esp_timer_handle_t address_timer_ = nullptr;
+    SsidItem fast_wake_network_;
+    std::atomic<int> wake_to_ip_ms_ = 0;
+
+    // Sampled link state, published through a two copy sequence lock
+    std::mutex link_mutex_;
+    WifiLinkInfo link_info_;
+    std::atomic<uint32_t> link_copies_[2][LINK_INFO_WORDS] = {};
+    std::atomic<uint32_t> link_sequence_ = 0;
+    int rssi_filter_ = 0;
+    esp_timer_handle_t link_timer_ = nullptr;
+
     int reconnect_count_ = 0;
+    bool connected_once_ = false;
+    int64_t start_time_ = 0;
+    int64_t disconnected_time_ = 0;
+    WifiReconnectPolicy reconnect_policy_;
+    WifiReconnectStrategy reconnect_strategy_;
+    WifiReconnectStats reconnect_stats_;
+    esp_timer_handle_t reconnect_timer_ = nullptr;
+    std::mutex stats_mutex_;
+    std::map<uint16_t, uint32_t> disconnect_reasons_;
+    uint16_t last_disconnect_reason_ = 0;
+
+    // Phase timestamps of the current connection attempt
+    int64_t scan_start_time_ = 0;
+    int64_t scan_done_time_ = 0;
+    int64_t attempt_time_ = 0;
+    int64_t associated_time_ = 0;
+    // Set while the scan started by Connect() runs, other scans are not ours to act on
+    std::atomic<bool> scan_pending_ = false;
+    std::vector<WifiConnectRecord> connect_records_;
+    size_t connect_record_index_ = 0;
+
+    std::mutex power_mutex_;
+    bool power_policy_enabled_ = false;
+    WifiPowerSavePolicy power_policy_;
+    WifiActivity activity_ = WifiActivity::Idle;
+    std::atomic<uint32_t> traffic_bytes_ = 0;
+    int64_t traffic_time_ = 0;
+    wifi_ps_type_t ps_mode_ = WIFI_PS_MIN_MODEM;
+    int64_t ps_mode_time_ = 0;
+    int64_t deeper_mode_time_ = 0;
+    WifiPowerSaveStats power_stats_;
+    esp_event_handler_instance_t instance_any_id_ = nullptr;
+    esp_event_handler_instance_t instance_got_ip_ = nullptr;
+    esp_timer_handle_t start_timer_ = nullptr;
+    std::function<void(WifiStationResult result)> start_callback_;
+    std::atomic<bool> start_pending_ = false;
+
+    void SetState(WifiState state);
+    void CompleteStart(WifiStationResult result);
+    void ScheduleReconnect(uint16_t reason = 0);
+    void Connect();
+    void SelectNetworkFromScan();
+    void ApplyStationConfig();
+    void UpdateLinkInfo(bool connected, const esp_ip4_addr_t* ip);
+    void PublishLinkInfo();
+    void AddConnectRecord(int64_t now);
+    bool LoadFastWakeState(esp_netif_ip_info_t* ip_info = nullptr);
+    void SaveFastWakeState(const esp_netif_ip_info_t* ip_info);
+    void SaveFastWakePsk(const std::string& ssid, const std::string& psk);
+    void ProbeReusedAddress();
+    void CheckReusedAddress();
+    void EvaluatePowerSave();
+    void SwitchPowerSaveMode(wifi_ps_type_t mode, int64_t now);
 
     static void WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
     static void IpEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
@@ -0,0 +1,126 @@
+#include "json_writer.h"
+
+#include <cstdio>
+#include <cstring>
+
+JsonWriter::JsonWriter(char* buffer, size_t size, Sink sink, void* ctx)
+    : buffer_(buffer), size_(size), sink_(sink), ctx_(ctx) {
+}
+
+void JsonWriter::BeginObject() {
+    Separate();
+    Put('{');
+    need_comma_ = false;
+}
+
+void JsonWriter::EndObject() {
+    Put('}');
+    need_comma_ = true;
+}
+
+void JsonWriter::BeginArray() {
+    Separate();
+    Put('[');
+    need_comma_ = false;
+}
+
+void JsonWriter::EndArray() {
+    Put(']');
+    need_comma_ = true;
+}
+
+void JsonWriter::Key(const char* key) {
+    String(key);
+    Put(':');
+    need_comma_ = false;
+}
+
+void JsonWriter::String(const char* value) {
+    String(value, strlen(value));
+}
+
+void JsonWriter::String(const char* value, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    Separate();
+    Put('"');
+    size_t i = 0;
+    while (i < length) {
+        // Copy the run of characters that need no escaping at once
+        size_t run = i;
+        while (run < length && (unsigned char)value[run] >= 0x20 && value[run] != '"' && value[run] != '\\') {
+            run++;
+        }
+        Write(value + i, run - i);
+        if (run == length) {
+            break;
+        }
+        unsigned char c = value[run];
+        if (c == '"' || c == '\\') {
+            Put('\\');
+            Put(c);
+        } else if (c == '\n') {
+            Write("\\n", 2);
+        } else if (c == '\r') {
+            Write("\\r", 2);
+        } else if (c == '\t') {
+            Write("\\t", 2);
+        } else {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F] };
+            Write(escaped, sizeof(escaped));
+        }
+        i = run + 1;
+    }
+    Put('"');
+    need_comma_ = true;
+}
+
+void JsonWriter::Int(int value) {
+    char buf[12];
+    int n = snprintf(buf, sizeof(buf), "%d", value);
+    Separate();
+    Write(buf, n);
+    need_comma_ = true;
+}
+
+void JsonWriter::Raw(const char* data, size_t length) {
+    Separate();
+    Write(data, length);
+    need_comma_ = true;
+}
+
+bool JsonWriter::Flush() {
+    if (ok_ && length_ > 0) {
+        ok_ = sink_(ctx_, buffer_, length_);
+    }
+    length_ = 0;
+    return ok_;
+}
+
+void JsonWriter::Separate() {
+    if (need_comma_) {
+        Put(',');
+    }
+}
+
+void JsonWriter::Put(char c) {
+    if (length_ == size_) {
+        Flush();
+    }
+    buffer_[length_++] = c;
+}
+
+void JsonWriter::Write(const char* data, size_t length) {
+    while (length > 0) {
+        if (length_ == size_) {
+            Flush();
+        }
+        size_t n = size_ - length_;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(buffer_ + length_, data, n);
+        length_ += n;
+        data += n;
+        length -= n;
+    }
+}
@@ -0,0 +1,364 @@
+#include "ssid_manager.h"
+#include "wifi_psk.h"
+
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <nvs.h>
+#include <esp_rom_crc.h>
+
+#define TAG "SsidManager"
+#define NVS_NAMESPACE "wifi"
+#define MAX_SSID_COUNT 10
+#define CONFIG_KEY "config"
+#define CONFIG_VERSION 1
+
+// Garbage after a power on, only compared with a value saved since
+static RTC_NOINIT_ATTR std::atomic<uint32_t> generation;
+
+SsidManager& SsidManager::GetInstance() {
+    static SsidManager instance;
+    return instance;
+}
+
+SsidManager::SsidManager() {
+    LoadFromNvs();
+}
+
+SsidManager::~SsidManager() {
+}
+
+// All networks are stored in one blob under CONFIG_KEY, read and written in one go.
+// entry_size lets a later version with longer entries still read the older ones.
+struct __attribute__((packed)) SsidConfigHeader {
+    uint8_t version;
+    uint8_t count;
+    uint16_t entry_size;
+    // CRC32 of the whole blob with this field set to 0
+    uint32_t crc;
+};
+
+struct __attribute__((packed)) SsidConfigEntry {
+    char ssid[33];
+    char password[65];
+    // 64 hex characters without NUL, empty if psk[0] is 0
+    char psk[64];
+    int32_t priority;
+    uint32_t last_success;
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t authmode;
+};
+
+static uint32_t ConfigCrc(uint8_t* data, size_t length) {
+    auto* header = reinterpret_cast<SsidConfigHeader*>(data);
+    uint32_t crc = header->crc;
+    header->crc = 0;
+    uint32_t result = esp_rom_crc32_le(0, data, length);
+    header->crc = crc;
+    return result;
+}
+
+// Versions before the config blob used one key per field, the first network with
+// the plain names ("ssid", "password", ...) and the others with their index added
+static std::string Key(const char* name, int index) {
+    if (index == 0) {
+        return name;
+    }
+    return name + std::to_string(index);
+}
+
+static std::vector<SsidItem> LoadLegacyKeys(nvs_handle_t nvs_handle) {
+    std::vector<SsidItem> list;
+    for (int i = 0; i < MAX_SSID_COUNT; i++) {
+        char ssid[33], password[65], psk[65];
+        size_t length = sizeof(ssid);
+        if (nvs_get_str(nvs_handle, Key("ssid", i).c_str(), ssid, &length) != ESP_OK) {
+            continue;
+        }
+        SsidItem item;
+        item.ssid = ssid;
+        length = sizeof(password);
+        if (nvs_get_str(nvs_handle, Key("password", i).c_str(), password, &length) == ESP_OK) {
+            item.password = password;
+        }
+        length = sizeof(psk);
+        if (nvs_get_str(nvs_handle, Key("psk", i).c_str(), psk, &length) == ESP_OK) {
+            item.psk = psk;
+        }
+        int32_t priority = 0;
+        if (nvs_get_i32(nvs_handle, Key("priority", i).c_str(), &priority) == ESP_OK) {
+            item.priority = priority;
+        }
+        nvs_get_u32(nvs_handle, Key("last_ok", i).c_str(), &item.last_success);
+
+        uint8_t channel = 0, authmode = 0;
+        length = sizeof(item.bssid);
+        if (nvs_get_blob(nvs_handle, Key("bssid", i).c_str(), item.bssid, &length) == ESP_OK && length == sizeof(item.bssid) &&
+            nvs_get_u8(nvs_handle, Key("channel", i).c_str(), &channel) == ESP_OK &&
+            nvs_get_u8(nvs_handle, Key("authmode", i).c_str(), &authmode) == ESP_OK) {
+            item.channel = channel;
+            item.authmode = (wifi_auth_mode_t)authmode;
+        }
+        list.push_back(item);
+    }
+    return list;
+}
+
+// Any network may have been removed before the upgrade, so look at every index
+static bool HasLegacyKeys(nvs_handle_t nvs_handle) {
+    for (int i = 0; i < MAX_SSID_COUNT; i++) {
+        size_t length = 0;
+        if (nvs_get_str(nvs_handle, Key("ssid", i).c_str(), nullptr, &length) == ESP_OK) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void EraseLegacyKeys(nvs_handle_t nvs_handle) {
+    static const char* const names[] = {
+        "ssid", "password", "psk", "priority", "last_ok", "bssid", "channel", "authmode"
+    };
+    for (int i = 0; i < MAX_SSID_COUNT; i++) {
+        for (auto name : names) {
+            nvs_erase_key(nvs_handle, Key(name, i).c_str());
+        }
+    }
+}
+
+void SsidManager::LoadFromNvs() {
+    ssid_list_.clear();
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    std::vector<uint8_t> blob(sizeof(SsidConfigHeader) + MAX_SSID_COUNT * sizeof(SsidConfigEntry));
+    size_t length = blob.size();
+    esp_err_t ret = nvs_get_blob(nvs_handle, CONFIG_KEY, blob.data(), &length);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        ssid_list_ = LoadLegacyKeys(nvs_handle);
+        nvs_close(nvs_handle);
+        if (!ssid_list_.empty()) {
+            // Move to the blob once, the old keys are erased after it is written
+            ESP_LOGI(TAG, "Migrating %d networks to the config blob", (int)ssid_list_.size());
+            SaveToNvs();
+        }
+        return;
+    }
+    nvs_close(nvs_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the config: %s", esp_err_to_name(ret));
+        return;
+    }
+
+    auto* header = reinterpret_cast<SsidConfigHeader*>(blob.data());
+    if (length < sizeof(SsidConfigHeader) || header->version == 0 || header->version > CONFIG_VERSION ||
+        header->entry_size == 0 || header->count > MAX_SSID_COUNT ||
+        length != sizeof(SsidConfigHeader) + header->count * header->entry_size) {
+        ESP_LOGE(TAG, "Invalid config, version %d", length < sizeof(SsidConfigHeader) ? 0 : header->version);
+        return;
+    }
+    if (ConfigCrc(blob.data(), length) != header->crc) {
+        ESP_LOGE(TAG, "Config CRC mismatch");
+        return;
+    }
+
+    for (int i = 0; i < header->count; i++) {
+        // Fields missing from older, shorter entries stay zero
+        SsidConfigEntry entry = {};
+        memcpy(&entry, blob.data() + sizeof(SsidConfigHeader) + i * header->entry_size,
+            std::min<size_t>(header->entry_size, sizeof(entry)));
+        entry.ssid[sizeof(entry.ssid) - 1] = '\0';
+        entry.password[sizeof(entry.password) - 1] = '\0';
+
+        SsidItem item;
+        item.ssid = entry.ssid;
+        item.password = entry.password;
+        if (entry.psk[0] != '\0') {
+            item.psk.assign(entry.psk, sizeof(entry.psk));
+        }
+        item.priority = entry.priority;
+        item.last_success = entry.last_success;
+        memcpy(item.bssid, entry.bssid, sizeof(item.bssid));
+        item.channel = entry.channel;
+        item.authmode = (wifi_auth_mode_t)entry.authmode;
+        ssid_list_.push_back(item);
+    }
+}
+
+void SsidManager::SaveToNvs() {
+    size_t count = std::min<size_t>(ssid_list_.size(), MAX_SSID_COUNT);
+    std::vector<uint8_t> blob(sizeof(SsidConfigHeader) + count * sizeof(SsidConfigEntry));
+    auto* header = reinterpret_cast<SsidConfigHeader*>(blob.data());
+    header->version = CONFIG_VERSION;
+    header->count = count;
+    header->entry_size = sizeof(SsidConfigEntry);
+    for (size_t i = 0; i < count; i++) {
+        auto& item = ssid_list_[i];
+        SsidConfigEntry entry = {};
+        strncpy(entry.ssid, item.ssid.c_str(), sizeof(entry.ssid) - 1);
+        strncpy(entry.password, item.password.c_str(), sizeof(entry.password) - 1);
+        if (item.psk.length() == sizeof(entry.psk)) {
+            memcpy(entry.psk, item.psk.data(), sizeof(entry.psk));
+        }
+        entry.priority = item.priority;
+        entry.last_success = item.last_success;
+        memcpy(entry.bssid, item.bssid, sizeof(entry.bssid));
+        entry.channel = item.channel;
+        entry.authmode = item.authmode;
+        memcpy(blob.data() + sizeof(SsidConfigHeader) + i * sizeof(entry), &entry, sizeof(entry));
+    }
+    header->crc = ConfigCrc(blob.data(), blob.size());
+
+    // One blob replaces the whole configuration atomically. A full or worn NVS keeps the
+    // previous configuration, the list in memory stays usable until the next reboot.
+    nvs_handle_t nvs_handle;
+    esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(ret));
+        return;
+    }
+    ret = nvs_set_blob(nvs_handle, CONFIG_KEY, blob.data(), blob.size());
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs_handle);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save the config: %s", esp_err_to_name(ret));
+        nvs_close(nvs_handle);
+        return;
+    }
+    if (HasLegacyKeys(nvs_handle)) {
+        EraseLegacyKeys(nvs_handle);
+        nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+}
+
+std::vector<SsidItem> SsidManager::GetSsidList() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ssid_list_;
+}
+
+SsidItem* SsidManager::Find(const std::string& ssid) {
+    for (auto& item : ssid_list_) {
+        if (item.ssid == ssid) {
+            return &item;
+        }
+    }
+    return nullptr;
+}
+
+void SsidManager::AddSsid(const std::string& ssid, const std::string& password) {
+    AddOrUpdate(ssid, password, std::nullopt);
+}
+
+void SsidManager::AddSsid(const std::string& ssid, const std::string& password, int priority) {
+    AddOrUpdate(ssid, password, priority);
+}
+
+void SsidManager::AddOrUpdate(const std::string& ssid, const std::string& password, std::optional<int> priority) {
+    // Derive the PSK once so the station does not run PBKDF2 on every boot. It takes most
+    // of a second, so not while holding the lock, and not again for an unchanged password.
+    std::string psk;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto* item = Find(ssid);
+        if (item != nullptr && item->password == password) {
+            psk = item->psk;
+        }
+    }
+    if (psk.empty()) {
+        psk = WifiDerivePsk(ssid, password);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* item = Find(ssid);
+    if (item == nullptr) {
+        if (ssid_list_.size() >= MAX_SSID_COUNT) {
+            // Forget the network that has not been used for the longest time
+            auto oldest = ssid_list_.begin();
+            for (auto it = ssid_list_.begin(); it != ssid_list_.end(); ++it) {
+                if (it->last_success < oldest->last_success) {
+                    oldest = it;
+                }
+            }
+            ESP_LOGW(TAG, "Too many networks, removing %s", oldest->ssid.c_str());
+            ssid_list_.erase(oldest);
+        }
+        ssid_list_.push_back(SsidItem());
+        item = &ssid_list_.back();
+        item->ssid = ssid;
+    }
+
+    item->password = password;
+    item->psk = psk;
+    if (priority.has_value()) {
+        item->priority = *priority;
+    }
+    SaveToNvs();
+    generation++;
+    ESP_LOGI(TAG, "Added network %s priority=%d", ssid.c_str(), item->priority);
+}
+
+void SsidManager::RemoveSsid(const std::string& ssid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = ssid_list_.begin(); it != ssid_list_.end(); ++it) {
+        if (it->ssid == ssid) {
+            ssid_list_.erase(it);
+            SaveToNvs();
+            generation++;
+            return;
+        }
+    }
+}
+
+void SsidManager::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ssid_list_.clear();
+    SaveToNvs();
+    generation++;
+}
+
+uint32_t SsidManager::GetGeneration() {
+    return generation.load();
+}
+
+void SsidManager::UpdateConnectedAp(const std::string& ssid, const wifi_ap_record_t& ap_info) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* item = Find(ssid);
+    if (item == nullptr) {
+        return;
+    }
+    // A counter rather than the time, which is not set at boot and may jump
+    uint32_t newest = 0;
+    for (auto& other : ssid_list_) {
+        if (&other != item) {
+            newest = std::max(newest, other.last_success);
+        }
+    }
+    bool same_ap = memcmp(item->bssid, ap_info.bssid, sizeof(item->bssid)) == 0 &&
+        item->channel == ap_info.primary && item->authmode == ap_info.authmode;
+    if (same_ap && item->last_success > newest) {
+        // Reconnected to the same AP, nothing to write
+        return;
+    }
+    memcpy(item->bssid, ap_info.bssid, sizeof(item->bssid));
+    item->channel = ap_info.primary;
+    item->authmode = ap_info.authmode;
+    item->last_success = std::max(item->last_success, newest + 1);
+    SaveToNvs();
+}
+
+void SsidManager::UpdatePsk(const std::string& ssid, const std::string& psk) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* item = Find(ssid);
+    if (item == nullptr || item->psk == psk) {
+        return;
+    }
+    item->psk = psk;
+    SaveToNvs();
+}
@@ -0,0 +1,14 @@
+// The portal page under the symbols target_add_binary_data gives it in the firmware,
+// minified and gzipped by the same script. The paths come from CMakeLists.txt.
+
+#define EMBED_ASSET(symbol, path)                       \
+    asm(".section .rodata\n"                            \
+        ".global " symbol "_start\n"                    \
+        symbol "_start:\n"                              \
+        ".incbin \"" path "\"\n"                        \
+        ".global " symbol "_end\n"                      \
+        symbol "_end:\n"                                \
+        ".previous\n")
+
+EMBED_ASSET("_binary_wifi_configuration_ap_html_gz", PORTAL_HTML_GZ);
+EMBED_ASSET("_binary_wifi_configuration_ap_html", PORTAL_HTML_MIN);
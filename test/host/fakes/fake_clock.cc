@@ -0,0 +1,409 @@
+#include "fake_clock.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+static int64_t now_us = FAKE_CLOCK_BOOT_US;
+static uint64_t next_id = 1;
+// Ordered by due time, then by the order they were scheduled in
+static std::map<std::pair<int64_t, uint64_t>, std::function<void()>> pending;
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void* arg;
+    int64_t period_us;
+    uint64_t pending_id;
+    bool active;
+};
+
+static std::set<esp_timer_handle_t> timers;
+
+// Every task has a thread, but only one thread runs at a time: the one running the clock
+// hands over to a task and waits until the task blocks or returns. A blocked task is
+// resumed from the clock once what it waits for is done, or at its timeout.
+struct FakeTask {
+    std::condition_variable resumed;
+    bool running = false;
+    bool finished = false;
+    // What the task waits for while it is blocked
+    std::function<bool()> done;
+    uint64_t timeout_id = 0;
+};
+
+// Never destroyed, the threads of tasks still blocked when the process exits wait on them
+static std::mutex& baton = *new std::mutex;
+static std::condition_variable& yielded = *new std::condition_variable;
+static thread_local FakeTask* current_task;
+static std::vector<FakeTask*> blocked_tasks;
+
+// Runs the task until it blocks or returns
+static void SwitchTo(FakeTask* task) {
+    {
+        std::unique_lock<std::mutex> lock(baton);
+        task->running = true;
+        task->resumed.notify_one();
+        yielded.wait(lock, [task] { return !task->running; });
+    }
+    if (task->finished) {
+        delete task;
+    }
+}
+
+static void Resume(FakeTask* task) {
+    blocked_tasks.erase(std::find(blocked_tasks.begin(), blocked_tasks.end(), task));
+    FakeClockCancel(task->timeout_id);
+    task->done = nullptr;
+    SwitchTo(task);
+}
+
+// In the order they blocked, a resumed task may unblock others
+static void ResumeReadyTasks() {
+    for (size_t i = 0; i < blocked_tasks.size();) {
+        if (blocked_tasks[i]->done()) {
+            Resume(blocked_tasks[i]);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
+
+// On the thread of the task: hands back to the clock until done() or the timeout
+static bool Block(FakeTask* task, const std::function<bool()>& done, int64_t max_ms) {
+    if (done() || max_ms <= 0) {
+        return done();
+    }
+    task->done = done;
+    task->timeout_id = FakeClockSchedule(max_ms * 1000, [task] {
+        if (task->done) {
+            Resume(task);
+        }
+    });
+    blocked_tasks.push_back(task);
+    std::unique_lock<std::mutex> lock(baton);
+    task->running = false;
+    yielded.notify_all();
+    task->resumed.wait(lock, [task] { return task->running; });
+    return done();
+}
+
+void FakeClockReset() {
+    pending.clear();
+    // Their wake ups are gone, they stay blocked
+    blocked_tasks.clear();
+    // Their pending expiry is gone
+    for (auto* timer : timers) {
+        timer->active = false;
+    }
+    now_us = FAKE_CLOCK_BOOT_US;
+}
+
+int64_t FakeClockNow() {
+    return now_us;
+}
+
+uint64_t FakeClockSchedule(int64_t delay_us, std::function<void()> work) {
+    uint64_t id = next_id++;
+    pending.emplace(std::make_pair(now_us + (delay_us > 0 ? delay_us : 0), id), std::move(work));
+    return id;
+}
+
+void FakeClockCancel(uint64_t id) {
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+        if (it->first.second == id) {
+            pending.erase(it);
+            return;
+        }
+    }
+}
+
+bool FakeClockRunUntil(const std::function<bool()>& done, int64_t max_ms) {
+    if (current_task != nullptr) {
+        // A task waits, the clock goes on without it
+        return Block(current_task, done, max_ms);
+    }
+    int64_t deadline = now_us + max_ms * 1000;
+    ResumeReadyTasks();
+    while (!done()) {
+        auto it = pending.begin();
+        if (it == pending.end() || it->first.first > deadline) {
+            now_us = deadline;
+            return done();
+        }
+        now_us = it->first.first;
+        auto work = std::move(it->second);
+        pending.erase(it);
+        work();
+        ResumeReadyTasks();
+    }
+    return true;
+}
+
+void FakeClockRunFor(int64_t ms) {
+    FakeClockRunUntil([] { return false; }, ms);
+}
+
+// esp_timer
+
+int64_t esp_timer_get_time(void) {
+    return now_us;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    *out_handle = new esp_timer{create_args->callback, create_args->arg, 0, 0, false};
+    timers.insert(*out_handle);
+    return ESP_OK;
+}
+
+static void Arm(esp_timer_handle_t timer, int64_t delay_us) {
+    timer->active = true;
+    timer->pending_id = FakeClockSchedule(delay_us, [timer] {
+        if (timer->period_us > 0) {
+            Arm(timer, timer->period_us);
+        } else {
+            timer->active = false;
+        }
+        timer->callback(timer->arg);
+    });
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = 0;
+    Arm(timer, timeout_us);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = period;
+    Arm(timer, period);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (!timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    FakeClockCancel(timer->pending_id);
+    timer->active = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    if (timer == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timers.erase(timer);
+    delete timer;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    return timer->active;
+}
+
+// Default event loop
+
+struct esp_event_handler_instance_context {
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void* arg;
+};
+
+static std::vector<esp_event_handler_instance_context*> handlers;
+
+esp_err_t esp_event_loop_create_default(void) {
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id,
+    esp_event_handler_t event_handler, void* event_handler_arg, esp_event_handler_instance_t* instance) {
+    auto* context = new esp_event_handler_instance_context{event_base, event_id, event_handler, event_handler_arg};
+    handlers.push_back(context);
+    if (instance != nullptr) {
+        *instance = context;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_unregister(esp_event_base_t event_base, int32_t event_id,
+    esp_event_handler_instance_t instance) {
+    for (auto it = handlers.begin(); it != handlers.end(); ++it) {
+        if (*it == instance && (*it)->base == event_base && (*it)->id == event_id) {
+            handlers.erase(it);
+            delete instance;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void* event_data,
+    size_t event_data_size, TickType_t ticks_to_wait) {
+    auto* bytes = static_cast<const uint8_t*>(event_data);
+    std::vector<uint8_t> data(bytes, bytes + (bytes != nullptr ? event_data_size : 0));
+    FakeClockSchedule(0, [event_base, event_id, data]() mutable {
+        // A handler may unregister itself or others while the event is dispatched
+        auto snapshot = handlers;
+        for (auto* context : snapshot) {
+            bool registered = false;
+            for (auto* handler : handlers) {
+                registered |= handler == context;
+            }
+            if (registered && context->base == event_base && (context->id == ESP_EVENT_ANY_ID || context->id == event_id)) {
+                context->handler(context->arg, event_base, event_id, data.empty() ? nullptr : data.data());
+            }
+        }
+    });
+    return ESP_OK;
+}
+
+// FreeRTOS
+
+// Waiting forever stops after a simulated hour, a test would hang otherwise
+static int64_t TicksToMs(TickType_t ticks) {
+    return ticks == portMAX_DELAY ? 3600 * 1000 : ticks;
+}
+
+struct EventGroupDef_t {
+    EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    return new EventGroupDef_t{0};
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    group->bits |= bits;
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    EventBits_t old_bits = group->bits;
+    group->bits &= ~bits;
+    return old_bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+    BaseType_t wait_for_all, TickType_t ticks_to_wait) {
+    auto satisfied = [&] {
+        return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    };
+    bool done = FakeClockRunUntil(satisfied, TicksToMs(ticks_to_wait));
+    EventBits_t result = group->bits;
+    if (done && clear_on_exit) {
+        group->bits &= ~bits;
+    }
+    return result;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_depth, void* parameters,
+    UBaseType_t priority, TaskHandle_t* created_task) {
+    auto* task = new FakeTask();
+    FakeClockSchedule(0, [task, function, parameters] {
+        std::thread([task, function, parameters] {
+            current_task = task;
+            {
+                std::unique_lock<std::mutex> lock(baton);
+                task->resumed.wait(lock, [task] { return task->running; });
+            }
+            function(parameters);
+            std::lock_guard<std::mutex> lock(baton);
+            task->finished = true;
+            task->running = false;
+            yielded.notify_all();
+        }).detach();
+        SwitchTo(task);
+    });
+    if (created_task != nullptr) {
+        *created_task = nullptr;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+}
+
+void vTaskDelay(TickType_t ticks) {
+    FakeClockRunFor(ticks);
+}
+
+struct QueueDefinition {
+    UBaseType_t length;
+    UBaseType_t item_size;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    return new QueueDefinition{length, item_size, {}};
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait) {
+    if (!FakeClockRunUntil([queue] { return queue->items.size() < queue->length; }, TicksToMs(ticks_to_wait))) {
+        return errQUEUE_FULL;
+    }
+    auto* bytes = static_cast<const uint8_t*>(item);
+    queue->items.emplace_back(bytes, bytes + (bytes != nullptr ? queue->item_size : 0));
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* buffer, TickType_t ticks_to_wait) {
+    if (!FakeClockRunUntil([queue] { return !queue->items.empty(); }, TicksToMs(ticks_to_wait))) {
+        return pdFALSE;
+    }
+    if (queue->item_size > 0) {
+        memcpy(buffer, queue->items.front().data(), queue->item_size);
+    }
+    queue->items.pop_front();
+    return pdTRUE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xQueueCreate(1, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    vQueueDelete(semaphore);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return xQueueSend(semaphore, nullptr, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    return xQueueReceive(semaphore, nullptr, ticks_to_wait);
+}
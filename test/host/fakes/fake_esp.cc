@@ -0,0 +1,84 @@
+#include "esp_err.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_mac.h"
+#include "fake_system.h"
+
+#include <cstring>
+#include <random>
+
+const char* esp_err_to_name(esp_err_t code) {
+    switch (code) {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    default:
+        return "ERROR";
+    }
+}
+
+static std::mt19937 generator(1);
+static esp_reset_reason_t reset_reason = ESP_RST_POWERON;
+static int restart_count;
+
+void FakeRandomSeed(uint32_t seed) {
+    generator.seed(seed);
+}
+
+uint32_t esp_random(void) {
+    return generator();
+}
+
+void FakeSystemSetResetReason(esp_reset_reason_t reason) {
+    reset_reason = reason;
+}
+
+esp_reset_reason_t esp_reset_reason(void) {
+    return reset_reason;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    return 200 * 1024;
+}
+
+uint32_t esp_get_free_heap_size(void) {
+    return 220 * 1024;
+}
+
+void esp_restart(void) {
+    restart_count++;
+}
+
+int FakeSystemGetRestartCount() {
+    return restart_count;
+}
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type) {
+    uint8_t base[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+    memcpy(mac, base, sizeof(base));
+    mac[5] += type == ESP_MAC_WIFI_SOFTAP;
+    return ESP_OK;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+    // Reflected CRC-32 (0xEDB88320) with the pre- and post-inversion of the ROM version
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
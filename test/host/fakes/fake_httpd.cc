@@ -0,0 +1,477 @@
+#include "fake_httpd.h"
+#include "fake_clock.h"
+#include "esp_http_server.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <strings.h>
+
+#include "lwip/sockets.h"
+
+struct Session {
+    uint64_t last_used;
+};
+
+// What a handler reads and writes through its httpd_req_t
+struct Request {
+    int sockfd;
+    FakeHttpRequest request;
+    size_t content_length;
+    size_t body_read = 0;
+    std::string status = "200 OK";
+    std::string type = "text/html";
+    std::vector<std::pair<std::string, std::string>> headers;
+    bool headers_sent = false;
+};
+
+struct Handler {
+    std::string uri;
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t* r);
+    void* user_ctx;
+};
+
+struct Server {
+    httpd_config_t config;
+    std::vector<Handler> handlers;
+    std::map<httpd_err_code_t, httpd_err_handler_func_t> err_handlers;
+    std::map<int, Session> sessions;
+    uint64_t lru_counter = 0;
+};
+
+static Server* server;
+// Drops the work queued for a server that was stopped since
+static uint32_t server_generation;
+// Kept after the connection is closed, sockets are not reused
+static std::map<int, FakeHttpResponse> responses;
+
+static Request* RequestOf(httpd_req_t* r) {
+    return static_cast<Request*>(r->aux);
+}
+
+static bool IsOpen(int sockfd) {
+    return server != nullptr && server->sessions.count(sockfd) > 0;
+}
+
+static void CloseSession(int sockfd) {
+    if (server->config.close_fn != nullptr) {
+        server->config.close_fn(server, sockfd);
+    } else {
+        close(sockfd);
+    }
+    server->sessions.erase(sockfd);
+}
+
+static const char* StatusLine(httpd_err_code_t error) {
+    switch (error) {
+    case HTTPD_501_METHOD_NOT_IMPLEMENTED:
+        return "501 Method Not Implemented";
+    case HTTPD_505_VERSION_NOT_SUPPORTED:
+        return "505 Version Not Supported";
+    case HTTPD_400_BAD_REQUEST:
+        return "400 Bad Request";
+    case HTTPD_401_UNAUTHORIZED:
+        return "401 Unauthorized";
+    case HTTPD_403_FORBIDDEN:
+        return "403 Forbidden";
+    case HTTPD_404_NOT_FOUND:
+        return "404 Not Found";
+    case HTTPD_405_METHOD_NOT_ALLOWED:
+        return "405 Method Not Allowed";
+    case HTTPD_408_REQ_TIMEOUT:
+        return "408 Request Timeout";
+    case HTTPD_411_LENGTH_REQUIRED:
+        return "411 Length Required";
+    case HTTPD_414_URI_TOO_LONG:
+        return "414 URI Too Long";
+    case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE:
+        return "431 Request Header Fields Too Large";
+    default:
+        return "500 Internal Server Error";
+    }
+}
+
+static httpd_method_t ParseMethod(const std::string& method) {
+    if (method == "POST") {
+        return HTTP_POST;
+    } else if (method == "PUT") {
+        return HTTP_PUT;
+    } else if (method == "DELETE") {
+        return HTTP_DELETE;
+    } else if (method == "HEAD") {
+        return HTTP_HEAD;
+    }
+    return HTTP_GET;
+}
+
+std::string FakeHttpResponse::Header(const std::string& name) const {
+    for (auto& header : headers) {
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0) {
+            return header.second;
+        }
+    }
+    return "";
+}
+
+bool FakeHttpdIsRunning() {
+    return server != nullptr;
+}
+
+int FakeHttpdConnect() {
+    if (server == nullptr) {
+        return -1;
+    }
+    auto& sessions = server->sessions;
+    if (sessions.size() >= server->config.max_open_sockets) {
+        if (!server->config.lru_purge_enable) {
+            return -1;
+        }
+        auto lru = std::min_element(sessions.begin(), sessions.end(), [](auto& a, auto& b) {
+            return a.second.last_used < b.second.last_used;
+        });
+        CloseSession(lru->first);
+    }
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sessions[sockfd].last_used = ++server->lru_counter;
+    responses[sockfd] = FakeHttpResponse();
+    if (server->config.open_fn != nullptr && server->config.open_fn(server, sockfd) != ESP_OK) {
+        CloseSession(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+FakeHttpResponse& FakeHttpdRequest(int sockfd, const FakeHttpRequest& request) {
+    auto& response = responses[sockfd];
+    response = FakeHttpResponse();
+    if (!IsOpen(sockfd)) {
+        return response;
+    }
+    server->sessions[sockfd].last_used = ++server->lru_counter;
+
+    Request data;
+    data.sockfd = sockfd;
+    data.request = request;
+    data.content_length = request.content_length < 0 ? request.body.size() : (size_t)request.content_length;
+    httpd_req_t req = {};
+    req.handle = server;
+    req.method = ParseMethod(request.method);
+    strncpy(req.uri, request.uri.c_str(), HTTPD_MAX_URI_LEN);
+    req.content_len = data.content_length;
+    req.aux = &data;
+
+    // The path without the query selects the handler
+    size_t length = strcspn(req.uri, "?#");
+    httpd_err_code_t error = HTTPD_404_NOT_FOUND;
+    const Handler* found = nullptr;
+    for (auto& handler : server->handlers) {
+        bool matches = server->config.uri_match_fn != nullptr
+            ? server->config.uri_match_fn(handler.uri.c_str(), req.uri, length)
+            : handler.uri.length() == length && strncmp(handler.uri.c_str(), req.uri, length) == 0;
+        if (matches) {
+            if (handler.method == req.method) {
+                found = &handler;
+                break;
+            }
+            error = HTTPD_405_METHOD_NOT_ALLOWED;
+        }
+    }
+
+    esp_err_t ret;
+    if (found != nullptr) {
+        req.user_ctx = found->user_ctx;
+        ret = found->handler(&req);
+    } else if (server->err_handlers.count(error) > 0) {
+        ret = server->err_handlers[error](&req, error);
+    } else {
+        httpd_resp_send_err(&req, error, nullptr);
+        ret = ESP_FAIL;
+    }
+    if (ret != ESP_OK && IsOpen(sockfd)) {
+        CloseSession(sockfd);
+    }
+    return responses[sockfd];
+}
+
+FakeHttpResponse& FakeHttpdResponse(int sockfd) {
+    return responses[sockfd];
+}
+
+bool FakeHttpdIsOpen(int sockfd) {
+    return IsOpen(sockfd);
+}
+
+void FakeHttpdDisconnect(int sockfd) {
+    if (IsOpen(sockfd)) {
+        CloseSession(sockfd);
+    }
+}
+
+FakeHttpResponse FakeHttpdFetch(const FakeHttpRequest& request) {
+    int sockfd = FakeHttpdConnect();
+    if (sockfd < 0) {
+        return FakeHttpResponse();
+    }
+    FakeHttpResponse response = FakeHttpdRequest(sockfd, request);
+    FakeHttpdDisconnect(sockfd);
+    // Nobody else knows the socket, a benchmark would keep every response otherwise
+    responses.erase(sockfd);
+    return response;
+}
+
+// esp_http_server
+
+esp_err_t httpd_start(httpd_handle_t* handle, const httpd_config_t* config) {
+    if (server != nullptr) {
+        return ESP_ERR_HTTPD_TASK;
+    }
+    server = new Server();
+    server->config = *config;
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+    if (handle == nullptr || handle != server) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    while (!server->sessions.empty()) {
+        CloseSession(server->sessions.begin()->first);
+    }
+    auto* ctx = server->config.global_user_ctx;
+    if (ctx != nullptr) {
+        if (server->config.global_user_ctx_free_fn != nullptr) {
+            server->config.global_user_ctx_free_fn(ctx);
+        } else {
+            free(ctx);
+        }
+    }
+    delete server;
+    server = nullptr;
+    server_generation++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uri_handler) {
+    if (handle != server || uri_handler == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto& handlers = server->handlers;
+    for (auto& handler : handlers) {
+        if (handler.uri == uri_handler->uri && handler.method == uri_handler->method) {
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+    if (handlers.size() >= server->config.max_uri_handlers) {
+        return ESP_ERR_HTTPD_HANDLERS_FULL;
+    }
+    handlers.push_back({ uri_handler->uri, uri_handler->method, uri_handler->handler, uri_handler->user_ctx });
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_err_handler(httpd_handle_t handle, httpd_err_code_t error, httpd_err_handler_func_t handler_fn) {
+    if (handle != server || error >= HTTPD_ERR_CODE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    server->err_handlers[error] = handler_fn;
+    return ESP_OK;
+}
+
+// As in esp_http_server: a trailing * matches any rest, a trailing ? makes the character before it optional
+bool httpd_uri_match_wildcard(const char* uri_template, const char* uri_to_match, size_t match_upto) {
+    size_t template_length = strlen(uri_template);
+    size_t exact_length = template_length;
+    char last = template_length > 0 ? uri_template[template_length - 1] : 0;
+    char before_last = template_length > 1 ? uri_template[template_length - 2] : 0;
+    bool asterisk = last == '*' || (before_last == '*' && last == '?');
+    bool question = last == '?' || (before_last == '?' && last == '*');
+    if (exact_length < (size_t)(asterisk + question * 2)) {
+        return false;
+    }
+    exact_length -= asterisk + question * 2;
+    if (match_upto < exact_length) {
+        return false;
+    }
+    if (!question) {
+        if (!asterisk && match_upto != exact_length) {
+            return false;
+        }
+        return strncmp(uri_template, uri_to_match, exact_length) == 0;
+    }
+    if (match_upto > exact_length && uri_template[exact_length] != uri_to_match[exact_length]) {
+        return false;
+    }
+    if (strncmp(uri_template, uri_to_match, exact_length) != 0) {
+        return false;
+    }
+    return asterisk || match_upto <= exact_length + 1;
+}
+
+void* httpd_get_global_user_ctx(httpd_handle_t handle) {
+    return handle == server ? server->config.global_user_ctx : nullptr;
+}
+
+int httpd_req_to_sockfd(httpd_req_t* r) {
+    return r != nullptr ? RequestOf(r)->sockfd : -1;
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t* r, httpd_req_t** out) {
+    if (r == nullptr || out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto* copy = new httpd_req_t(*r);
+    copy->aux = new Request(*RequestOf(r));
+    *out = copy;
+    return ESP_OK;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t* r) {
+    if (r == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    delete RequestOf(r);
+    delete r;
+    return ESP_OK;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void* arg) {
+    if (handle == nullptr || handle != server) {
+        return ESP_FAIL;
+    }
+    uint32_t generation = server_generation;
+    FakeClockSchedule(0, [generation, work, arg] {
+        if (server != nullptr && server_generation == generation) {
+            work(arg);
+        }
+    });
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t* r, const char* status) {
+    RequestOf(r)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t* r, const char* type) {
+    RequestOf(r)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t* r, const char* field, const char* value) {
+    auto* request = RequestOf(r);
+    if (server != nullptr && request->headers.size() >= server->config.max_resp_headers) {
+        return ESP_ERR_HTTPD_RESP_HDR;
+    }
+    request->headers.emplace_back(field, value);
+    return ESP_OK;
+}
+
+static FakeHttpResponse& SendHeaders(Request* request, bool chunked) {
+    auto& response = responses[request->sockfd];
+    if (!request->headers_sent) {
+        request->headers_sent = true;
+        response.status = atoi(request->status.c_str());
+        response.headers.emplace_back("Content-Type", request->type);
+        response.headers.insert(response.headers.end(), request->headers.begin(), request->headers.end());
+        response.chunked = chunked;
+    }
+    return response;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t* r, const char* buf, ssize_t buf_len) {
+    auto* request = RequestOf(r);
+    if (!IsOpen(request->sockfd)) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    if (buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = buf != nullptr ? strlen(buf) : 0;
+    }
+    auto& response = SendHeaders(request, false);
+    response.headers.emplace_back("Content-Length", std::to_string(buf_len));
+    response.body.assign(buf != nullptr ? buf : "", buf != nullptr ? buf_len : 0);
+    response.complete = true;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t* r, const char* buf, ssize_t buf_len) {
+    auto* request = RequestOf(r);
+    if (!IsOpen(request->sockfd)) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    if (buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = buf != nullptr ? strlen(buf) : 0;
+    }
+    auto& response = SendHeaders(request, true);
+    if (buf == nullptr || buf_len == 0) {
+        response.complete = true;
+    } else {
+        response.body.append(buf, buf_len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t* req, httpd_err_code_t error, const char* msg) {
+    const char* status = StatusLine(error);
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "text/html");
+    return httpd_resp_send(req, msg != nullptr ? msg : status, HTTPD_RESP_USE_STRLEN);
+}
+
+int httpd_req_recv(httpd_req_t* r, char* buf, size_t buf_len) {
+    auto* request = RequestOf(r);
+    size_t remaining = request->content_length - request->body_read;
+    if (remaining == 0) {
+        return 0;
+    }
+    auto& body = request->request.body;
+    if (request->body_read >= body.size()) {
+        // The client sent less than it announced
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    }
+    size_t length = std::min({ buf_len, remaining, body.size() - request->body_read, request->request.segment_size });
+    memcpy(buf, body.data() + request->body_read, length);
+    request->body_read += length;
+    return length;
+}
+
+static esp_err_t CopyValue(const std::string& value, char* buf, size_t size) {
+    if (size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t length = std::min(value.length(), size - 1);
+    memcpy(buf, value.data(), length);
+    buf[length] = '\0';
+    return length < value.length() ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* r, const char* field, char* val, size_t val_size) {
+    for (auto& header : RequestOf(r)->request.headers) {
+        if (strcasecmp(header.first.c_str(), field) == 0) {
+            return CopyValue(header.second, val, val_size);
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t* r, char* buf, size_t buf_len) {
+    const char* query = strchr(r->uri, '?');
+    if (query == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return CopyValue(query + 1, buf, buf_len);
+}
+
+esp_err_t httpd_query_key_value(const char* qry, const char* key, char* val, size_t val_size) {
+    size_t key_length = strlen(key);
+    while (*qry != '\0') {
+        size_t length = strcspn(qry, "&");
+        if (length > key_length && strncmp(qry, key, key_length) == 0 && qry[key_length] == '=') {
+            return CopyValue(std::string(qry + key_length + 1, length - key_length - 1), val, val_size);
+        }
+        qry += length;
+        qry += *qry == '&';
+    }
+    return ESP_ERR_NOT_FOUND;
+}
@@ -0,0 +1,12 @@
+#include "mbedtls/pkcs5.h"
+
+#include <openssl/evp.h>
+
+int mbedtls_pkcs5_pbkdf2_hmac_ext(mbedtls_md_type_t md_type, const unsigned char* password, size_t plen,
+    const unsigned char* salt, size_t slen, unsigned int iteration_count, uint32_t key_length, unsigned char* output) {
+    if (md_type != MBEDTLS_MD_SHA1) {
+        return -1;
+    }
+    int ok = PKCS5_PBKDF2_HMAC((const char*)password, plen, salt, slen, iteration_count, EVP_sha1(), key_length, output);
+    return ok == 1 ? 0 : -1;
+}
@@ -0,0 +1,204 @@
+#include "nvs.h"
+#include "fake_nvs.h"
+
+#include <cstring>
+#include <map>
+
+// Values are kept as bytes with their type, like the items of an NVS page
+enum class ItemType { U8, I32, U32, Str, Blob };
+
+struct Item {
+    ItemType type;
+    std::vector<uint8_t> data;
+};
+
+struct Handle {
+    std::string name;
+    nvs_open_mode_t mode;
+};
+
+static std::map<std::string, std::map<std::string, Item>> namespaces;
+static std::map<nvs_handle_t, Handle> handles;
+static nvs_handle_t next_handle = 1;
+static esp_err_t write_error = ESP_OK;
+static int write_count = 0;
+
+void FakeNvsReset() {
+    namespaces.clear();
+    handles.clear();
+    write_error = ESP_OK;
+    write_count = 0;
+}
+
+void FakeNvsFailWrites(esp_err_t error) {
+    write_error = error;
+}
+
+int FakeNvsWriteCount() {
+    return write_count;
+}
+
+bool FakeNvsGet(const std::string& name, const std::string& key, std::vector<uint8_t>& value) {
+    auto ns = namespaces.find(name);
+    if (ns == namespaces.end() || ns->second.count(key) == 0) {
+        return false;
+    }
+    value = ns->second[key].data;
+    return true;
+}
+
+bool FakeNvsContains(const std::string& name, const std::string& key) {
+    std::vector<uint8_t> value;
+    return FakeNvsGet(name, key, value);
+}
+
+static esp_err_t Set(nvs_handle_t handle, const char* key, ItemType type, const void* data, size_t length) {
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (it->second.mode != NVS_READWRITE) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    if (write_error != ESP_OK) {
+        return write_error;
+    }
+    auto* bytes = static_cast<const uint8_t*>(data);
+    namespaces[it->second.name][key] = Item{type, std::vector<uint8_t>(bytes, bytes + length)};
+    write_count++;
+    return ESP_OK;
+}
+
+static esp_err_t Get(nvs_handle_t handle, const char* key, ItemType type, const Item** item) {
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    auto& items = namespaces[it->second.name];
+    auto found = items.find(key);
+    if (found == items.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (found->second.type != type) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+    *item = &found->second;
+    return ESP_OK;
+}
+
+template <typename T>
+static esp_err_t GetValue(nvs_handle_t handle, const char* key, ItemType type, T* out_value) {
+    const Item* item;
+    esp_err_t ret = Get(handle, key, type, &item);
+    if (ret == ESP_OK) {
+        memcpy(out_value, item->data.data(), sizeof(T));
+    }
+    return ret;
+}
+
+static esp_err_t GetBytes(nvs_handle_t handle, const char* key, ItemType type, void* out_value, size_t* length) {
+    const Item* item;
+    esp_err_t ret = Get(handle, key, type, &item);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (out_value == nullptr) {
+        *length = item->data.size();
+        return ESP_OK;
+    }
+    if (*length < item->data.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, item->data.data(), item->data.size());
+    *length = item->data.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle) {
+    if (open_mode == NVS_READONLY && namespaces.count(name) == 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    namespaces[name];
+    *out_handle = next_handle++;
+    handles[*out_handle] = Handle{name, open_mode};
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    handles.erase(handle);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    if (handles.count(handle) == 0) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    return write_error;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (it->second.mode != NVS_READWRITE) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    return namespaces[it->second.name].erase(key) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_find_key(nvs_handle_t handle, const char* key, nvs_type_t* out_type) {
+    static const nvs_type_t types[] = { NVS_TYPE_U8, NVS_TYPE_I32, NVS_TYPE_U32, NVS_TYPE_STR, NVS_TYPE_BLOB };
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    auto& items = namespaces[it->second.name];
+    auto found = items.find(key);
+    if (found == items.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_type != nullptr) {
+        *out_type = types[(int)found->second.type];
+    }
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char* key, uint8_t value) {
+    return Set(handle, key, ItemType::U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char* key, int32_t value) {
+    return Set(handle, key, ItemType::I32, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value) {
+    return Set(handle, key, ItemType::U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value) {
+    return Set(handle, key, ItemType::Str, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length) {
+    return Set(handle, key, ItemType::Blob, value, length);
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char* key, uint8_t* out_value) {
+    return GetValue(handle, key, ItemType::U8, out_value);
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char* key, int32_t* out_value) {
+    return GetValue(handle, key, ItemType::I32, out_value);
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* out_value) {
+    return GetValue(handle, key, ItemType::U32, out_value);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out_value, size_t* length) {
+    return GetBytes(handle, key, ItemType::Str, out_value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length) {
+    return GetBytes(handle, key, ItemType::Blob, out_value, length);
+}
@@ -0,0 +1,167 @@
+#include "fake_sockets.h"
+#include "fake_clock.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+
+#include "lwip/sockets.h"
+
+// Like lwIP, descriptors start above the ones of the VFS
+#define FIRST_SOCKET 54
+// The client on the AP network, the first address the DHCP server of the AP hands out
+#define CLIENT_ADDRESS 0x0204a8c0
+
+struct Datagram {
+    uint16_t from_port;
+    std::vector<uint8_t> data;
+};
+
+struct Socket {
+    int type;
+    uint16_t port = 0;
+    int64_t receive_timeout_ms = 0;
+    std::deque<Datagram> received;
+};
+
+static std::map<int, Socket> sockets;
+static int next_socket = FIRST_SOCKET;
+static std::map<uint16_t, std::vector<std::vector<uint8_t>>> replies;
+
+void FakeSocketsReset() {
+    sockets.clear();
+    replies.clear();
+}
+
+int FakeSocketsOpenCount() {
+    return sockets.size();
+}
+
+static Socket* FindBound(uint16_t port) {
+    for (auto& entry : sockets) {
+        if (entry.second.type == SOCK_DGRAM && entry.second.port == port) {
+            return &entry.second;
+        }
+    }
+    return nullptr;
+}
+
+bool FakeSocketsIsBound(uint16_t port) {
+    return FindBound(port) != nullptr;
+}
+
+bool FakeSocketsSend(uint16_t port, const std::vector<uint8_t>& datagram, uint16_t from_port) {
+    auto* socket = FindBound(port);
+    if (socket == nullptr) {
+        return false;
+    }
+    socket->received.push_back({ from_port, datagram });
+    return true;
+}
+
+std::vector<std::vector<uint8_t>> FakeSocketsReceive(uint16_t from_port) {
+    auto datagrams = std::move(replies[from_port]);
+    replies.erase(from_port);
+    return datagrams;
+}
+
+static Socket* Find(int s) {
+    auto it = sockets.find(s);
+    if (it == sockets.end()) {
+        errno = EBADF;
+        return nullptr;
+    }
+    return &it->second;
+}
+
+int lwip_socket(int domain, int type, int protocol) {
+    if (domain != AF_INET || (type != SOCK_DGRAM && type != SOCK_STREAM)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int s = next_socket++;
+    sockets[s].type = type;
+    return s;
+}
+
+int lwip_bind(int s, const struct sockaddr* name, socklen_t namelen) {
+    auto* socket = Find(s);
+    if (socket == nullptr) {
+        return -1;
+    }
+    auto* address = reinterpret_cast<const struct sockaddr_in*>(name);
+    uint16_t port = ntohs(address->sin_port);
+    if (FindBound(port) != nullptr) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    socket->port = port;
+    return 0;
+}
+
+int lwip_setsockopt(int s, int level, int optname, const void* optval, socklen_t optlen) {
+    auto* socket = Find(s);
+    if (socket == nullptr) {
+        return -1;
+    }
+    if (level == SOL_SOCKET && optname == SO_RCVTIMEO) {
+        auto* timeout = static_cast<const struct timeval*>(optval);
+        socket->receive_timeout_ms = timeout->tv_sec * 1000LL + timeout->tv_usec / 1000;
+    }
+    return 0;
+}
+
+ssize_t lwip_recvfrom(int s, void* mem, size_t len, int flags, struct sockaddr* from, socklen_t* fromlen) {
+    if (Find(s) == nullptr) {
+        return -1;
+    }
+    // Without a timeout it waits as long as an event group does for portMAX_DELAY
+    int64_t timeout_ms = sockets[s].receive_timeout_ms > 0 ? sockets[s].receive_timeout_ms : 3600 * 1000;
+    // The socket may be closed while a task waits on it
+    bool ready = FakeClockRunUntil([s] {
+        auto it = sockets.find(s);
+        return it == sockets.end() || !it->second.received.empty();
+    }, timeout_ms);
+    auto* socket = Find(s);
+    if (socket == nullptr) {
+        return -1;
+    }
+    if (!ready) {
+        errno = EAGAIN;
+        return -1;
+    }
+    auto datagram = std::move(socket->received.front());
+    socket->received.pop_front();
+    size_t length = std::min(len, datagram.data.size());
+    memcpy(mem, datagram.data.data(), length);
+    if (from != nullptr && fromlen != nullptr && *fromlen >= sizeof(struct sockaddr_in)) {
+        auto* address = reinterpret_cast<struct sockaddr_in*>(from);
+        memset(address, 0, sizeof(*address));
+        address->sin_len = sizeof(*address);
+        address->sin_family = AF_INET;
+        address->sin_port = htons(datagram.from_port);
+        address->sin_addr.s_addr = CLIENT_ADDRESS;
+        *fromlen = sizeof(*address);
+    }
+    return length;
+}
+
+ssize_t lwip_sendto(int s, const void* dataptr, size_t size, int flags, const struct sockaddr* to, socklen_t tolen) {
+    if (Find(s) == nullptr) {
+        return -1;
+    }
+    auto* address = reinterpret_cast<const struct sockaddr_in*>(to);
+    auto* bytes = static_cast<const uint8_t*>(dataptr);
+    replies[ntohs(address->sin_port)].emplace_back(bytes, bytes + size);
+    return size;
+}
+
+int lwip_close(int s) {
+    if (Find(s) == nullptr) {
+        return -1;
+    }
+    sockets.erase(s);
+    return 0;
+}
@@ -0,0 +1,636 @@
+#include "fake_wifi.h"
+#include "fake_clock.h"
+#include "wifi_psk.h"
+#include "lwip/etharp.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+enum class Link { Idle, Connecting, Associated };
+
+struct Driver {
+    bool initialized = false;
+    bool started = false;
+    wifi_mode_t mode = WIFI_MODE_NULL;
+    wifi_config_t sta = {};
+    wifi_ps_type_t ps = WIFI_PS_MIN_MODEM;
+    Link link = Link::Idle;
+    int ap_index = -1;
+    bool scanning = false;
+    uint64_t scan_id = 0;
+    std::vector<wifi_ap_record_t> scan_results;
+};
+
+struct esp_netif_obj {
+    std::string if_key;
+    esp_netif_ip_info_t ip_info = {};
+    esp_ip4_addr_t dns = {};
+    bool dhcpc_running = true;
+    bool dhcps_running = false;
+    struct ArpEntry {
+        ip4_addr_t ip;
+        bool stable;
+    };
+    std::vector<ArpEntry> arp_cache;
+};
+
+static std::vector<FakeAp> aps;
+static FakeWifiTiming timing;
+static FakeWifiCounters counters;
+static Driver driver;
+// Bumped to drop the pending steps of an attempt or a lease, survives esp_wifi_deinit()
+static uint32_t generation;
+static std::vector<esp_netif_t*> netifs;
+static std::mt19937 radio_random(1);
+
+void FakeWifiReset(uint32_t seed) {
+    aps.clear();
+    timing = FakeWifiTiming();
+    counters = FakeWifiCounters();
+    driver = Driver();
+    for (auto* netif : netifs) {
+        delete netif;
+    }
+    netifs.clear();
+    generation++;
+    radio_random.seed(seed);
+}
+
+FakeAp& FakeWifiAddAp(const FakeAp& ap) {
+    aps.push_back(ap);
+    return aps.back();
+}
+
+std::vector<FakeAp>& FakeWifiAps() {
+    return aps;
+}
+
+FakeWifiTiming& FakeWifiGetTiming() {
+    return timing;
+}
+
+const FakeWifiCounters& FakeWifiGetCounters() {
+    return counters;
+}
+
+bool FakeWifiIsAssociated() {
+    return driver.link == Link::Associated;
+}
+
+int FakeWifiGetAssociatedAp() {
+    return driver.link == Link::Associated ? driver.ap_index : -1;
+}
+
+const wifi_config_t& FakeWifiGetStaConfig() {
+    return driver.sta;
+}
+
+wifi_mode_t FakeWifiGetMode() {
+    return driver.mode;
+}
+
+wifi_ps_type_t FakeWifiGetPowerSave() {
+    return driver.ps;
+}
+
+static bool IsHost(const FakeAp& ap, uint32_t address) {
+    return std::any_of(ap.hosts.begin(), ap.hosts.end(), [address](const esp_ip4_addr_t& host) {
+        return host.addr == address;
+    });
+}
+
+esp_ip4_addr_t FakeWifiGetLeaseAddress(int index) {
+    esp_ip4_addr_t address;
+    int host = 100;
+    do {
+        IP4_ADDR(&address, 10, 0, index, host++);
+    } while (IsHost(aps[index], address.addr));
+    return address;
+}
+
+static int8_t Rssi(const FakeAp& ap) {
+    return ap.rssi_over_time ? ap.rssi_over_time(FakeClockNow() / 1000) : ap.rssi;
+}
+
+static wifi_ap_record_t Record(const FakeAp& ap) {
+    wifi_ap_record_t record = {};
+    memcpy(record.bssid, ap.bssid, sizeof(record.bssid));
+    strncpy((char*)record.ssid, ap.ssid.c_str(), sizeof(record.ssid) - 1);
+    record.primary = ap.channel;
+    record.rssi = Rssi(ap);
+    record.authmode = ap.authmode;
+    return record;
+}
+
+static esp_netif_t* StaNetif() {
+    return esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+}
+
+static void PostDisconnected(uint16_t reason) {
+    wifi_event_sta_disconnected_t event = {};
+    size_t length = strnlen((const char*)driver.sta.sta.ssid, sizeof(event.ssid));
+    memcpy(event.ssid, driver.sta.sta.ssid, length);
+    event.ssid_len = length;
+    event.reason = reason;
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event, sizeof(event), 0);
+}
+
+static void EndLink(uint16_t reason) {
+    generation++;
+    driver.link = Link::Idle;
+    driver.ap_index = -1;
+    auto* netif = StaNetif();
+    if (netif != nullptr) {
+        netif->arp_cache.clear();
+        if (netif->dhcpc_running) {
+            netif->ip_info = {};
+        }
+    }
+    PostDisconnected(reason);
+}
+
+void FakeWifiDropLink(uint16_t reason) {
+    if (driver.link == Link::Associated) {
+        EndLink(reason);
+    }
+}
+
+static void PostGotIp(esp_netif_t* netif) {
+    ip_event_got_ip_t event = {};
+    event.esp_netif = netif;
+    event.ip_info = netif->ip_info;
+    event.ip_changed = true;
+    esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &event, sizeof(event), 0);
+}
+
+static void StartIp(int index) {
+    auto* netif = StaNetif();
+    if (netif == nullptr) {
+        return;
+    }
+    if (!netif->dhcpc_running) {
+        // A static address is reported as soon as the link is up
+        if (netif->ip_info.ip.addr != 0) {
+            PostGotIp(netif);
+        }
+        return;
+    }
+    counters.dhcp_requests++;
+    uint32_t attempt = generation;
+    FakeClockSchedule(aps[index].dhcp_ms * 1000LL, [netif, index, attempt] {
+        if (generation != attempt || !netif->dhcpc_running) {
+            return;
+        }
+        netif->ip_info.ip = FakeWifiGetLeaseAddress(index);
+        IP4_ADDR(&netif->ip_info.gw, 10, 0, index, 1);
+        IP4_ADDR(&netif->ip_info.netmask, 255, 255, 255, 0);
+        netif->dns = netif->ip_info.gw;
+        PostGotIp(netif);
+    });
+}
+
+// The AP the driver would pick for the station config, and how many channels it scans for it
+static int FindAp(int* channels_scanned) {
+    auto& sta = driver.sta.sta;
+    auto matches = [&](const FakeAp& ap) {
+        return ap.present && ap.ssid == (const char*)sta.ssid &&
+            (!sta.bssid_set || memcmp(ap.bssid, sta.bssid, sizeof(ap.bssid)) == 0);
+    };
+    if (sta.channel != 0) {
+        *channels_scanned = 1;
+    } else {
+        *channels_scanned = timing.channel_count;
+    }
+    int best = -1;
+    for (int channel = 1; channel <= timing.channel_count; channel++) {
+        if (sta.channel != 0 && channel != sta.channel) {
+            continue;
+        }
+        for (size_t i = 0; i < aps.size(); i++) {
+            if (aps[i].channel == channel && matches(aps[i]) && (best < 0 || Rssi(aps[i]) > Rssi(aps[best]))) {
+                best = i;
+            }
+        }
+        // A fast scan stops on the first channel with a match
+        if (best >= 0 && sta.channel == 0 && sta.scan_method == WIFI_FAST_SCAN) {
+            *channels_scanned = channel;
+            break;
+        }
+    }
+    return best;
+}
+
+static bool KeyMatches(const FakeAp& ap, const char* password) {
+    if (ap.authmode == WIFI_AUTH_OPEN) {
+        return true;
+    }
+    if (strlen(password) == 64) {
+        return WifiDerivePsk(ap.ssid, ap.password) == password;
+    }
+    return ap.password == password;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t* config) {
+    driver.initialized = true;
+    driver.ps = WIFI_PS_MIN_MODEM;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_deinit(void) {
+    if (driver.started) {
+        return ESP_ERR_WIFI_NOT_STOPPED;
+    }
+    driver = Driver();
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    driver.mode = mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mode(wifi_mode_t* mode) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    *mode = driver.mode;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    if (!driver.started) {
+        driver.started = true;
+        esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, nullptr, 0, 0);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    if (driver.link != Link::Idle) {
+        EndLink(WIFI_REASON_ASSOC_LEAVE);
+    }
+    esp_wifi_scan_stop();
+    if (driver.started) {
+        driver.started = false;
+        esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_STOP, nullptr, 0, 0);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    if (!driver.started) {
+        return ESP_ERR_WIFI_NOT_STARTED;
+    }
+    if (driver.link != Link::Idle) {
+        return ESP_ERR_WIFI_CONN;
+    }
+    // Connecting takes the radio, a scan in progress is abandoned
+    esp_wifi_scan_stop();
+    driver.link = Link::Connecting;
+    generation++;
+    counters.connects++;
+
+    int channels_scanned;
+    int index = FindAp(&channels_scanned);
+    int64_t scan_us = (int64_t)channels_scanned * timing.channel_scan_ms * 1000;
+    uint32_t attempt = generation;
+    auto unless_cancelled = [attempt](std::function<void()> step) {
+        return [attempt, step] {
+            if (generation == attempt) {
+                step();
+            }
+        };
+    };
+    if (index < 0) {
+        FakeClockSchedule(scan_us, unless_cancelled([] { EndLink(WIFI_REASON_NO_AP_FOUND); }));
+        return ESP_OK;
+    }
+
+    auto& ap = aps[index];
+    const char* password = (const char*)driver.sta.sta.password;
+    int64_t key_us = 0;
+    if (ap.authmode != WIFI_AUTH_OPEN && strlen(password) != 64) {
+        counters.pbkdf2_runs++;
+        key_us = timing.pbkdf2_ms * 1000LL;
+    }
+    if (!KeyMatches(ap, password)) {
+        FakeClockSchedule(scan_us + key_us + timing.handshake_timeout_ms * 1000LL,
+            unless_cancelled([] { EndLink(WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT); }));
+        return ESP_OK;
+    }
+    if (std::uniform_real_distribution<double>(0, 1)(radio_random) < ap.failure_probability) {
+        FakeClockSchedule(scan_us + key_us + timing.connect_ms * 1000LL,
+            unless_cancelled([] { EndLink(WIFI_REASON_CONNECTION_FAIL); }));
+        return ESP_OK;
+    }
+    FakeClockSchedule(scan_us + key_us + timing.connect_ms * 1000LL, unless_cancelled([index] {
+        driver.link = Link::Associated;
+        driver.ap_index = index;
+        auto& ap = aps[index];
+        wifi_event_sta_connected_t event = {};
+        memcpy(event.ssid, ap.ssid.data(), std::min(ap.ssid.length(), sizeof(event.ssid)));
+        event.ssid_len = ap.ssid.length();
+        memcpy(event.bssid, ap.bssid, sizeof(event.bssid));
+        event.channel = ap.channel;
+        event.authmode = ap.authmode;
+        esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &event, sizeof(event), 0);
+        StartIp(index);
+    }));
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    if (driver.link != Link::Idle) {
+        EndLink(WIFI_REASON_ASSOC_LEAVE);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t* conf) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    if (interface == WIFI_IF_STA) {
+        driver.sta = *conf;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(wifi_interface_t interface, wifi_config_t* conf) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    *conf = driver.sta;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t* config, bool block) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    if (!driver.started) {
+        return ESP_ERR_WIFI_NOT_STARTED;
+    }
+    if (driver.scanning || driver.link == Link::Connecting) {
+        return ESP_ERR_WIFI_STATE;
+    }
+    driver.scanning = true;
+    counters.scans++;
+    driver.scan_id = FakeClockSchedule((int64_t)timing.channel_count * timing.channel_scan_ms * 1000, [] {
+        if (!driver.scanning) {
+            return;
+        }
+        driver.scanning = false;
+        driver.scan_results.clear();
+        for (auto& ap : aps) {
+            if (ap.present) {
+                driver.scan_results.push_back(Record(ap));
+            }
+        }
+        std::sort(driver.scan_results.begin(), driver.scan_results.end(),
+            [](const wifi_ap_record_t& a, const wifi_ap_record_t& b) { return a.rssi > b.rssi; });
+        wifi_event_sta_scan_done_t event = {};
+        event.number = driver.scan_results.size();
+        esp_event_post(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, &event, sizeof(event), 0);
+    });
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_stop(void) {
+    if (driver.scanning) {
+        driver.scanning = false;
+        FakeClockCancel(driver.scan_id);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t* number) {
+    *number = driver.scan_results.size();
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t* number, wifi_ap_record_t* ap_records) {
+    // Like the driver, reading the records frees them
+    *number = std::min<size_t>(*number, driver.scan_results.size());
+    std::copy(driver.scan_results.begin(), driver.scan_results.begin() + *number, ap_records);
+    driver.scan_results.clear();
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_clear_ap_list(void) {
+    driver.scan_results.clear();
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t* ap_info) {
+    if (driver.link != Link::Associated) {
+        return ESP_ERR_WIFI_NOT_CONNECT;
+    }
+    *ap_info = Record(aps[driver.ap_index]);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    driver.ps = type;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_ps(wifi_ps_type_t* type) {
+    if (!driver.initialized) {
+        return ESP_ERR_WIFI_NOT_INIT;
+    }
+    *type = driver.ps;
+    return ESP_OK;
+}
+
+// esp_netif
+
+esp_err_t esp_netif_init(void) {
+    return ESP_OK;
+}
+
+esp_netif_t* esp_netif_create_default_wifi_sta(void) {
+    counters.netifs_created++;
+    auto* netif = new esp_netif_obj();
+    netif->if_key = "WIFI_STA_DEF";
+    netifs.push_back(netif);
+    return netif;
+}
+
+esp_netif_t* esp_netif_create_default_wifi_ap(void) {
+    counters.netifs_created++;
+    auto* netif = new esp_netif_obj();
+    netif->if_key = "WIFI_AP_DEF";
+    netif->dhcpc_running = false;
+    netif->dhcps_running = true;
+    netifs.push_back(netif);
+    return netif;
+}
+
+void esp_netif_destroy_default_wifi(void* esp_netif) {
+    auto it = std::find(netifs.begin(), netifs.end(), esp_netif);
+    if (it != netifs.end()) {
+        delete *it;
+        netifs.erase(it);
+    }
+}
+
+esp_netif_t* esp_netif_get_handle_from_ifkey(const char* if_key) {
+    for (auto* netif : netifs) {
+        if (netif->if_key == if_key) {
+            return netif;
+        }
+    }
+    return nullptr;
+}
+
+esp_err_t esp_netif_dhcpc_start(esp_netif_t* esp_netif) {
+    if (esp_netif->dhcpc_running) {
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED;
+    }
+    esp_netif->dhcpc_running = true;
+    esp_netif->ip_info = {};
+    if (driver.link == Link::Associated) {
+        StartIp(driver.ap_index);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t* esp_netif) {
+    if (!esp_netif->dhcpc_running) {
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED;
+    }
+    esp_netif->dhcpc_running = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcps_start(esp_netif_t* esp_netif) {
+    if (esp_netif->dhcps_running) {
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED;
+    }
+    esp_netif->dhcps_running = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_dhcps_stop(esp_netif_t* esp_netif) {
+    if (!esp_netif->dhcps_running) {
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED;
+    }
+    esp_netif->dhcps_running = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_ip_info(esp_netif_t* esp_netif, const esp_netif_ip_info_t* ip_info) {
+    if (esp_netif->dhcpc_running || esp_netif->dhcps_running) {
+        return ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED;
+    }
+    esp_netif->ip_info = *ip_info;
+    // Like esp_netif, a static address set while the link is up is reported right away
+    if (ip_info->ip.addr != 0 && driver.link == Link::Associated && esp_netif == StaNetif()) {
+        PostGotIp(esp_netif);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t* esp_netif, esp_netif_ip_info_t* ip_info) {
+    *ip_info = esp_netif->ip_info;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_set_dns_info(esp_netif_t* esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t* dns) {
+    if (type == ESP_NETIF_DNS_MAIN) {
+        esp_netif->dns = dns->ip.u_addr.ip4;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_dns_info(esp_netif_t* esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t* dns) {
+    *dns = {};
+    dns->ip.type = ESP_IPADDR_TYPE_V4;
+    if (type == ESP_NETIF_DNS_MAIN) {
+        dns->ip.u_addr.ip4 = esp_netif->dns;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_tcpip_exec(esp_netif_callback_fn fn, void* ctx) {
+    return fn(ctx);
+}
+
+void* esp_netif_get_netif_impl(esp_netif_t* esp_netif) {
+    return esp_netif;
+}
+
+// lwIP
+
+err_t etharp_query(struct netif* netif, const ip4_addr_t* ipaddr, struct pbuf* q) {
+    if (driver.link != Link::Associated) {
+        return ERR_IF;
+    }
+    if (q != nullptr || ipaddr->addr == 0) {
+        return ERR_ARG;
+    }
+    auto* esp_netif = reinterpret_cast<esp_netif_t*>(netif);
+    auto& cache = esp_netif->arp_cache;
+    if (std::none_of(cache.begin(), cache.end(), [ipaddr](auto& entry) { return entry.ip.addr == ipaddr->addr; })) {
+        cache.push_back({ *ipaddr, false });
+    }
+    // A host does not answer a sender that claims its own address
+    bool martian = esp_netif->ip_info.ip.addr == ipaddr->addr;
+    if (IsHost(aps[driver.ap_index], ipaddr->addr) && !martian) {
+        uint32_t attempt = generation;
+        ip4_addr_t address = *ipaddr;
+        FakeClockSchedule(5000, [esp_netif, address, attempt] {
+            if (generation != attempt) {
+                return;
+            }
+            for (auto& entry : esp_netif->arp_cache) {
+                if (entry.ip.addr == address.addr) {
+                    entry.stable = true;
+                }
+            }
+        });
+    }
+    return ERR_OK;
+}
+
+ssize_t etharp_find_addr(struct netif* netif, const ip4_addr_t* ipaddr, struct eth_addr** eth_ret, const ip4_addr_t** ip_ret) {
+    static struct eth_addr eth = { { 0x02, 0, 0, 0, 0, 0xee } };
+    auto& cache = reinterpret_cast<esp_netif_t*>(netif)->arp_cache;
+    for (size_t i = 0; i < cache.size(); i++) {
+        if (cache[i].stable && cache[i].ip.addr == ipaddr->addr) {
+            *eth_ret = &eth;
+            *ip_ret = &cache[i].ip;
+            return i;
+        }
+    }
+    return -1;
+}
+
+char* esp_ip4addr_ntoa(const esp_ip4_addr_t* addr, char* buf, int buflen) {
+    snprintf(buf, buflen, IPSTR, IP2STR(addr));
+    return buf;
+}
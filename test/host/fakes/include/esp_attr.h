@@ -0,0 +1,5 @@
+#pragma once
+
+// RTC memory is ordinary memory on the host, it survives as long as the process
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
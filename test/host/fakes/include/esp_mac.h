@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+typedef enum {
+    ESP_MAC_WIFI_STA,
+    ESP_MAC_WIFI_SOFTAP,
+} esp_mac_type_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 02:00:00:00:00:01 for the station, one more for the AP
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type);
+
+#ifdef __cplusplus
+}
+#endif
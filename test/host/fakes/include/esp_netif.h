@@ -0,0 +1,71 @@
+#pragma once
+
+// Host stand-in for esp_netif with the Wi-Fi interfaces of the simulated driver
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_netif_ip_addr.h"
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef enum {
+    ESP_NETIF_DNS_MAIN = 0,
+    ESP_NETIF_DNS_BACKUP,
+    ESP_NETIF_DNS_FALLBACK,
+    ESP_NETIF_DNS_MAX
+} esp_netif_dns_type_t;
+
+typedef struct {
+    esp_ip_addr_t ip;
+} esp_netif_dns_info_t;
+
+typedef enum {
+    IP_EVENT_STA_GOT_IP,
+    IP_EVENT_STA_LOST_IP,
+} ip_event_t;
+
+typedef esp_err_t (*esp_netif_callback_fn)(void* ctx);
+
+typedef struct {
+    esp_netif_t* esp_netif;
+    esp_netif_ip_info_t ip_info;
+    bool ip_changed;
+} ip_event_got_ip_t;
+
+#define ESP_ERR_ESP_NETIF_BASE 0x5000
+#define ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED (ESP_ERR_ESP_NETIF_BASE + 0x05)
+#define ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED (ESP_ERR_ESP_NETIF_BASE + 0x06)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern esp_event_base_t const IP_EVENT;
+
+esp_err_t esp_netif_init(void);
+esp_netif_t* esp_netif_create_default_wifi_sta(void);
+esp_netif_t* esp_netif_create_default_wifi_ap(void);
+void esp_netif_destroy_default_wifi(void* esp_netif);
+esp_netif_t* esp_netif_get_handle_from_ifkey(const char* if_key);
+esp_err_t esp_netif_dhcpc_start(esp_netif_t* esp_netif);
+esp_err_t esp_netif_dhcpc_stop(esp_netif_t* esp_netif);
+esp_err_t esp_netif_dhcps_start(esp_netif_t* esp_netif);
+esp_err_t esp_netif_dhcps_stop(esp_netif_t* esp_netif);
+esp_err_t esp_netif_set_ip_info(esp_netif_t* esp_netif, const esp_netif_ip_info_t* ip_info);
+esp_err_t esp_netif_get_ip_info(esp_netif_t* esp_netif, esp_netif_ip_info_t* ip_info);
+esp_err_t esp_netif_set_dns_info(esp_netif_t* esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t* dns);
+esp_err_t esp_netif_get_dns_info(esp_netif_t* esp_netif, esp_netif_dns_type_t type, esp_netif_dns_info_t* dns);
+// Runs fn at once, there is no TCP/IP task
+esp_err_t esp_netif_tcpip_exec(esp_netif_callback_fn fn, void* ctx);
+void* esp_netif_get_netif_impl(esp_netif_t* esp_netif);
+char* esp_ip4addr_ntoa(const esp_ip4_addr_t* addr, char* buf, int buflen);
+
+#ifdef __cplusplus
+}
+#endif
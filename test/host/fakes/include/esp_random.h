@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stand-in for esp_random, a seeded generator so that runs are repeatable
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t esp_random(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+// Host stand-in for the ROM CRC functions
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Same result as the ROM function and zlib's crc32()
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum {
+    ESP_RST_UNKNOWN,
+    ESP_RST_POWERON,
+    ESP_RST_EXT,
+    ESP_RST_SW,
+    ESP_RST_PANIC,
+    ESP_RST_INT_WDT,
+    ESP_RST_TASK_WDT,
+    ESP_RST_WDT,
+    ESP_RST_DEEPSLEEP,
+    ESP_RST_BROWNOUT,
+    ESP_RST_SDIO,
+} esp_reset_reason_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ESP_RST_POWERON unless changed with FakeSystemSetResetReason()
+esp_reset_reason_t esp_reset_reason(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+uint32_t esp_get_free_heap_size(void);
+// Counted for FakeSystemGetRestartCount(), the host keeps running
+void esp_restart(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+// Virtual clock of the host build. esp_timer, the event loop, FreeRTOS tasks and
+// the simulated driver schedule their work on it, and it runs in the calling
+// thread in time order, so a run is repeatable and takes no real time. Tasks
+// have threads of their own but never run at the same time as the clock.
+
+#include <cstdint>
+#include <functional>
+
+// The application starts this long after the boot, esp_timer_get_time() is never 0
+#define FAKE_CLOCK_BOOT_US 300000
+
+// Drops all pending work, stops the timers and sets the time back to FAKE_CLOCK_BOOT_US
+void FakeClockReset();
+// Microseconds since the boot
+int64_t FakeClockNow();
+// Returns an id for FakeClockCancel()
+uint64_t FakeClockSchedule(int64_t delay_us, std::function<void()> work);
+void FakeClockCancel(uint64_t id);
+// Runs the work that falls due in the next ms milliseconds
+void FakeClockRunFor(int64_t ms);
+// Runs until done() or until max_ms have passed, returns done(). Called from a FreeRTOS
+// task it blocks the task instead, the clock goes on in the thread that runs it.
+bool FakeClockRunUntil(const std::function<bool()>& done, int64_t max_ms);
@@ -0,0 +1,47 @@
+#pragma once
+
+// The browser side of the esp_http_server fake. A connection is a socket of
+// lwip/sockets.h; the server calls open_fn and close_fn for it and purges the least
+// recently used one when max_open_sockets are open, as esp_http_server does.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+struct FakeHttpRequest {
+    std::string method = "GET";
+    std::string uri = "/";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // Most bytes one httpd_req_recv() returns, the body arrives in segments of this size
+    size_t segment_size = 1460;
+    // Content-Length, the length of the body if negative. A longer one makes the read time out.
+    long content_length = -1;
+};
+
+struct FakeHttpResponse {
+    int status = 0;
+    std::vector<std::pair<std::string, std::string>> headers;
+    // The chunks so far for a chunked response, an event stream keeps adding to it
+    std::string body;
+    bool chunked = false;
+    // The whole body was sent, for a chunked response the last empty chunk
+    bool complete = false;
+
+    // Value of the header, case-insensitive, empty if there is none
+    std::string Header(const std::string& name) const;
+};
+
+bool FakeHttpdIsRunning();
+// Returns the socket of the new connection, -1 if the server refused it
+int FakeHttpdConnect();
+// Sends the request on the connection and runs its handler. Returns the response so far.
+FakeHttpResponse& FakeHttpdRequest(int sockfd, const FakeHttpRequest& request);
+// The last response on the connection, also after the connection was closed
+FakeHttpResponse& FakeHttpdResponse(int sockfd);
+// Whether the server has the connection open
+bool FakeHttpdIsOpen(int sockfd);
+// The client closes the connection, the server notices and closes it too
+void FakeHttpdDisconnect(int sockfd);
+// One request on a connection of its own, closed afterwards
+FakeHttpResponse FakeHttpdFetch(const FakeHttpRequest& request);
@@ -0,0 +1,18 @@
+#pragma once
+
+// Control of the in-memory NVS behind the nvs.h fake
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "esp_err.h"
+
+// Erase all namespaces and reset the counters and injected errors
+void FakeNvsReset();
+// Make every following set and commit fail with error, ESP_OK to stop
+void FakeNvsFailWrites(esp_err_t error);
+// Number of successful set calls since the reset
+int FakeNvsWriteCount();
+// Raw value of a key of any type, false if it does not exist
+bool FakeNvsGet(const std::string& name, const std::string& key, std::vector<uint8_t>& value);
+bool FakeNvsContains(const std::string& name, const std::string& key);
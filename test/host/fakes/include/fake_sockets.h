@@ -0,0 +1,17 @@
+#pragma once
+
+// The other end of the UDP sockets of lwip/sockets.h: a client on the AP network that
+// sends datagrams to a bound port and reads the replies sent back to its own port
+
+#include <cstdint>
+#include <vector>
+
+// Closes all sockets
+void FakeSocketsReset();
+// Sockets the component has open, the connections of the httpd fake included
+int FakeSocketsOpenCount();
+bool FakeSocketsIsBound(uint16_t port);
+// Queues a datagram from the client port to the bound port, false if nothing is bound to it
+bool FakeSocketsSend(uint16_t port, const std::vector<uint8_t>& datagram, uint16_t from_port);
+// Takes the datagrams sent to the client port, oldest first
+std::vector<std::vector<uint8_t>> FakeSocketsReceive(uint16_t from_port);
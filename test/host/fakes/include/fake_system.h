@@ -0,0 +1,13 @@
+#pragma once
+
+// Control of the system functions of the host build
+
+#include <cstdint>
+#include "esp_system.h"
+
+// Reseed the generator behind esp_random()
+void FakeRandomSeed(uint32_t seed);
+// Reason returned by esp_reset_reason(), ESP_RST_POWERON by default
+void FakeSystemSetResetReason(esp_reset_reason_t reason);
+// Times esp_restart() was called
+int FakeSystemGetRestartCount();
@@ -0,0 +1,67 @@
+#pragma once
+
+// Simulated radio environment behind the esp_wifi and esp_netif fakes. The driver
+// scans, associates and obtains leases from these APs on the virtual clock and
+// posts the same events as the real one, so WifiStation runs unchanged on top.
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "esp_wifi.h"
+#include "esp_netif.h"
+
+struct FakeAp {
+    std::string ssid;
+    uint8_t bssid[6] = {0x02, 0, 0, 0, 0, 1};
+    uint8_t channel = 1;
+    int8_t rssi = -50;
+    // Replaces rssi when set, for an AP that fades or moves
+    std::function<int8_t(int64_t now_ms)> rssi_over_time;
+    wifi_auth_mode_t authmode = WIFI_AUTH_WPA2_PSK;
+    std::string password;
+    // Chance that an association attempt fails, 0..1
+    double failure_probability = 0;
+    int dhcp_ms = 300;
+    bool present = true;
+    // Addresses of other hosts on the network, they answer ARP and DHCP does not hand them out
+    std::vector<esp_ip4_addr_t> hosts;
+};
+
+struct FakeWifiTiming {
+    // Active scan dwell time on each channel
+    int channel_scan_ms = 120;
+    int channel_count = 13;
+    // Authentication, association and the 4-way handshake
+    int connect_ms = 60;
+    // The driver runs PBKDF2 when it is given the passphrase instead of the PSK
+    int pbkdf2_ms = 650;
+    // Time until a handshake with the wrong key is given up
+    int handshake_timeout_ms = 1000;
+};
+
+struct FakeWifiCounters {
+    int scans = 0;
+    int connects = 0;
+    int pbkdf2_runs = 0;
+    int dhcp_requests = 0;
+    int netifs_created = 0;
+};
+
+// Removes the APs and resets the driver, the interfaces and the counters, not the clock.
+// seed drives the association failures of FakeAp::failure_probability.
+void FakeWifiReset(uint32_t seed = 1);
+FakeAp& FakeWifiAddAp(const FakeAp& ap);
+std::vector<FakeAp>& FakeWifiAps();
+FakeWifiTiming& FakeWifiGetTiming();
+const FakeWifiCounters& FakeWifiGetCounters();
+// The AP drops the station, with the reason reported in the disconnect event
+void FakeWifiDropLink(uint16_t reason);
+bool FakeWifiIsAssociated();
+// Index in FakeWifiAps() of the AP the station is associated with, -1 if none
+int FakeWifiGetAssociatedAp();
+const wifi_config_t& FakeWifiGetStaConfig();
+wifi_mode_t FakeWifiGetMode();
+wifi_ps_type_t FakeWifiGetPowerSave();
+// Address the DHCP server of AP index hands out, the first from .100 not taken by a host
+esp_ip4_addr_t FakeWifiGetLeaseAddress(int index);
@@ -0,0 +1,18 @@
+#pragma once
+
+// Host stand-in for FreeRTOS. Ticks are milliseconds of the virtual clock.
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define portMAX_DELAY (TickType_t)0xffffffffUL
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define BIT0 0x00000001
+#define BIT1 0x00000002
+#define BIT2 0x00000004
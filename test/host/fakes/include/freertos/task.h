@@ -0,0 +1,15 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct tskTaskControlBlock* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+// The task starts from the virtual clock at the current time, on a thread of its own. Only
+// one thread runs at a time: a task that waits hands back to the clock until it is done.
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_depth, void* parameters,
+    UBaseType_t priority, TaskHandle_t* created_task);
+// Only NULL (the calling task) is supported, the function returns after it
+void vTaskDelete(TaskHandle_t task);
+// Runs the virtual clock for the ticks
+void vTaskDelay(TickType_t ticks);
@@ -0,0 +1,40 @@
+#pragma once
+
+// Host stand-in for the lwIP ARP cache of the simulated station interface. A host in
+// FakeAp::hosts answers a request for its address a few ms later, as a real stack does,
+// unless the sender claims that address itself: it drops those as a martian source.
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef int8_t err_t;
+
+#define ERR_OK 0
+#define ERR_ARG -16
+#define ERR_IF -12
+
+typedef struct ip4_addr {
+    uint32_t addr;
+} ip4_addr_t;
+
+struct eth_addr {
+    uint8_t addr[6];
+};
+
+// esp_netif_get_netif_impl() of the station interface
+struct netif;
+struct pbuf;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sends a request from the address of the interface, 0.0.0.0 before it has one, and adds a
+// pending entry that the reply completes. q must be NULL, there is nothing to send.
+err_t etharp_query(struct netif* netif, const ip4_addr_t* ipaddr, struct pbuf* q);
+// Index of the completed cache entry for ipaddr, -1 if there is none
+ssize_t etharp_find_addr(struct netif* netif, const ip4_addr_t* ipaddr, struct eth_addr** eth_ret, const ip4_addr_t** ip_ret);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,82 @@
+#pragma once
+
+// Host stand-in for the lwIP sockets: UDP sockets that exchange datagrams with the test
+// through fake_sockets.h, and the descriptors of the connections of the httpd fake. The
+// POSIX names are macros for the lwip_ functions, as with LWIP_POSIX_SOCKETS_IO_NAMES.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+// Declares close() before the macro replaces it
+#include <unistd.h>
+
+typedef uint8_t sa_family_t;
+typedef uint16_t in_port_t;
+typedef uint32_t in_addr_t;
+typedef uint32_t socklen_t;
+
+struct in_addr {
+    in_addr_t s_addr;
+};
+
+struct sockaddr {
+    uint8_t sa_len;
+    sa_family_t sa_family;
+    char sa_data[14];
+};
+
+struct sockaddr_in {
+    uint8_t sin_len;
+    sa_family_t sin_family;
+    in_port_t sin_port;
+    struct in_addr sin_addr;
+    char sin_zero[8];
+};
+
+#define AF_INET 2
+#define SOCK_STREAM 1
+#define SOCK_DGRAM 2
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+#define SOL_SOCKET 0xfff
+#define SO_RCVTIMEO 0x1006
+#define INADDR_ANY ((uint32_t)0x00000000UL)
+
+static inline uint16_t lwip_htons(uint16_t n) {
+    return __builtin_bswap16(n);
+}
+
+static inline uint32_t lwip_htonl(uint32_t n) {
+    return __builtin_bswap32(n);
+}
+
+#define htons(x) lwip_htons(x)
+#define ntohs(x) lwip_htons(x)
+#define htonl(x) lwip_htonl(x)
+#define ntohl(x) lwip_htonl(x)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int lwip_socket(int domain, int type, int protocol);
+// Fails for a port another socket is bound to
+int lwip_bind(int s, const struct sockaddr* name, socklen_t namelen);
+// Only SO_RCVTIMEO, the other options are accepted and ignored
+int lwip_setsockopt(int s, int level, int optname, const void* optval, socklen_t optlen);
+// Runs the virtual clock until a datagram arrives or SO_RCVTIMEO has passed, a task blocks instead
+ssize_t lwip_recvfrom(int s, void* mem, size_t len, int flags, struct sockaddr* from, socklen_t* fromlen);
+ssize_t lwip_sendto(int s, const void* dataptr, size_t size, int flags, const struct sockaddr* to, socklen_t tolen);
+int lwip_close(int s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define socket(domain, type, protocol) lwip_socket(domain, type, protocol)
+#define bind(s, name, namelen) lwip_bind(s, name, namelen)
+#define setsockopt(s, level, optname, opval, optlen) lwip_setsockopt(s, level, optname, opval, optlen)
+#define recvfrom(s, mem, len, flags, from, fromlen) lwip_recvfrom(s, mem, len, flags, from, fromlen)
+#define sendto(s, dataptr, size, flags, to, tolen) lwip_sendto(s, dataptr, size, flags, to, tolen)
+#define close(s) lwip_close(s)
@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stand-in for mbedtls PBKDF2, implemented with OpenSSL
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    MBEDTLS_MD_NONE = 0,
+    MBEDTLS_MD_SHA1 = 4,
+} mbedtls_md_type_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mbedtls_pkcs5_pbkdf2_hmac_ext(mbedtls_md_type_t md_type, const unsigned char* password, size_t plen,
+    const unsigned char* salt, size_t slen, unsigned int iteration_count, uint32_t key_length, unsigned char* output);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,4 @@
+#pragma once
+
+// The store of fake_nvs.h needs no initialization
+#include "nvs.h"
@@ -0,0 +1,68 @@
+// libFuzzer entry point for FormParser, built on its own with
+// -DWIFI_CONNECT_FUZZ=ON and Clang. host_tests also replays it on random input.
+// The first byte picks the format and the chunk size, the rest is the body.
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "form_parser.h"
+
+namespace {
+
+struct Result {
+    bool ok;
+    char ssid[32 * 3 + 1];
+    char password[64 * 3 + 1];
+    FormField fields[2] = {
+        { .name = "ssid", .value = ssid, .size = sizeof(ssid), .max_length = 32 },
+        { .name = "password", .value = password, .size = sizeof(password), .max_length = 64 },
+    };
+};
+
+void Parse(FormParser::Format format, const char* body, size_t length, size_t chunk, Result& result) {
+    FormParser parser(format, result.fields, 2);
+    bool ok = true;
+    for (size_t i = 0; i < length && ok; i += chunk) {
+        ok = parser.Feed(body + i, length - i < chunk ? length - i : chunk);
+    }
+    result.ok = ok && parser.Finish();
+}
+
+void Check(bool condition) {
+    if (!condition) {
+        abort();
+    }
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    auto format = (data[0] & 1) ? FormParser::Format::Json : FormParser::Format::UrlEncoded;
+    size_t chunk = (data[0] >> 1) + 1;
+    const char* body = reinterpret_cast<const char*>(data + 1);
+    size_t length = size - 1;
+
+    Result whole;
+    Result split;
+    Parse(format, body, length, length > 0 ? length : 1, whole);
+    Parse(format, body, length, chunk, split);
+
+    // Where the body is split must not matter
+    Check(whole.ok == split.ok);
+    if (!whole.ok) {
+        return 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        const FormField& a = whole.fields[i];
+        const FormField& b = split.fields[i];
+        Check(a.present == b.present);
+        Check(a.length <= a.max_length);
+        // Values are used as C strings, an embedded NUL would cut them short
+        Check(strlen(a.value) == a.length);
+        Check(a.length == b.length && memcmp(a.value, b.value, a.length) == 0);
+        Check(a.present || a.length == 0);
+    }
+    return 0;
+}
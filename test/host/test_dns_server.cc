@@ -0,0 +1,115 @@
+#include <catch2/catch.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "dns_server.h"
+#include "fake_clock.h"
+#include "fake_sockets.h"
+
+#define CLIENT_PORT 5353
+
+static void ResetDns() {
+    FakeClockReset();
+    FakeSocketsReset();
+}
+
+// A standard query with recursion desired for one name
+static std::vector<uint8_t> Query(const std::string& name, uint16_t type, uint16_t id = 0x1234) {
+    std::vector<uint8_t> query = { (uint8_t)(id >> 8), (uint8_t)id, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+    size_t start = 0;
+    while (start <= name.length()) {
+        size_t end = name.find('.', start);
+        if (end == std::string::npos) {
+            end = name.length();
+        }
+        query.push_back(end - start);
+        query.insert(query.end(), name.begin() + start, name.begin() + end);
+        start = end + 1;
+    }
+    query.push_back(0);
+    query.insert(query.end(), { (uint8_t)(type >> 8), (uint8_t)type, 0, 1 });
+    return query;
+}
+
+// Sends the query to port 53 and returns the reply, empty if none came within a second
+static std::vector<uint8_t> Ask(const std::vector<uint8_t>& query) {
+    REQUIRE(FakeSocketsSend(53, query, CLIENT_PORT));
+    std::vector<std::vector<uint8_t>> replies;
+    FakeClockRunUntil([&] {
+        replies = FakeSocketsReceive(CLIENT_PORT);
+        return !replies.empty();
+    }, 1000);
+    return replies.empty() ? std::vector<uint8_t>() : replies[0];
+}
+
+static esp_ip4_addr_t PortalAddress() {
+    esp_ip4_addr_t address;
+    IP4_ADDR(&address, 192, 168, 4, 1);
+    return address;
+}
+
+TEST_CASE("DNS server answers an A query with the portal address", "[dns]") {
+    ResetDns();
+    DnsServer server;
+    server.Start(PortalAddress());
+    REQUIRE(FakeClockRunUntil([] { return FakeSocketsIsBound(53); }, 100));
+
+    auto query = Query("connectivitycheck.gstatic.com", 1);
+    auto reply = Ask(query);
+    REQUIRE(reply.size() == query.size() + 16);
+    // Same id, a response with recursion desired and available, one answer
+    CHECK(reply[0] == 0x12);
+    CHECK(reply[1] == 0x34);
+    CHECK(reply[2] == 0x85);
+    CHECK(reply[3] == 0x80);
+    CHECK(reply[7] == 1);
+    CHECK(std::equal(query.begin() + 12, query.end(), reply.begin() + 12));
+    const uint8_t* answer = reply.data() + query.size();
+    // A pointer to the question, type A, class IN, TTL 60, four bytes of address
+    const uint8_t expected[] = { 0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 192, 168, 4, 1 };
+    CHECK(memcmp(answer, expected, sizeof(expected)) == 0);
+    server.Stop();
+}
+
+TEST_CASE("DNS server gives other record types an empty answer", "[dns]") {
+    ResetDns();
+    DnsServer server;
+    server.Start(PortalAddress());
+    REQUIRE(FakeClockRunUntil([] { return FakeSocketsIsBound(53); }, 100));
+
+    // AAAA, the client falls back to IPv4
+    auto query = Query("captive.apple.com", 28, 0x4242);
+    auto reply = Ask(query);
+    REQUIRE(reply.size() == query.size());
+    CHECK(reply[2] == 0x85);
+    CHECK(reply[5] == 1);
+    CHECK(reply[7] == 0);
+
+    // A response or a query without a question is not answered
+    auto response = Query("example.com", 1);
+    response[2] |= 0x80;
+    CHECK(Ask(response).empty());
+    std::vector<uint8_t> empty = { 0, 1, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    CHECK(Ask(empty).empty());
+    server.Stop();
+}
+
+TEST_CASE("DNS server closes its socket on stop and can start again", "[dns]") {
+    ResetDns();
+    DnsServer server;
+    server.Start(PortalAddress());
+    REQUIRE(FakeClockRunUntil([] { return FakeSocketsIsBound(53); }, 100));
+
+    // Stop returns within one poll of the socket
+    auto start = FakeClockNow();
+    server.Stop();
+    CHECK(FakeClockNow() - start <= 250 * 1000);
+    CHECK_FALSE(FakeSocketsIsBound(53));
+    CHECK(FakeSocketsOpenCount() == 0);
+
+    server.Start(PortalAddress());
+    REQUIRE(FakeClockRunUntil([] { return FakeSocketsIsBound(53); }, 100));
+    CHECK(Ask(Query("example.com", 1)).size() > 0);
+    server.Stop();
+    CHECK_FALSE(FakeSocketsIsBound(53));
+}
@@ -0,0 +1,257 @@
+#include <catch2/catch.hpp>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "form_parser.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+namespace {
+
+// The fields and buffer sizes of the /submit handler
+struct Form {
+    char ssid[32 * 3 + 1];
+    char password[64 * 3 + 1];
+    FormField fields[2] = {
+        { .name = "ssid", .value = ssid, .size = sizeof(ssid), .max_length = 32 },
+        { .name = "password", .value = password, .size = sizeof(password), .max_length = 64 },
+    };
+    bool ok = false;
+
+    Form(FormParser::Format format, const std::string& body, size_t chunk = 0) {
+        FormParser parser(format, fields, 2);
+        if (chunk == 0) {
+            chunk = body.length() > 0 ? body.length() : 1;
+        }
+        ok = true;
+        for (size_t i = 0; i < body.length() && ok; i += chunk) {
+            ok = parser.Feed(body.data() + i, std::min(chunk, body.length() - i));
+        }
+        ok = ok && parser.Finish();
+    }
+};
+
+Form UrlEncoded(const std::string& body, size_t chunk = 0) {
+    return Form(FormParser::Format::UrlEncoded, body, chunk);
+}
+
+Form Json(const std::string& body, size_t chunk = 0) {
+    return Form(FormParser::Format::Json, body, chunk);
+}
+
+std::string Decode(const std::string& value, size_t size = 128) {
+    std::vector<char> buffer(size + 1, 'x');
+    int length = FormParser::UrlDecode(value.data(), value.length(), buffer.data(), size);
+    if (length < 0) {
+        return "<error>";
+    }
+    REQUIRE(buffer[length] == '\0');
+    // Nothing is written past size
+    REQUIRE(buffer[size] == 'x');
+    return std::string(buffer.data(), length);
+}
+
+// The decoder before FormParser, kept to compare against
+std::string UrlDecodeStoi(const std::string &url) {
+    std::string decoded;
+    for (size_t i = 0; i < url.length(); ++i) {
+        if (url[i] == '%') {
+            char hex[3];
+            hex[0] = url[i + 1];
+            hex[1] = url[i + 2];
+            hex[2] = '\0';
+            char ch = static_cast<char>(std::stoi(hex, nullptr, 16));
+            decoded += ch;
+            i += 2;
+        } else if (url[i] == '+') {
+            decoded += ' ';
+        } else {
+            decoded += url[i];
+        }
+    }
+    return decoded;
+}
+
+}  // namespace
+
+TEST_CASE("URL-encoded form fields are decoded in any order", "[form]") {
+    Form form = UrlEncoded("password=p%40ss+word&ssid=My%20Home");
+    REQUIRE(form.ok);
+    CHECK(std::string(form.ssid) == "My Home");
+    CHECK(form.fields[0].length == 7);
+    CHECK(std::string(form.password) == "p@ss word");
+
+    // Unknown fields and keys without a value are skipped, the last occurrence wins
+    form = UrlEncoded("x=1&flag&ssid=a&other=%zz&ssid=b");
+    REQUIRE(form.ok);
+    CHECK(std::string(form.ssid) == "b");
+    CHECK(!form.fields[1].present);
+    CHECK(std::string(form.password).empty());
+
+    // A key longer than any field name does not match by its prefix
+    form = UrlEncoded("ssidssidssidssidssid=x&ssid=y");
+    REQUIRE(form.ok);
+    CHECK(std::string(form.ssid) == "y");
+
+    form = UrlEncoded("ssid=");
+    REQUIRE(form.ok);
+    CHECK(form.fields[0].present);
+    CHECK(form.fields[0].length == 0);
+}
+
+TEST_CASE("URL-encoded form fields reject bad escapes and long values", "[form]") {
+    CHECK(!UrlEncoded("ssid=a%2").ok);
+    CHECK(!UrlEncoded("ssid=a%zz").ok);
+    CHECK(!UrlEncoded("ssid=a%00b").ok);
+    CHECK(UrlEncoded("ssid=" + std::string(32, 'a')).ok);
+    CHECK(!UrlEncoded("ssid=" + std::string(33, 'a')).ok);
+    // Escaped, the longest SSID fills the buffer, one more byte overflows it
+    std::string escaped;
+    for (int i = 0; i < 32; i++) {
+        escaped += "%41";
+    }
+    CHECK(UrlEncoded("ssid=" + escaped).ok);
+    CHECK(!UrlEncoded("ssid=" + escaped + "A").ok);
+}
+
+TEST_CASE("JSON form fields are decoded with escapes", "[form]") {
+    Form form = Json(" {\n \"password\" : \"a\\\"b\\\\c\\/d\",\"ssid\":\"caf\\u00e9 \\u4e2d\"} ");
+    REQUIRE(form.ok);
+    CHECK(std::string(form.ssid) == "caf\xc3\xa9 \xe4\xb8\xad");
+    CHECK(std::string(form.password) == "a\"b\\c/d");
+
+    // Other fields may hold scalars
+    form = Json("{\"n\":12,\"b\":true,\"z\":null,\"ssid\":\"home\"}");
+    REQUIRE(form.ok);
+    CHECK(std::string(form.ssid) == "home");
+
+    form = Json("{}");
+    REQUIRE(form.ok);
+    CHECK(!form.fields[0].present);
+}
+
+TEST_CASE("JSON form bodies that are not a flat object of strings are rejected", "[form]") {
+    CHECK(!Json("").ok);
+    CHECK(!Json("[]").ok);
+    CHECK(!Json("{\"ssid\":\"home\"").ok);
+    CHECK(!Json("{\"ssid\":\"home\"} x").ok);
+    CHECK(!Json("{\"ssid\":42}").ok);
+    CHECK(!Json("{\"x\":{\"ssid\":\"home\"}}").ok);
+    CHECK(!Json("{\"x\":[1]}").ok);
+    CHECK(!Json("{\"ssid\":\"a\nb\"}").ok);
+    CHECK(!Json("{\"ssid\":\"\\x\"}").ok);
+    CHECK(!Json("{\"ssid\":\"\\u00g0\"}").ok);
+    CHECK(!Json("{\"ssid\":\"\\ud83d\\ude00\"}").ok);
+    CHECK(!Json("{\"ssid\":\"a\\u0000b\"}").ok);
+    CHECK(!Json("{\"ssid\":\"" + std::string(33, 'a') + "\"}").ok);
+}
+
+TEST_CASE("Form fields do not depend on how the body is split", "[form]") {
+    std::string url = "ssid=My%20Home&password=p%40ss+word";
+    std::string json = "{\"ssid\":\"caf\\u00e9\",\"n\":1,\"password\":\"a\\\"b\"}";
+    for (size_t chunk = 1; chunk <= json.length(); chunk++) {
+        INFO("chunk " << chunk);
+        Form form = UrlEncoded(url, chunk);
+        REQUIRE(form.ok);
+        CHECK(std::string(form.ssid) == "My Home");
+        CHECK(std::string(form.password) == "p@ss word");
+        form = Json(json, chunk);
+        REQUIRE(form.ok);
+        CHECK(std::string(form.ssid) == "caf\xc3\xa9");
+        CHECK(std::string(form.password) == "a\"b");
+    }
+}
+
+TEST_CASE("URL decoding", "[form]") {
+    CHECK(Decode("") == "");
+    CHECK(Decode("a+b%20c") == "a b c");
+    CHECK(Decode("%4a%4A%7e%2B") == "JJ~+");
+    CHECK(Decode("%c3%a9") == "\xc3\xa9");
+    CHECK(Decode("100%25") == "100%");
+}
+
+TEST_CASE("URL decoding rejects bad escapes and small buffers", "[form]") {
+    // Truncated escapes, which the old decoder read past the end for
+    CHECK(Decode("%") == "<error>");
+    CHECK(Decode("a%4") == "<error>");
+    // Not hex, where std::stoi threw or took a partial value
+    CHECK(Decode("%zz") == "<error>");
+    CHECK(Decode("%4z") == "<error>");
+    CHECK(Decode("% 4") == "<error>");
+    CHECK(Decode("%-1") == "<error>");
+    CHECK(Decode("%00") == "<error>");
+
+    // The NUL needs a byte too
+    CHECK(Decode("abc", 4) == "abc");
+    CHECK(Decode("abc", 3) == "<error>");
+    CHECK(Decode("%41%42", 3) == "AB");
+    CHECK(Decode("%41%42", 2) == "<error>");
+    char none[1];
+    CHECK(FormParser::UrlDecode("a", 1, none, 0) == -1);
+    CHECK(FormParser::UrlDecode("", 0, none, 1) == 0);
+    CHECK(none[0] == '\0');
+
+    // In place
+    char value[] = "p%40ss+word";
+    CHECK(FormParser::UrlDecode(value, strlen(value), value, sizeof(value)) == 9);
+    CHECK(std::string(value) == "p@ss word");
+}
+
+TEST_CASE("URL decoding of a password", "[.][benchmark]") {
+    const std::string plain = "correcthorsebatterystaple-correcthorsebatterystaple-0123456789";
+    std::string escaped;
+    for (char c : plain) {
+        char hex[4];
+        snprintf(hex, sizeof(hex), "%%%02X", (unsigned char)c);
+        escaped += hex;
+    }
+    for (auto& input : { plain, escaped }) {
+        REQUIRE(UrlDecodeStoi(input) == plain);
+        std::string name = input == plain ? " plain" : " escaped";
+        BENCHMARK("std::string and std::stoi" + name) {
+            return UrlDecodeStoi(input);
+        };
+        BENCHMARK("FormParser::UrlDecode" + name) {
+            char buffer[64 * 3 + 1];
+            return FormParser::UrlDecode(input.data(), input.length(), buffer, sizeof(buffer));
+        };
+    }
+}
+
+// Replays the fuzz harness on mutations of valid bodies, it aborts on a failed check
+TEST_CASE("Form parser survives random input", "[form]") {
+    std::vector<std::string> seeds = {
+        "ssid=My%20Home&password=p%40ss+word",
+        "{\"ssid\":\"caf\\u00e9\",\"n\":1,\"password\":\"a\\\"b\"}",
+    };
+    const char alphabet[] = "{}[]\":,\\u0aF%+=& \n\x01\xc3";
+    std::mt19937 random(1);
+    for (int i = 0; i < 20000; i++) {
+        std::string input = seeds[i % seeds.size()];
+        int mutations = random() % 8;
+        for (int j = 0; j < mutations; j++) {
+            size_t pos = random() % (input.length() + 1);
+            char c = alphabet[random() % (sizeof(alphabet) - 1)];
+            switch (random() % 3) {
+            case 0:
+                input.insert(pos, 1, c);
+                break;
+            case 1:
+                if (pos < input.length()) {
+                    input.erase(pos, 1);
+                }
+                break;
+            default:
+                if (pos < input.length()) {
+                    input[pos] = c;
+                }
+                break;
+            }
+        }
+        // Format and chunk size in the first byte, as in a fuzzer corpus
+        input.insert(input.begin(), (char)((random() % 64) << 1 | (i % seeds.size())));
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.length());
+    }
+    SUCCEED();
+}
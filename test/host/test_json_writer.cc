@@ -0,0 +1,191 @@
+#include <catch2/catch.hpp>
+#include "json_writer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Capture {
+    std::string output;
+    int calls = 0;
+    // Calls after which the sink fails, -1 never
+    int fail_after = -1;
+};
+
+bool CaptureSink(void* ctx, const char* data, size_t length) {
+    auto capture = static_cast<Capture*>(ctx);
+    if (capture->fail_after >= 0 && capture->calls >= capture->fail_after) {
+        return false;
+    }
+    capture->calls++;
+    capture->output.append(data, length);
+    return true;
+}
+
+std::string WriteString(const std::string& value) {
+    char buffer[64];
+    Capture capture;
+    JsonWriter writer(buffer, sizeof(buffer), CaptureSink, &capture);
+    writer.String(value.data(), value.length());
+    writer.Flush();
+    return capture.output;
+}
+
+struct Ap {
+    std::string ssid;
+    int rssi;
+    int authmode;
+};
+
+std::vector<Ap> MakeAps(int count) {
+    std::vector<Ap> aps;
+    for (int i = 0; i < count; i++) {
+        aps.push_back({ "Network-" + std::to_string(i) + "-2.4G", -40 - i, 3 });
+    }
+    return aps;
+}
+
+void WriteAps(JsonWriter& writer, const std::vector<Ap>& aps) {
+    writer.BeginObject();
+    writer.Key("age");
+    writer.Int(0);
+    writer.Key("aps");
+    writer.BeginArray();
+    for (auto& ap : aps) {
+        writer.BeginObject();
+        writer.Key("ssid");
+        writer.String(ap.ssid.data(), ap.ssid.length());
+        writer.Key("rssi");
+        writer.Int(ap.rssi);
+        writer.Key("authmode");
+        writer.Int(ap.authmode);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    writer.Flush();
+}
+
+// The /scan handler before JsonWriter: one snprintf and a chunk per AP plus one per comma
+void WriteApsSnprintf(Capture& capture, const std::vector<Ap>& aps) {
+    CaptureSink(&capture, "[", 1);
+    for (size_t i = 0; i < aps.size(); i++) {
+        char buf[128];
+        int n = snprintf(buf, sizeof(buf), "{\"ssid\":\"%s\",\"rssi\":%d,\"authmode\":%d}",
+            aps[i].ssid.c_str(), aps[i].rssi, aps[i].authmode);
+        CaptureSink(&capture, buf, n);
+        if (i < aps.size() - 1) {
+            CaptureSink(&capture, ",", 1);
+        }
+    }
+    CaptureSink(&capture, "]", 1);
+}
+
+}  // namespace
+
+TEST_CASE("JSON strings escape quotes, backslashes and control bytes", "[json]") {
+    CHECK(WriteString("home") == "\"home\"");
+    CHECK(WriteString("say \"hi\"") == "\"say \\\"hi\\\"\"");
+    CHECK(WriteString("a\\b") == "\"a\\\\b\"");
+    CHECK(WriteString("a\nb\rc\td") == "\"a\\nb\\rc\\td\"");
+    CHECK(WriteString("\x01\x1f") == "\"\\u0001\\u001f\"");
+    CHECK(WriteString(std::string("a\0b", 3)) == "\"a\\u0000b\"");
+    // UTF-8 and DEL pass through unchanged
+    CHECK(WriteString("caf\xc3\xa9\x7f") == "\"caf\xc3\xa9\x7f\"");
+    CHECK(WriteString("") == "\"\"");
+}
+
+TEST_CASE("JSON values are separated by commas at every nesting level", "[json]") {
+    char buffer[64];
+    Capture capture;
+    JsonWriter writer(buffer, sizeof(buffer), CaptureSink, &capture);
+    writer.BeginObject();
+    writer.Key("a");
+    writer.Int(1);
+    writer.Key("b");
+    writer.BeginArray();
+    writer.Int(-2);
+    writer.String("x");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Raw("[3]", 3);
+    writer.EndArray();
+    writer.Key("c");
+    writer.String("y");
+    writer.EndObject();
+    REQUIRE(writer.Flush());
+    CHECK(capture.output == "{\"a\":1,\"b\":[-2,\"x\",{},[],[3]],\"c\":\"y\"}");
+}
+
+TEST_CASE("JSON output is the same for any buffer size", "[json]") {
+    auto aps = MakeAps(20);
+    aps[3].ssid = "quote\" back\\ nl\n";
+    char reference_buffer[4096];
+    Capture reference;
+    JsonWriter reference_writer(reference_buffer, sizeof(reference_buffer), CaptureSink, &reference);
+    WriteAps(reference_writer, aps);
+    REQUIRE(reference.calls == 1);
+
+    for (size_t size : { 1, 2, 5, 6, 7, 64, 1436 }) {
+        std::vector<char> buffer(size);
+        Capture capture;
+        JsonWriter writer(buffer.data(), size, CaptureSink, &capture);
+        WriteAps(writer, aps);
+        INFO("buffer " << size);
+        CHECK(capture.output == reference.output);
+        CHECK(capture.calls == (int)((reference.output.length() + size - 1) / size));
+    }
+}
+
+TEST_CASE("JSON writer drops the output after the sink fails", "[json]") {
+    char buffer[8];
+    Capture capture;
+    capture.fail_after = 2;
+    JsonWriter writer(buffer, sizeof(buffer), CaptureSink, &capture);
+    WriteAps(writer, MakeAps(5));
+    CHECK(!writer.ok());
+    CHECK(capture.calls == 2);
+    CHECK(capture.output.length() == 16);
+
+    // Nothing buffered, nothing to send
+    Capture empty;
+    JsonWriter idle(buffer, sizeof(buffer), CaptureSink, &empty);
+    CHECK(idle.Flush());
+    CHECK(empty.calls == 0);
+}
+
+// Sink calls stand for httpd_resp_send_chunk, each one a socket write and a chunk header
+TEST_CASE("Scan response for 50 APs", "[.][benchmark]") {
+    auto aps = MakeAps(50);
+    const int rounds = 20000;
+
+    char buffer[1436];
+    Capture streamed;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        streamed = Capture();
+        JsonWriter writer(buffer, sizeof(buffer), CaptureSink, &streamed);
+        WriteAps(writer, aps);
+    }
+    double streamed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Capture baseline;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        baseline = Capture();
+        WriteApsSnprintf(baseline, aps);
+    }
+    double baseline_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("JsonWriter:  %zu bytes, %d sink calls, %.1f MB/s\n", streamed.output.length(),
+        streamed.calls, streamed.output.length() * rounds / streamed_s / 1e6);
+    printf("snprintf:    %zu bytes, %d sink calls, %.1f MB/s\n", baseline.output.length(),
+        baseline.calls, baseline.output.length() * rounds / baseline_s / 1e6);
+    CHECK(streamed.calls < baseline.calls);
+}
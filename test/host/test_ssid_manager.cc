@@ -0,0 +1,262 @@
+#include <catch2/catch.hpp>
+#include <cstring>
+#include <functional>
+#include "ssid_manager.h"
+#include "nvs.h"
+#include "esp_rom_crc.h"
+#include "fake_nvs.h"
+
+// The singleton loaded NVS once, start every case from an empty list and an empty NVS
+static SsidManager& ResetSsidManager() {
+    auto& manager = SsidManager::GetInstance();
+    manager.Clear();
+    FakeNvsReset();
+    return manager;
+}
+
+static wifi_ap_record_t ApRecord(uint8_t id, uint8_t channel) {
+    wifi_ap_record_t record = {};
+    uint8_t bssid[6] = {0x02, 0, 0, 0, 0, id};
+    memcpy(record.bssid, bssid, sizeof(bssid));
+    record.primary = channel;
+    record.authmode = WIFI_AUTH_WPA2_PSK;
+    return record;
+}
+
+static const SsidItem* Find(const std::vector<SsidItem>& list, const std::string& ssid) {
+    for (auto& item : list) {
+        if (item.ssid == ssid) {
+            return &item;
+        }
+    }
+    return nullptr;
+}
+
+TEST_CASE("Reconnecting to the same AP does not write NVS", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    manager.AddSsid("home", "password123");
+
+    int writes = FakeNvsWriteCount();
+    manager.UpdateConnectedAp("home", ApRecord(1, 6));
+    CHECK(FakeNvsWriteCount() == writes + 1);
+    manager.UpdateConnectedAp("home", ApRecord(1, 6));
+    CHECK(FakeNvsWriteCount() == writes + 1);
+
+    // Another AP of the same network, or the same AP on another channel
+    manager.UpdateConnectedAp("home", ApRecord(2, 6));
+    CHECK(FakeNvsWriteCount() == writes + 2);
+    manager.UpdateConnectedAp("home", ApRecord(2, 11));
+    CHECK(FakeNvsWriteCount() == writes + 3);
+    CHECK(manager.GetSsidList()[0].channel == 11);
+
+    // Unknown networks are ignored
+    manager.UpdateConnectedAp("cafe", ApRecord(3, 1));
+    CHECK(FakeNvsWriteCount() == writes + 3);
+}
+
+TEST_CASE("The last used network has the highest success counter", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    manager.AddSsid("home", "password123");
+    manager.AddSsid("office", "password456");
+
+    manager.UpdateConnectedAp("home", ApRecord(1, 6));
+    manager.UpdateConnectedAp("office", ApRecord(2, 1));
+    auto list = manager.GetSsidList();
+    CHECK(Find(list, "office")->last_success > Find(list, "home")->last_success);
+
+    // Same AP as before, but office was used since, so the order is written
+    int writes = FakeNvsWriteCount();
+    manager.UpdateConnectedAp("home", ApRecord(1, 6));
+    CHECK(FakeNvsWriteCount() == writes + 1);
+    list = manager.GetSsidList();
+    CHECK(Find(list, "home")->last_success > Find(list, "office")->last_success);
+}
+
+TEST_CASE("Updating a network keeps its priority unless one is given", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    manager.AddSsid("home", "password123", 3);
+    auto psk = manager.GetSsidList()[0].psk;
+    REQUIRE(psk.length() == 64);
+
+    manager.AddSsid("home", "password456");
+    auto item = manager.GetSsidList()[0];
+    CHECK(item.priority == 3);
+    CHECK(item.password == "password456");
+    CHECK(item.psk.length() == 64);
+    CHECK(item.psk != psk);
+
+    manager.AddSsid("home", "password456", 0);
+    CHECK(manager.GetSsidList()[0].priority == 0);
+    manager.AddSsid("office", "password789");
+    CHECK(Find(manager.GetSsidList(), "office")->priority == 0);
+}
+
+TEST_CASE("The generation counts changes to the networks only", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    uint32_t generation = SsidManager::GetGeneration();
+    manager.AddSsid("home", "password123");
+    CHECK(SsidManager::GetGeneration() == generation + 1);
+
+    // What the station caches does not make the networks different
+    manager.UpdateConnectedAp("home", ApRecord(1, 6));
+    manager.UpdatePsk("home", std::string(64, 'a'));
+    CHECK(SsidManager::GetGeneration() == generation + 1);
+
+    manager.AddSsid("home", "password456");
+    manager.RemoveSsid("home");
+    manager.Clear();
+    CHECK(SsidManager::GetGeneration() == generation + 4);
+}
+
+TEST_CASE("The least recently used network is dropped from a full list", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    for (int i = 0; i < 10; i++) {
+        manager.AddSsid("net" + std::to_string(i), "password123");
+    }
+    for (int i = 9; i >= 0; i--) {
+        if (i != 3) {
+            manager.UpdateConnectedAp("net" + std::to_string(i), ApRecord(i, 1));
+        }
+    }
+    manager.AddSsid("net10", "password123");
+    auto list = manager.GetSsidList();
+    CHECK(list.size() == 10);
+    CHECK(Find(list, "net3") == nullptr);
+    CHECK(Find(list, "net10") != nullptr);
+
+    // net9 was used first of the others, it goes next
+    manager.AddSsid("net11", "password123");
+    list = manager.GetSsidList();
+    CHECK(Find(list, "net10") == nullptr);
+    CHECK(Find(list, "net9") != nullptr);
+}
+
+TEST_CASE("A failing NVS keeps the list in memory", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    FakeNvsFailWrites(ESP_ERR_NVS_NOT_ENOUGH_SPACE);
+    manager.AddSsid("home", "password123");
+    manager.UpdateConnectedAp("home", ApRecord(1, 6));
+    FakeNvsFailWrites(ESP_OK);
+
+    auto list = manager.GetSsidList();
+    REQUIRE(list.size() == 1);
+    CHECK(list[0].channel == 6);
+    CHECK(!FakeNvsContains("wifi", "config"));
+}
+
+// Layout of the config blob: version, count, entry size, CRC32 of the blob with the CRC 0
+static const size_t kHeaderSize = 8;
+static const size_t kEntrySize = 33 + 65 + 64 + 4 + 4 + 6 + 1 + 1;
+
+static uint32_t BlobCrc(std::vector<uint8_t> blob) {
+    memset(blob.data() + 4, 0, 4);
+    return esp_rom_crc32_le(0, blob.data(), blob.size());
+}
+
+static void SetNvs(const std::function<void(nvs_handle_t)>& set) {
+    nvs_handle_t handle;
+    REQUIRE(nvs_open("wifi", NVS_READWRITE, &handle) == ESP_OK);
+    set(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+TEST_CASE("The config blob is checked by its CRC", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    manager.AddSsid("home", "password123", 2);
+    manager.AddSsid("office", "password456");
+    manager.UpdateConnectedAp("office", ApRecord(7, 11));
+
+    std::vector<uint8_t> blob;
+    REQUIRE(FakeNvsGet("wifi", "config", blob));
+    REQUIRE(blob.size() == kHeaderSize + 2 * kEntrySize);
+    CHECK(blob[0] == 1);
+    CHECK(blob[1] == 2);
+    CHECK((blob[2] | blob[3] << 8) == (int)kEntrySize);
+    uint32_t crc;
+    memcpy(&crc, blob.data() + 4, sizeof(crc));
+    CHECK(crc == BlobCrc(blob));
+    // Any changed byte is noticed
+    for (size_t i : { (size_t)0, kHeaderSize, blob.size() - 1 }) {
+        auto corrupted = blob;
+        corrupted[i] ^= 0x01;
+        CHECK(BlobCrc(corrupted) != crc);
+    }
+    // The legacy keys were never there, saving did not add or erase anything else
+    CHECK(!FakeNvsContains("wifi", "ssid"));
+}
+
+// The following cases load NVS through the constructor of the singleton, they need a
+// process of their own as CTest runs them
+
+TEST_CASE("A config blob with a bad CRC is not loaded", "[ssid]") {
+    FakeNvsReset();
+    std::vector<uint8_t> blob(kHeaderSize + kEntrySize);
+    blob[0] = 1;
+    blob[1] = 1;
+    blob[2] = kEntrySize & 0xFF;
+    blob[3] = kEntrySize >> 8;
+    strcpy((char*)blob.data() + kHeaderSize, "home");
+    uint32_t crc = BlobCrc(blob);
+    memcpy(blob.data() + 4, &crc, sizeof(crc));
+    // A flipped bit in the password after the CRC was written
+    blob[kHeaderSize + 33] ^= 0x20;
+    SetNvs([&](nvs_handle_t handle) {
+        nvs_set_blob(handle, "config", blob.data(), blob.size());
+    });
+
+    CHECK(SsidManager::GetInstance().GetSsidList().empty());
+}
+
+TEST_CASE("Per-field keys are migrated to the config blob and erased", "[ssid]") {
+    FakeNvsReset();
+    // The second network was removed before the upgrade, the third one has its AP
+    uint8_t bssid[6] = {0x02, 0, 0, 0, 0, 9};
+    SetNvs([&](nvs_handle_t handle) {
+        nvs_set_str(handle, "ssid", "home");
+        nvs_set_str(handle, "password", "password123");
+        nvs_set_str(handle, "ssid2", "office");
+        nvs_set_str(handle, "password2", "password456");
+        nvs_set_i32(handle, "priority2", 3);
+        nvs_set_u32(handle, "last_ok2", 5);
+        nvs_set_blob(handle, "bssid2", bssid, sizeof(bssid));
+        nvs_set_u8(handle, "channel2", 11);
+        nvs_set_u8(handle, "authmode2", WIFI_AUTH_WPA2_PSK);
+    });
+
+    auto list = SsidManager::GetInstance().GetSsidList();
+    REQUIRE(list.size() == 2);
+    CHECK(list[0].ssid == "home");
+    CHECK(list[0].password == "password123");
+    CHECK(list[0].channel == 0);
+    auto office = Find(list, "office");
+    REQUIRE(office != nullptr);
+    CHECK(office->password == "password456");
+    CHECK(office->priority == 3);
+    CHECK(office->last_success == 5);
+    CHECK(office->channel == 11);
+    CHECK(office->authmode == WIFI_AUTH_WPA2_PSK);
+    CHECK(memcmp(office->bssid, bssid, sizeof(bssid)) == 0);
+
+    std::vector<uint8_t> blob;
+    REQUIRE(FakeNvsGet("wifi", "config", blob));
+    CHECK(blob[1] == 2);
+    for (auto key : { "ssid", "password", "ssid2", "password2", "priority2", "last_ok2", "bssid2", "channel2", "authmode2" }) {
+        INFO(key);
+        CHECK(!FakeNvsContains("wifi", key));
+    }
+}
+
+TEST_CASE("Legacy keys without a first network are erased", "[ssid]") {
+    auto& manager = ResetSsidManager();
+    manager.AddSsid("home", "password123");
+    // Left behind by an older firmware that wrote them after the blob
+    SetNvs([](nvs_handle_t handle) {
+        nvs_set_str(handle, "ssid3", "old");
+        nvs_set_str(handle, "password3", "password789");
+    });
+    manager.AddSsid("office", "password456");
+    CHECK(!FakeNvsContains("wifi", "ssid3"));
+    CHECK(!FakeNvsContains("wifi", "password3"));
+    CHECK(manager.GetSsidList().size() == 2);
+}
@@ -0,0 +1,364 @@
+#include <catch2/catch.hpp>
+#include <string>
+#include <vector>
+#include "wifi_configuration_ap.h"
+#include "wifi_station.h"
+#include "ssid_manager.h"
+#include "fake_clock.h"
+#include "fake_httpd.h"
+#include "fake_nvs.h"
+#include "fake_sockets.h"
+#include "fake_system.h"
+#include "fake_wifi.h"
+
+// The portal is a singleton that cannot be stopped, so every case starts it once in a
+// process of its own, as CTest runs them
+
+static FakeAp HomeAp() {
+    FakeAp ap;
+    ap.ssid = "home";
+    ap.password = "password123";
+    ap.channel = 6;
+    return ap;
+}
+
+static WifiConfigurationAp& StartPortal() {
+    FakeClockReset();
+    FakeWifiReset();
+    FakeNvsReset();
+    FakeSocketsReset();
+    FakeWifiAddAp(HomeAp());
+    auto& portal = WifiConfigurationAp::GetInstance();
+    portal.SetSsidPrefix("Test");
+    portal.Start();
+    // Until the first scan is done
+    FakeClockRunFor(2000);
+    return portal;
+}
+
+static FakeHttpResponse Get(const std::string& uri, const std::vector<std::pair<std::string, std::string>>& headers = {}) {
+    FakeHttpRequest request;
+    request.uri = uri;
+    request.headers = headers;
+    return FakeHttpdFetch(request);
+}
+
+static FakeHttpResponse Submit(const std::string& body, size_t segment_size = 1460) {
+    FakeHttpRequest request;
+    request.method = "POST";
+    request.uri = "/submit";
+    request.headers = { { "Content-Type", "application/x-www-form-urlencoded" } };
+    request.body = body;
+    request.segment_size = segment_size;
+    return FakeHttpdFetch(request);
+}
+
+// Value of a string field of a flat JSON object
+static std::string Field(const std::string& json, const std::string& name) {
+    auto key = "\"" + name + "\":\"";
+    auto start = json.find(key);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += key.length();
+    return json.substr(start, json.find('"', start) - start);
+}
+
+static std::string Phase(int job) {
+    return Field(Get("/status?job=" + std::to_string(job)).body, "phase");
+}
+
+// Polls /status until the job has one of the final phases, returns the phases seen on the way
+static std::vector<std::string> FollowJob(int job) {
+    std::vector<std::string> phases;
+    FakeClockRunUntil([&] {
+        auto phase = Phase(job);
+        if (phases.empty() || phases.back() != phase) {
+            phases.push_back(phase);
+        }
+        return phase == "success" || phase == "failed";
+    }, 30000);
+    return phases;
+}
+
+// Opens an event stream, returns its socket
+static int OpenEvents() {
+    int sockfd = FakeHttpdConnect();
+    REQUIRE(sockfd >= 0);
+    FakeHttpRequest request;
+    request.uri = "/events";
+    FakeHttpdRequest(sockfd, request);
+    return sockfd;
+}
+
+// Runs the clock until the stream got the next event of that name, returns its data
+static std::string NextEvent(int sockfd, const std::string& name) {
+    auto& body = FakeHttpdResponse(sockfd).body;
+    auto header = "event: " + name + "\ndata: ";
+    size_t start = std::string::npos;
+    FakeClockRunUntil([&] {
+        start = body.find(header);
+        return start != std::string::npos && body.find("\n\n", start) != std::string::npos;
+    }, 10000);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += header.length();
+    size_t end = body.find("\n\n", start);
+    if (end == std::string::npos) {
+        return "";
+    }
+    auto data = body.substr(start, end - start);
+    body.erase(0, end + 2);
+    return data;
+}
+
+TEST_CASE("Portal sends the page gzipped and revalidates it with the ETag", "[portal]") {
+    StartPortal();
+
+    auto page = Get("/", { { "Accept-Encoding", "gzip, deflate" } });
+    CHECK(page.status == 200);
+    CHECK(page.Header("Content-Encoding") == "gzip");
+    CHECK(page.Header("Vary") == "Accept-Encoding");
+    REQUIRE(page.body.size() > 2);
+    CHECK((uint8_t)page.body[0] == 0x1f);
+    CHECK((uint8_t)page.body[1] == 0x8b);
+    auto etag = page.Header("ETag");
+    REQUIRE(etag.size() > 2);
+
+    auto cached = Get("/", { { "Accept-Encoding", "gzip" }, { "If-None-Match", "\"0\", W/" + etag } });
+    CHECK(cached.status == 304);
+    CHECK(cached.body.empty());
+
+    // A client without gzip gets the plain page under another ETag
+    auto plain = Get("/", { { "Accept-Encoding", "gzip;q=0, identity" } });
+    CHECK(plain.status == 200);
+    CHECK(plain.Header("Content-Encoding").empty());
+    CHECK(plain.body.find("<html") != std::string::npos);
+    CHECK(plain.Header("ETag") != etag);
+    CHECK(Get("/", { { "If-None-Match", etag } }).status == 200);
+}
+
+TEST_CASE("Portal redirects connectivity checks and unknown pages to itself", "[portal]") {
+    StartPortal();
+
+    for (auto uri : { "/generate_204", "/hotspot-detect.html", "/connecttest.txt", "/some/page?x=1" }) {
+        auto response = Get(uri);
+        CHECK(response.status == 302);
+        CHECK(response.Header("Location") == "http://192.168.4.1/");
+    }
+    CHECK(Get("/scan").status == 200);
+}
+
+TEST_CASE("Submitted credentials are connected to in the background and reported by /status", "[portal]") {
+    StartPortal();
+
+    auto response = Submit("ssid=home&password=password123");
+    CHECK(response.status == 200);
+    CHECK(response.body == "{\"job\":1}");
+
+    // The worker task has not run yet
+    CHECK(Phase(1) == "queued");
+    auto phases = FollowJob(1);
+    CHECK(phases == std::vector<std::string>{ "connecting", "dhcp", "success" });
+    auto status = Get("/status?job=1").body;
+    CHECK(Field(status, "ip") == "10.0.0.100");
+    CHECK(status.find("\"restart\":true") != std::string::npos);
+    CHECK(Phase(2) == "unknown");
+    auto list = SsidManager::GetInstance().GetSsidList();
+    REQUIRE(list.size() == 1);
+    CHECK(list[0].ssid == "home");
+
+    // Without a provisioned callback the device restarts
+    FakeClockRunFor(2900);
+    CHECK(FakeSystemGetRestartCount() == 0);
+    FakeClockRunFor(200);
+    CHECK(FakeSystemGetRestartCount() == 1);
+}
+
+TEST_CASE("A wrong password fails the job and the next one can be submitted", "[portal]") {
+    StartPortal();
+
+    REQUIRE(Submit("ssid=home&password=wrong-password").status == 200);
+    CHECK(FollowJob(1).back() == "failed");
+    CHECK(Field(Get("/status?job=1").body, "error") == "Wrong password");
+    CHECK(SsidManager::GetInstance().GetSsidList().empty());
+
+    REQUIRE(Submit("ssid=home&password=password123").body == "{\"job\":2}");
+    CHECK(FollowJob(2).back() == "success");
+}
+
+TEST_CASE("Portal refuses a second job while one is running", "[portal]") {
+    StartPortal();
+
+    REQUIRE(Submit("ssid=home&password=password123").status == 200);
+    auto busy = Submit("ssid=other&password=password123");
+    CHECK(busy.status == 503);
+    CHECK(busy.body == "Busy");
+    CHECK(FollowJob(1).back() == "success");
+}
+
+TEST_CASE("Portal reads a form that arrives in several segments", "[portal]") {
+    auto ap = HomeAp();
+    ap.ssid = "my home";
+    StartPortal();
+    FakeWifiAddAp(ap);
+
+    auto response = Submit("ssid=my%20home&password=password123", 5);
+    REQUIRE(response.status == 200);
+    CHECK(FollowJob(1).back() == "success");
+    CHECK(SsidManager::GetInstance().GetSsidList()[0].ssid == "my home");
+}
+
+TEST_CASE("Portal rejects large, invalid and incomplete forms", "[portal]") {
+    StartPortal();
+
+    CHECK(Submit("ssid=home&password=" + std::string(1100, 'a')).status == 400);
+    CHECK(Submit("password=password123").status == 400);
+    CHECK(Submit("ssid=&password=password123").status == 400);
+
+    // The client announces more than it sends
+    FakeHttpRequest request;
+    request.method = "POST";
+    request.uri = "/submit";
+    request.body = "ssid=home";
+    request.content_length = 40;
+    int sockfd = FakeHttpdConnect();
+    CHECK(FakeHttpdRequest(sockfd, request).status == 408);
+    CHECK_FALSE(FakeHttpdIsOpen(sockfd));
+
+    // Nothing was queued
+    CHECK(Phase(1) == "unknown");
+    CHECK(Submit("ssid=home&password=password123").body == "{\"job\":1}");
+}
+
+TEST_CASE("Portal keeps two event streams open and refuses more", "[portal]") {
+    StartPortal();
+
+    int first = OpenEvents();
+    auto& response = FakeHttpdResponse(first);
+    CHECK(response.status == 200);
+    CHECK(response.Header("Content-Type") == "text/event-stream");
+    CHECK_FALSE(response.complete);
+    CHECK(NextEvent(first, "list") == "{\"aps\":[{\"ssid\":\"home\",\"rssi\":-50,\"authmode\":3}]}");
+
+    int second = OpenEvents();
+    CHECK(FakeHttpdResponse(second).status == 200);
+    int third = OpenEvents();
+    CHECK(FakeHttpdResponse(third).status == 503);
+    CHECK(FakeHttpdResponse(third).complete);
+
+    // A closed stream makes room for a new one, and the others go on
+    FakeHttpdDisconnect(first);
+    int fourth = OpenEvents();
+    CHECK(FakeHttpdResponse(fourth).status == 200);
+    CHECK(NextEvent(fourth, "list").size() > 0);
+    CHECK(NextEvent(second, "delta").size() > 0);
+    CHECK(NextEvent(fourth, "delta").size() > 0);
+}
+
+TEST_CASE("Event streams get the changes of the AP list", "[portal]") {
+    auto& portal = WifiConfigurationAp::GetInstance();
+    portal.SetScanInterval(1000);
+    StartPortal();
+    FakeAp cafe;
+    cafe.ssid = "cafe";
+    cafe.rssi = -70;
+    FakeWifiAddAp(cafe);
+
+    int sockfd = OpenEvents();
+    NextEvent(sockfd, "list");
+    CHECK(NextEvent(sockfd, "delta") == "{\"added\":[{\"ssid\":\"cafe\",\"rssi\":-70,\"authmode\":3}],\"changed\":[],\"removed\":[]}");
+    CHECK(NextEvent(sockfd, "delta") == "{\"added\":[],\"changed\":[],\"removed\":[]}");
+
+    // 2 dB is below the threshold, 10 dB is not
+    FakeWifiAps()[0].rssi = -52;
+    FakeWifiAps()[1].rssi = -60;
+    CHECK(NextEvent(sockfd, "delta") == "{\"added\":[],\"changed\":[{\"ssid\":\"cafe\",\"rssi\":-60,\"authmode\":3}],\"removed\":[]}");
+
+    // Compared with the last reported value, so small changes add up
+    FakeWifiAps()[0].rssi = -54;
+    FakeWifiAps()[1].present = false;
+    CHECK(NextEvent(sockfd, "delta") == "{\"added\":[],\"changed\":[{\"ssid\":\"home\",\"rssi\":-54,\"authmode\":3}],\"removed\":[\"cafe\"]}");
+}
+
+TEST_CASE("A provisioned connection is handed over to the station without a restart", "[portal]") {
+    auto& portal = WifiConfigurationAp::GetInstance();
+    int provisioned = 0;
+    portal.SetProvisionedCallback([&] { provisioned++; });
+    StartPortal();
+
+    int sockfd = OpenEvents();
+    NextEvent(sockfd, "list");
+    REQUIRE(Submit("ssid=home&password=password123").status == 200);
+    REQUIRE(FakeClockRunUntil([] { return !FakeHttpdIsRunning(); }, 30000));
+
+    // The open page got the result before the web server went away
+    CHECK(provisioned == 1);
+    CHECK(NextEvent(sockfd, "done") == "{\"ip\":\"10.0.0.100\"}");
+    CHECK_FALSE(FakeHttpdIsOpen(sockfd));
+    // The AP, the DNS server and the web server are gone, the station keeps the connection
+    CHECK_FALSE(FakeSocketsIsBound(53));
+    CHECK(FakeSocketsOpenCount() == 0);
+    CHECK(FakeWifiGetMode() == WIFI_MODE_STA);
+    auto& station = WifiStation::GetInstance();
+    CHECK(station.IsConnected());
+    CHECK(station.GetIpAddress() == "10.0.0.100");
+    CHECK(FakeWifiGetCounters().connects == 1);
+
+    FakeClockRunFor(10000);
+    CHECK(FakeSystemGetRestartCount() == 0);
+    CHECK(station.IsConnected());
+}
+
+// CPU time of a request through the httpd fake on a connection of its own, the
+// handlers with the fake's overhead. tools/portal_load measures the device.
+TEST_CASE("Portal requests", "[.][benchmark]") {
+    StartPortal();
+    for (int i = 0; i < 20; i++) {
+        FakeAp ap;
+        ap.ssid = "neighbour-" + std::to_string(i);
+        ap.rssi = -60 - i;
+        FakeWifiAddAp(ap);
+    }
+    // Until the next scan has found them
+    FakeClockRunFor(12000);
+
+    FakeHttpRequest page;
+    page.headers = { { "Accept-Encoding", "gzip, deflate, br" } };
+    auto etag = FakeHttpdFetch(page).Header("ETag");
+    FakeHttpRequest revalidate = page;
+    revalidate.headers.emplace_back("If-None-Match", etag);
+    FakeHttpRequest scan;
+    scan.uri = "/scan";
+    REQUIRE(FakeHttpdFetch(scan).body.find("neighbour-19") != std::string::npos);
+    FakeHttpRequest status;
+    status.uri = "/status?job=1";
+    FakeHttpRequest submit;
+    submit.method = "POST";
+    submit.uri = "/submit";
+    submit.headers = { { "Content-Type", "application/x-www-form-urlencoded" } };
+    submit.body = "ssid=my%20home&password=correct%20horse%20battery%20staple";
+    // The clock stands still, so the first job stays busy and every other form is
+    // read and parsed, then refused
+    REQUIRE(FakeHttpdFetch(submit).status == 200);
+    REQUIRE(FakeHttpdFetch(submit).status == 503);
+
+    BENCHMARK("GET /") {
+        return FakeHttpdFetch(page);
+    };
+    BENCHMARK("GET / not modified") {
+        return FakeHttpdFetch(revalidate);
+    };
+    BENCHMARK("GET /scan with 21 APs") {
+        return FakeHttpdFetch(scan);
+    };
+    BENCHMARK("GET /status") {
+        return FakeHttpdFetch(status);
+    };
+    BENCHMARK("POST /submit") {
+        return FakeHttpdFetch(submit);
+    };
+    // The portal's own view of the load, as portal_load prints it
+    printf("/stats: %s\n", Get("/stats").body.c_str());
+}
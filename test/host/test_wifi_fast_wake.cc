@@ -0,0 +1,50 @@
+#include <catch2/catch.hpp>
+#include <cstring>
+#include "wifi_fast_wake.h"
+
+TEST_CASE("Fast wake state is only valid as sealed", "[fast_wake]") {
+    WifiFastWakeState state;
+    memset(&state, 0, sizeof(state));
+    CHECK(!state.IsValid());
+    strcpy(state.ssid, "home");
+    strcpy(state.password, "password123");
+    state.channel = 6;
+    IP4_ADDR(&state.ip, 10, 0, 0, 100);
+    state.lease_time = 1000;
+    state.Seal();
+    CHECK(state.magic == WIFI_FAST_WAKE_MAGIC);
+    CHECK(state.IsValid());
+
+    // Any byte after the CRC is covered by it
+    auto* bytes = reinterpret_cast<uint8_t*>(&state);
+    for (size_t i = 2 * sizeof(uint32_t); i < sizeof(state); i++) {
+        bytes[i] ^= 0x20;
+        CHECK(!state.IsValid());
+        bytes[i] ^= 0x20;
+    }
+    CHECK(state.IsValid());
+    state.magic = 0;
+    CHECK(!state.IsValid());
+
+    // Strings without a NUL are rejected even with a matching CRC
+    memset(state.ssid, 'a', sizeof(state.ssid));
+    state.Seal();
+    CHECK(!state.IsValid());
+}
+
+TEST_CASE("Fast wake lease is fresh for the reuse period only", "[fast_wake]") {
+    WifiFastWakeState state;
+    memset(&state, 0, sizeof(state));
+    IP4_ADDR(&state.ip, 10, 0, 0, 100);
+    state.lease_time = 1000;
+    CHECK(state.IsLeaseFresh(1000, 600));
+    CHECK(state.IsLeaseFresh(1599, 600));
+    CHECK(!state.IsLeaseFresh(1600, 600));
+    // The RTC clock went back, after a power cycle
+    CHECK(!state.IsLeaseFresh(999, 600));
+    state.lease_time = 0;
+    CHECK(!state.IsLeaseFresh(10, 600));
+    state.lease_time = 1000;
+    state.ip.addr = 0;
+    CHECK(!state.IsLeaseFresh(1000, 600));
+}
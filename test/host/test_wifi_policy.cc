@@ -0,0 +1,155 @@
+#include <catch2/catch.hpp>
+#include <cstring>
+#include "wifi_policy.h"
+
+static wifi_ap_record_t ApRecord(const char* ssid, int8_t rssi) {
+    wifi_ap_record_t record = {};
+    strncpy((char*)record.ssid, ssid, sizeof(record.ssid) - 1);
+    record.rssi = rssi;
+    record.authmode = WIFI_AUTH_WPA2_PSK;
+    return record;
+}
+
+static SsidItem Network(const char* ssid, int priority = 0) {
+    SsidItem item;
+    item.ssid = ssid;
+    item.priority = priority;
+    return item;
+}
+
+TEST_CASE("Disconnect reasons are classified", "[policy]") {
+    CHECK(ClassifyDisconnectReason(WIFI_REASON_AUTH_FAIL) == WifiDisconnectClass::FailFast);
+    CHECK(ClassifyDisconnectReason(WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT) == WifiDisconnectClass::FailFast);
+    CHECK(ClassifyDisconnectReason(WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY) == WifiDisconnectClass::FailFast);
+    CHECK(ClassifyDisconnectReason(WIFI_REASON_BEACON_TIMEOUT) == WifiDisconnectClass::RetryNow);
+    CHECK(ClassifyDisconnectReason(WIFI_REASON_ASSOC_LEAVE) == WifiDisconnectClass::RetryNow);
+    CHECK(ClassifyDisconnectReason(WIFI_REASON_NO_AP_FOUND) == WifiDisconnectClass::RetryWithBackoff);
+    CHECK(ClassifyDisconnectReason(0) == WifiDisconnectClass::RetryWithBackoff);
+}
+
+TEST_CASE("Reconnect delay grows exponentially up to the cap", "[policy]") {
+    WifiReconnectPolicy policy;
+    policy.jitter_percent = 0;
+    CHECK(GetReconnectDelayMs(policy, 1, 12345) == 500);
+    CHECK(GetReconnectDelayMs(policy, 2, 12345) == 1000);
+    CHECK(GetReconnectDelayMs(policy, 3, 12345) == 2000);
+    CHECK(GetReconnectDelayMs(policy, 8, 12345) == 60000);
+    CHECK(GetReconnectDelayMs(policy, 1000, 12345) == 60000);
+}
+
+TEST_CASE("Reconnect delay is spread by the jitter", "[policy]") {
+    WifiReconnectPolicy policy;
+    // 500 ms +-25%
+    CHECK(GetReconnectDelayMs(policy, 1, 0) == 375);
+    CHECK(GetReconnectDelayMs(policy, 1, 125) == 500);
+    CHECK(GetReconnectDelayMs(policy, 1, 250) == 625);
+    CHECK(GetReconnectDelayMs(policy, 1, 251) == 375);
+    for (uint32_t random = 0; random < 100000; random += 7919) {
+        auto delay_ms = GetReconnectDelayMs(policy, 20, random);
+        CHECK(delay_ms >= 45000);
+        CHECK(delay_ms <= 75000);
+    }
+}
+
+TEST_CASE("Out of range policy values are clamped", "[policy]") {
+    WifiReconnectPolicy policy;
+    policy.jitter_percent = 0;
+    policy.multiplier = 0;
+    CHECK(GetReconnectDelayMs(policy, 5, 0) == 500);
+    policy.multiplier = -3;
+    CHECK(GetReconnectDelayMs(policy, 5, 0) == 500);
+
+    policy.multiplier = 2;
+    policy.initial_delay_ms = -100;
+    CHECK(GetReconnectDelayMs(policy, 1, 0) == 0);
+    CHECK(GetReconnectDelayMs(policy, 10, 0) == 0);
+    policy.initial_delay_ms = 5000;
+    policy.max_delay_ms = 1000;
+    CHECK(GetReconnectDelayMs(policy, 1, 0) == 1000);
+    policy.max_delay_ms = -1;
+    CHECK(GetReconnectDelayMs(policy, 3, 0) == 0);
+
+    // Above 100% the jitter stays within 0..2x, below 0 it is off
+    policy.initial_delay_ms = 1000;
+    policy.max_delay_ms = 60000;
+    policy.jitter_percent = 500;
+    CHECK(GetReconnectDelayMs(policy, 1, 0) == 0);
+    CHECK(GetReconnectDelayMs(policy, 1, 2000) == 2000);
+    CHECK(GetReconnectDelayMs(policy, 1, 2001) == 0);
+    policy.jitter_percent = -50;
+    CHECK(GetReconnectDelayMs(policy, 1, 12345) == 1000);
+}
+
+TEST_CASE("Default strategy only skips the backoff of the first attempt after a lost link", "[policy]") {
+    WifiReconnectPolicy policy;
+    policy.jitter_percent = 0;
+    WifiReconnectAttempt attempt;
+    attempt.disconnect_class = WifiDisconnectClass::RetryNow;
+    CHECK(GetDefaultReconnectDelayMs(policy, attempt, 0) == 0);
+    attempt.attempt = 2;
+    CHECK(GetDefaultReconnectDelayMs(policy, attempt, 0) == 1000);
+    attempt.attempt = 1;
+    attempt.disconnect_class = WifiDisconnectClass::RetryWithBackoff;
+    CHECK(GetDefaultReconnectDelayMs(policy, attempt, 0) == 500);
+}
+
+TEST_CASE("Only the first reconnect attempt may be immediate", "[policy]") {
+    CHECK(ClampReconnectDelayMs(0, 1) == 0);
+    CHECK(ClampReconnectDelayMs(0, 2) == WIFI_MIN_RECONNECT_DELAY_MS);
+    CHECK(ClampReconnectDelayMs(50, 7) == WIFI_MIN_RECONNECT_DELAY_MS);
+    CHECK(ClampReconnectDelayMs(1500, 2) == 1500);
+}
+
+TEST_CASE("Network selection prefers priority, then signal", "[policy]") {
+    std::vector<SsidItem> networks = { Network("home"), Network("office", 1), Network("cafe") };
+    wifi_ap_record_t records[] = {
+        ApRecord("cafe", -40), ApRecord("home", -70), ApRecord("home", -50), ApRecord("neighbour", -30),
+    };
+    int network_index = -1;
+
+    SECTION("the strongest AP of equal priority networks") {
+        CHECK(SelectNetwork(networks, records, 4, &network_index) == 0);
+        CHECK(network_index == 2);
+        CHECK(SelectNetwork(networks, records + 1, 3, &network_index) == 1);
+        CHECK(network_index == 0);
+    }
+    SECTION("a higher priority network even if weaker") {
+        wifi_ap_record_t with_office[] = { records[0], records[2], ApRecord("office", -85) };
+        CHECK(SelectNetwork(networks, with_office, 3, &network_index) == 2);
+        CHECK(network_index == 1);
+    }
+    SECTION("no known network") {
+        CHECK(SelectNetwork(networks, records + 3, 1, &network_index) == -1);
+        CHECK(network_index == -1);
+        CHECK(SelectNetwork(networks, records, 0, &network_index) == -1);
+    }
+}
+
+TEST_CASE("Phase stats use the nearest rank percentile", "[policy]") {
+    std::vector<int> empty;
+    CHECK(GetPhaseStats(empty).count == 0);
+
+    std::vector<int> values;
+    for (int i = 100; i >= 1; i--) {
+        values.push_back(i * 10);
+    }
+    auto stats = GetPhaseStats(values);
+    CHECK(stats.count == 100);
+    CHECK(stats.min_ms == 10);
+    CHECK(stats.avg_ms == 505);
+    CHECK(stats.p95_ms == 950);
+
+    std::vector<int> one = { 42 };
+    stats = GetPhaseStats(one);
+    CHECK(stats.min_ms == 42);
+    CHECK(stats.p95_ms == 42);
+}
+
+TEST_CASE("Power save mode follows activity and traffic", "[policy]") {
+    WifiPowerSavePolicy policy;
+    CHECK(GetWantedPowerSaveMode(policy, WifiActivity::Streaming, 0) == WIFI_PS_NONE);
+    CHECK(GetWantedPowerSaveMode(policy, WifiActivity::Idle, policy.high_traffic) == WIFI_PS_NONE);
+    CHECK(GetWantedPowerSaveMode(policy, WifiActivity::Interactive, 0) == WIFI_PS_MIN_MODEM);
+    CHECK(GetWantedPowerSaveMode(policy, WifiActivity::Idle, policy.low_traffic) == WIFI_PS_MIN_MODEM);
+    CHECK(GetWantedPowerSaveMode(policy, WifiActivity::Idle, policy.low_traffic - 1) == WIFI_PS_MAX_MODEM);
+}
@@ -0,0 +1,31 @@
+#include <catch2/catch.hpp>
+#include "wifi_psk.h"
+
+TEST_CASE("PSK matches the IEEE 802.11i test vector", "[psk]") {
+    CHECK(WifiDerivePsk("IEEE", "password") == "f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e");
+    CHECK(WifiDerivePsk("ThisIsASSID", "ThisIsAPassword") == "0dc0d6eb90555ed6419756b9a15ec3e3209b63df707dd508d14581f8982721af");
+}
+
+TEST_CASE("PSK is not derived from an invalid passphrase or SSID", "[psk]") {
+    CHECK(WifiDerivePsk("home", "short").empty());
+    CHECK(WifiDerivePsk("home", std::string(64, 'a')).empty());
+    CHECK(WifiDerivePsk("", "password123").empty());
+    CHECK(WifiDerivePsk(std::string(33, 's'), "password123").empty());
+    CHECK(WifiDerivePsk(std::string(32, 's'), "password123").length() == 64);
+}
+
+TEST_CASE("PSK replaces the passphrase for WPA and WPA2 only", "[psk]") {
+    CHECK(WifiPskSupported(WIFI_AUTH_WPA_PSK));
+    CHECK(WifiPskSupported(WIFI_AUTH_WPA2_PSK));
+    CHECK(WifiPskSupported(WIFI_AUTH_WPA_WPA2_PSK));
+    CHECK(!WifiPskSupported(WIFI_AUTH_OPEN));
+    CHECK(!WifiPskSupported(WIFI_AUTH_WPA3_PSK));
+    CHECK(!WifiPskSupported(WIFI_AUTH_WPA2_WPA3_PSK));
+}
+
+// The cost the driver pays on every connection given the passphrase, and a stored PSK saves
+TEST_CASE("PSK derivation", "[.][benchmark]") {
+    BENCHMARK("WifiDerivePsk") {
+        return WifiDerivePsk("home", "password123");
+    };
+}
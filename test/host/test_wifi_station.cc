@@ -0,0 +1,676 @@
+#include <catch2/catch.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <cstring>
+#include "wifi_station.h"
+#include "ssid_manager.h"
+#include "wifi_psk.h"
+#include "esp_wifi.h"
+#include "lwip/etharp.h"
+#include "fake_clock.h"
+#include "fake_nvs.h"
+#include "fake_system.h"
+#include "fake_wifi.h"
+
+// Stops the station and puts the driver, NVS, the clock and the random generators back
+// to a known state, so a case can run several simulated starts in one process
+static WifiStation& ResetStation(uint32_t seed = 1) {
+    auto& station = WifiStation::GetInstance();
+    station.Stop();
+    SsidManager::GetInstance().Clear();
+    FakeClockReset();
+    FakeWifiReset(seed);
+    FakeNvsReset();
+    FakeRandomSeed(seed);
+    station.SetReconnectPolicy(WifiReconnectPolicy());
+    station.SetReconnectStrategy(nullptr);
+    // Use the networks of SsidManager
+    station.SetAuth("", "");
+    station.SetPowerSaveMode(true);
+    return station;
+}
+
+static FakeAp HomeAp() {
+    FakeAp ap;
+    ap.ssid = "home";
+    ap.password = "password123";
+    ap.channel = 6;
+    return ap;
+}
+
+// Starts the station and runs the clock until it has an IP, returns the time it took in ms
+static int StartAndWait(WifiStation& station) {
+    auto start = FakeClockNow();
+    station.StartAsync(nullptr);
+    REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 60000));
+    return (int)((FakeClockNow() - start) / 1000);
+}
+
+// Stops the station and lets the event loop deliver what the driver posted while stopping
+static void StopAndDrain(WifiStation& station) {
+    station.Stop();
+    FakeClockRunFor(10);
+}
+
+TEST_CASE("Station connects and records the phases of the connection", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+
+    bool done = false;
+    WifiStationResult result = WifiStationResult::Failed;
+    station.StartAsync([&](WifiStationResult r) {
+        result = r;
+        done = true;
+    }, 10000);
+    REQUIRE(FakeClockRunUntil([&] { return done; }, 20000));
+
+    CHECK(result == WifiStationResult::Connected);
+    CHECK(station.IsConnected());
+    CHECK(station.GetIpAddress() == "10.0.0.100");
+    CHECK(station.GetChannel() == 6);
+    auto records = station.GetConnectRecords();
+    REQUIRE(records.size() == 1);
+    auto& timing = FakeWifiGetTiming();
+    int connect_ms = 6 * timing.channel_scan_ms + timing.pbkdf2_ms + timing.connect_ms;
+    CHECK(records[0].attempts == 1);
+    CHECK(records[0].connect_ms == connect_ms);
+    CHECK(records[0].dhcp_ms == HomeAp().dhcp_ms);
+    CHECK(records[0].total_ms == connect_ms + HomeAp().dhcp_ms);
+}
+
+TEST_CASE("StartAsync without a network reports Failed after returning", "[station]") {
+    auto& station = ResetStation();
+    bool called = false;
+    WifiStationResult result = WifiStationResult::Connected;
+    CHECK(station.StartAsync([&](WifiStationResult r) {
+        result = r;
+        called = true;
+    }));
+    CHECK(!called);
+    FakeClockRunFor(10);
+    CHECK(called);
+    CHECK(result == WifiStationResult::Failed);
+    CHECK(FakeWifiGetCounters().connects == 0);
+}
+
+TEST_CASE("StartAsync reports Timeout and keeps trying", "[station]") {
+    auto& station = ResetStation();
+    station.SetAuth("home", "password123");
+    bool called = false;
+    WifiStationResult result = WifiStationResult::Connected;
+    station.StartAsync([&](WifiStationResult r) {
+        result = r;
+        called = true;
+    }, 3000);
+    FakeClockRunFor(2900);
+    CHECK(!called);
+    FakeClockRunFor(200);
+    CHECK(called);
+    CHECK(result == WifiStationResult::Timeout);
+
+    FakeWifiAddAp(HomeAp());
+    CHECK(FakeClockRunUntil([&] { return station.IsConnected(); }, 60000));
+}
+
+TEST_CASE("A second start is rejected while the station runs", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+    int calls = 0;
+    CHECK(station.StartAsync([&](WifiStationResult) { calls++; }));
+    CHECK(!station.StartAsync([&](WifiStationResult) { calls++; }));
+    REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 20000));
+    CHECK(!station.StartAsync(nullptr));
+    FakeClockRunFor(1000);
+    CHECK(calls == 1);
+}
+
+TEST_CASE("The station interface is created once", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+    StartAndWait(station);
+    StopAndDrain(station);
+    StartAndWait(station);
+    CHECK(FakeWifiGetCounters().netifs_created == 1);
+}
+
+TEST_CASE("A strategy returning 0 does not retry in a tight loop", "[station]") {
+    auto& station = ResetStation();
+    // Nothing to find and every attempt fails at once
+    FakeWifiGetTiming().channel_scan_ms = 0;
+    station.SetAuth("home", "password123");
+    station.SetReconnectStrategy([](const WifiReconnectAttempt&, uint32_t) -> int64_t { return 0; });
+    // Counted since boot
+    auto attempts_before = station.GetReconnectStats().attempts;
+
+    station.StartAsync(nullptr);
+    FakeClockRunFor(10000);
+
+    // One immediate attempt, then one every WIFI_MIN_RECONNECT_DELAY_MS
+    int connects = FakeWifiGetCounters().connects;
+    CHECK(connects >= 10000 / WIFI_MIN_RECONNECT_DELAY_MS);
+    CHECK(connects <= 10000 / WIFI_MIN_RECONNECT_DELAY_MS + 2);
+    // The next attempt may be waiting on the timer
+    auto attempts = station.GetReconnectStats().attempts - attempts_before;
+    CHECK(attempts >= (uint32_t)connects - 1);
+    CHECK(attempts <= (uint32_t)connects);
+}
+
+TEST_CASE("A lost link is retried at once", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+    StartAndWait(station);
+    // Counted since boot
+    auto recoveries = station.GetReconnectStats().recoveries;
+
+    std::vector<WifiState> states;
+    int id = station.Subscribe([&](WifiState, WifiState new_state) { states.push_back(new_state); });
+    FakeWifiDropLink(WIFI_REASON_BEACON_TIMEOUT);
+    REQUIRE(FakeClockRunUntil([&] { return !station.IsConnected(); }, 1000));
+    REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 20000));
+    station.Unsubscribe(id);
+
+    // No backoff state before the first attempt
+    REQUIRE(!states.empty());
+    CHECK(std::find(states.begin(), states.end(), WifiState::Backoff) == states.end());
+    auto stats = station.GetReconnectStats();
+    CHECK(stats.recoveries == recoveries + 1);
+    CHECK(stats.last_recover_time_ms > 0);
+}
+
+TEST_CASE("The AP of the last connection is cached and skips the scan", "[station]") {
+    auto& station = ResetStation();
+    auto ap = FakeWifiAddAp(HomeAp());
+    SsidManager::GetInstance().AddSsid("home", "password123");
+
+    int cold_ms = StartAndWait(station);
+    StopAndDrain(station);
+    auto list = SsidManager::GetInstance().GetSsidList();
+    REQUIRE(list.size() == 1);
+    CHECK(list[0].channel == 6);
+    CHECK(memcmp(list[0].bssid, ap.bssid, sizeof(ap.bssid)) == 0);
+    CHECK(list[0].authmode == WIFI_AUTH_WPA2_PSK);
+
+    int cached_ms = StartAndWait(station);
+    auto& config = FakeWifiGetStaConfig().sta;
+    CHECK(config.bssid_set);
+    CHECK(config.channel == 6);
+    // One channel instead of six, and the stored PSK instead of PBKDF2
+    auto& timing = FakeWifiGetTiming();
+    CHECK(cold_ms - cached_ms == 5 * timing.channel_scan_ms + timing.pbkdf2_ms);
+    CHECK(FakeWifiGetCounters().pbkdf2_runs == 1);
+}
+
+TEST_CASE("A cached AP that moved falls back to a full scan", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    StartAndWait(station);
+    StopAndDrain(station);
+
+    FakeWifiAps()[0].channel = 11;
+    // Counted since boot
+    auto not_found = station.GetDisconnectReasons()[WIFI_REASON_NO_AP_FOUND];
+    StartAndWait(station);
+    CHECK(!FakeWifiGetStaConfig().sta.bssid_set);
+    CHECK(station.GetChannel() == 11);
+    CHECK(SsidManager::GetInstance().GetSsidList()[0].channel == 11);
+    CHECK(station.GetDisconnectReasons()[WIFI_REASON_NO_AP_FOUND] == not_found + 1);
+}
+
+TEST_CASE("The passphrase and the stored PSK both connect", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    auto psk = WifiDerivePsk("home", "password123");
+    REQUIRE(SsidManager::GetInstance().GetSsidList()[0].psk == psk);
+
+    // Without a cached AP the driver gets the passphrase and runs PBKDF2 itself
+    StartAndWait(station);
+    CHECK(std::string((const char*)FakeWifiGetStaConfig().sta.password) == "password123");
+    CHECK(FakeWifiGetCounters().pbkdf2_runs == 1);
+    StopAndDrain(station);
+
+    // With it the driver gets the PSK, which only connects if it matches the AP's
+    StartAndWait(station);
+    auto& config = FakeWifiGetStaConfig().sta;
+    CHECK(std::string((const char*)config.password, sizeof(config.password)) == psk);
+    CHECK(FakeWifiGetCounters().pbkdf2_runs == 1);
+}
+
+TEST_CASE("A scan started by someone else is left alone", "[station]") {
+    auto& station = ResetStation();
+    FakeAp office = HomeAp();
+    office.ssid = "office";
+    office.bssid[5] = 2;
+    office.channel = 1;
+    FakeWifiAddAp(HomeAp());
+    FakeWifiAddAp(office);
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    SsidManager::GetInstance().AddSsid("office", "password123");
+    StartAndWait(station);
+    int connects = FakeWifiGetCounters().connects;
+
+    // Like the portal listing the networks
+    REQUIRE(esp_wifi_scan_start(nullptr, false) == ESP_OK);
+    FakeClockRunFor(5000);
+    CHECK(station.GetState() == WifiState::Connected);
+    CHECK(FakeWifiGetCounters().connects == connects);
+    uint16_t count = 0;
+    esp_wifi_scan_get_ap_num(&count);
+    CHECK(count == 2);
+}
+
+TEST_CASE("Link info is never read half written", "[station]") {
+    auto& station = ResetStation();
+    // Two APs whose fields all follow from the channel, toggled so the station moves between them
+    for (uint8_t channel : { 1, 11 }) {
+        FakeAp ap = HomeAp();
+        ap.channel = channel;
+        ap.bssid[5] = channel;
+        ap.rssi = -40 - channel;
+        ap.dhcp_ms = 1;
+        FakeWifiAddAp(ap);
+    }
+    FakeWifiAps()[1].present = false;
+    station.SetAuth("home", "password123");
+    StartAndWait(station);
+
+    std::atomic<bool> running = true;
+    std::atomic<int> reads = 0, torn = 0;
+    auto reader = [&] {
+        while (running) {
+            auto info = station.GetLinkInfo();
+            if (info.connected) {
+                uint8_t index = info.channel == 1 ? 0 : 1;
+                if (info.bssid[5] != info.channel || info.rssi != -40 - info.channel ||
+                    info.ip.addr != FakeWifiGetLeaseAddress(index).addr) {
+                    torn++;
+                }
+            }
+            reads++;
+        }
+    };
+    std::thread readers[] = { std::thread(reader), std::thread(reader) };
+    for (int i = 0; i < 2000; i++) {
+        FakeWifiAps()[i % 2].present = false;
+        FakeWifiAps()[(i + 1) % 2].present = true;
+        FakeWifiDropLink(WIFI_REASON_BEACON_TIMEOUT);
+        FakeClockRunUntil([&] { return !station.IsConnected(); }, 1000);
+        REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 60000));
+        FakeClockRunFor(3000);
+    }
+    running = false;
+    for (auto& thread : readers) {
+        thread.join();
+    }
+    CHECK(reads > 0);
+    CHECK(torn == 0);
+}
+
+TEST_CASE("A power save mode set before the start is applied", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+    station.SetPowerSaveMode(false);
+    StartAndWait(station);
+    CHECK(FakeWifiGetPowerSave() == WIFI_PS_NONE);
+    CHECK(station.GetPowerSaveStats().mode == WIFI_PS_NONE);
+
+    // And kept over a restart
+    StopAndDrain(station);
+    StartAndWait(station);
+    CHECK(FakeWifiGetPowerSave() == WIFI_PS_NONE);
+}
+
+TEST_CASE("Power save time only counts while started", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+    auto before = station.GetPowerSaveStats();
+    station.StartAsync(nullptr);
+    FakeClockRunFor(10000);
+    StopAndDrain(station);
+    FakeClockRunFor(50000);
+    station.SetPowerSaveMode(false);
+    station.StartAsync(nullptr);
+    FakeClockRunFor(5000);
+
+    auto stats = station.GetPowerSaveStats();
+    CHECK(stats.time_ms[WIFI_PS_MIN_MODEM] - before.time_ms[WIFI_PS_MIN_MODEM] == 10000);
+    CHECK(stats.time_ms[WIFI_PS_NONE] - before.time_ms[WIFI_PS_NONE] == 5000);
+    CHECK(stats.switches == before.switches);
+}
+
+TEST_CASE("Running out of attempts is reported as Failed before retrying", "[station]") {
+    auto& station = ResetStation();
+    station.SetAuth("home", "password123");
+    WifiReconnectPolicy policy;
+    policy.max_attempts = 2;
+    station.SetReconnectPolicy(policy);
+    std::vector<WifiState> states;
+    int id = station.Subscribe([&](WifiState, WifiState new_state) { states.push_back(new_state); });
+    station.StartAsync(nullptr);
+    FakeClockRunFor(30000);
+    station.Unsubscribe(id);
+
+    auto failed = std::find(states.begin(), states.end(), WifiState::Failed);
+    REQUIRE(failed != states.end());
+    REQUIRE(failed + 1 != states.end());
+    CHECK(*(failed + 1) == WifiState::Backoff);
+    // Only once per start
+    CHECK(std::count(states.begin(), states.end(), WifiState::Failed) == 1);
+}
+
+TEST_CASE("A change made by a subscriber is delivered after the current one", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.SetAuth("home", "password123");
+    std::vector<std::pair<WifiState, WifiState>> first, second;
+    int stopper = station.Subscribe([&](WifiState old_state, WifiState new_state) {
+        first.emplace_back(old_state, new_state);
+        if (new_state == WifiState::Connected) {
+            station.Stop();
+        }
+    });
+    int recorder = station.Subscribe([&](WifiState old_state, WifiState new_state) {
+        second.emplace_back(old_state, new_state);
+    });
+    station.StartAsync(nullptr);
+    FakeClockRunFor(20000);
+    station.Unsubscribe(stopper);
+    station.Unsubscribe(recorder);
+
+    // Both saw the same changes, each starting where the one before ended
+    CHECK(first == second);
+    REQUIRE(second.size() >= 2);
+    CHECK(second[second.size() - 2].second == WifiState::Connected);
+    CHECK(second.back() == std::make_pair(WifiState::Connected, WifiState::Idle));
+    for (size_t i = 1; i < second.size(); i++) {
+        CHECK(second[i].first == second[i - 1].second);
+    }
+}
+
+TEST_CASE("An adopted connection is recorded and its AP cached", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    SsidManager::GetInstance().AddSsid("home", "password123");
+
+    // Connect as the configuration AP does, without the station
+    esp_netif_init();
+    esp_netif_create_default_wifi_sta();
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    esp_wifi_init(&cfg);
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    wifi_config_t config = {};
+    strcpy((char*)config.sta.ssid, "home");
+    strcpy((char*)config.sta.password, "password123");
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+    esp_wifi_start();
+    FakeClockRunFor(10);
+    int64_t attempt_time = FakeClockNow();
+    esp_wifi_connect();
+    REQUIRE(FakeClockRunUntil([] { return FakeWifiIsAssociated(); }, 10000));
+    int64_t associated_time = FakeClockNow();
+    esp_netif_ip_info_t ip_info = {};
+    REQUIRE(FakeClockRunUntil([&] {
+        esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF"), &ip_info);
+        return ip_info.ip.addr != 0;
+    }, 10000));
+    int64_t got_ip_time = FakeClockNow();
+    FakeClockRunFor(500);
+
+    REQUIRE(station.AdoptConnection(attempt_time, associated_time, got_ip_time));
+    CHECK(station.IsConnected());
+    CHECK(station.GetIpAddress() == "10.0.0.100");
+    auto records = station.GetConnectRecords();
+    REQUIRE(!records.empty());
+    auto& timing = FakeWifiGetTiming();
+    int connect_ms = 6 * timing.channel_scan_ms + timing.pbkdf2_ms + timing.connect_ms;
+    CHECK(records.back().connect_ms == connect_ms);
+    CHECK(records.back().dhcp_ms == HomeAp().dhcp_ms);
+    CHECK(records.back().total_ms == connect_ms + HomeAp().dhcp_ms);
+    auto list = SsidManager::GetInstance().GetSsidList();
+    REQUIRE(list.size() == 1);
+    CHECK(list[0].channel == 6);
+    CHECK(memcmp(list[0].bssid, HomeAp().bssid, 6) == 0);
+
+    // The station follows the link from here
+    FakeWifiDropLink(WIFI_REASON_BEACON_TIMEOUT);
+    REQUIRE(FakeClockRunUntil([&] { return !station.IsConnected(); }, 1000));
+    CHECK(FakeClockRunUntil([&] { return station.IsConnected(); }, 60000));
+    StopAndDrain(station);
+}
+
+TEST_CASE("A started station does not adopt a connection", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    StartAndWait(station);
+    auto records = station.GetConnectRecords().size();
+    CHECK(!station.AdoptConnection());
+    CHECK(station.GetConnectRecords().size() == records);
+
+    // The events are still handled once
+    auto reasons = station.GetDisconnectReasons()[WIFI_REASON_BEACON_TIMEOUT];
+    FakeWifiDropLink(WIFI_REASON_BEACON_TIMEOUT);
+    REQUIRE(FakeClockRunUntil([&] { return !station.IsConnected(); }, 1000));
+    REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 60000));
+    CHECK(station.GetDisconnectReasons()[WIFI_REASON_BEACON_TIMEOUT] == reasons + 1);
+    CHECK(station.GetConnectRecords().size() == records + 1);
+    StopAndDrain(station);
+}
+
+// The RTC memory of the fast wake state lives as long as the process
+static void DeepSleep(WifiStation& station) {
+    StopAndDrain(station);
+    FakeSystemSetResetReason(ESP_RST_DEEPSLEEP);
+}
+
+TEST_CASE("Fast wake skips NVS and DHCP after a deep sleep only", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.EnableFastWake();
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    StartAndWait(station);
+    StopAndDrain(station);
+
+    // After any other reset the state in RTC memory is not used
+    FakeSystemSetResetReason(ESP_RST_SW);
+    int dhcp_requests = FakeWifiGetCounters().dhcp_requests;
+    StartAndWait(station);
+    CHECK(FakeWifiGetCounters().dhcp_requests == dhcp_requests + 1);
+
+    DeepSleep(station);
+    int writes = FakeNvsWriteCount();
+    StartAndWait(station);
+    CHECK(station.GetIpAddress() == "10.0.0.100");
+    // Nobody else has the address, it is kept
+    FakeClockRunFor(2000);
+    CHECK(FakeWifiGetCounters().dhcp_requests == dhcp_requests + 1);
+    // Same AP, nothing to write
+    CHECK(FakeNvsWriteCount() == writes);
+}
+
+TEST_CASE("Changing the stored networks invalidates the fast wake state", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.EnableFastWake();
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    StartAndWait(station);
+    StopAndDrain(station);
+
+    SsidManager::GetInstance().AddSsid("office", "secret123");
+    FakeSystemSetResetReason(ESP_RST_DEEPSLEEP);
+    auto counters = FakeWifiGetCounters();
+    StartAndWait(station);
+    // Both networks from NVS, picked by a scan
+    CHECK(FakeWifiGetCounters().scans == counters.scans + 1);
+    CHECK(FakeWifiGetCounters().dhcp_requests == counters.dhcp_requests + 1);
+}
+
+TEST_CASE("A fast wake network that is gone falls back to the stored networks", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    FakeAp office = HomeAp();
+    office.ssid = "office";
+    office.password = "secret123";
+    office.bssid[5] = 2;
+    office.channel = 11;
+    FakeWifiAddAp(office);
+    station.EnableFastWake();
+    SsidManager::GetInstance().AddSsid("home", "password123", 1);
+    SsidManager::GetInstance().AddSsid("office", "secret123");
+    StartAndWait(station);
+    REQUIRE(station.GetSsid() == "home");
+
+    DeepSleep(station);
+    FakeWifiAps()[0].present = false;
+    StartAndWait(station);
+    CHECK(station.GetSsid() == "office");
+    CHECK(station.GetIpAddress() == "10.0.1.100");
+    CHECK(SsidManager::GetInstance().GetSsidList()[1].channel == 11);
+}
+
+TEST_CASE("A reused address that another host answers for is replaced by DHCP", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    station.EnableFastWake();
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    StartAndWait(station);
+    REQUIRE(station.GetIpAddress() == "10.0.0.100");
+
+    // The DHCP server gave the address to someone else while we slept
+    DeepSleep(station);
+    FakeWifiAps()[0].hosts.push_back(FakeWifiGetLeaseAddress(0));
+    std::vector<uint32_t> reported;
+    esp_event_handler_instance_t instance;
+    esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, [](void* arg, esp_event_base_t, int32_t, void* data) {
+        static_cast<std::vector<uint32_t>*>(arg)->push_back(static_cast<ip_event_got_ip_t*>(data)->ip_info.ip.addr);
+    }, &reported, &instance);
+    int dhcp_requests = FakeWifiGetCounters().dhcp_requests;
+    StartAndWait(station);
+    esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance);
+    // The probe found the host before the address was set, it was never used
+    CHECK(station.GetIpAddress() == "10.0.0.101");
+    REQUIRE(reported.size() == 1);
+    CHECK(reported[0] == FakeWifiGetLeaseAddress(0).addr);
+    CHECK(FakeWifiGetCounters().dhcp_requests == dhcp_requests + 1);
+
+    // The new lease is the one reused on the next wake
+    DeepSleep(station);
+    StartAndWait(station);
+    CHECK(station.GetIpAddress() == "10.0.0.101");
+    CHECK(FakeWifiGetCounters().dhcp_requests == dhcp_requests + 1);
+}
+
+TEST_CASE("A simulated host answers a probe but not a request from its own address", "[station]") {
+    auto& station = ResetStation();
+    FakeWifiAddAp(HomeAp());
+    SsidManager::GetInstance().AddSsid("home", "password123");
+    StartAndWait(station);
+    esp_ip4_addr_t own = FakeWifiGetLeaseAddress(0);
+    FakeWifiAps()[0].hosts.push_back(own);
+    auto* netif = static_cast<struct netif*>(esp_netif_get_netif_impl(esp_netif_get_handle_from_ifkey("WIFI_STA_DEF")));
+    ip4_addr_t target = { own.addr };
+    auto answered = [&] {
+        struct eth_addr* eth;
+        const ip4_addr_t* ip;
+        return etharp_find_addr(netif, &target, &eth, &ip) >= 0;
+    };
+
+    // Sent from the address the host has, dropped as a martian source
+    REQUIRE(etharp_query(netif, &target, NULL) == ERR_OK);
+    FakeClockRunFor(100);
+    CHECK_FALSE(answered());
+
+    // The same request as a probe from 0.0.0.0 is answered
+    esp_netif_t* sta_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    esp_netif_dhcpc_stop(sta_netif);
+    esp_netif_ip_info_t none = {};
+    esp_netif_set_ip_info(sta_netif, &none);
+    REQUIRE(etharp_query(netif, &target, NULL) == ERR_OK);
+    CHECK_FALSE(answered());
+    FakeClockRunFor(100);
+    CHECK(answered());
+}
+
+static int Percentile(std::vector<int> values, int percent) {
+    std::sort(values.begin(), values.end());
+    size_t rank = (values.size() * percent + 99) / 100;
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+// Not a check: prints the time to the first IP and to recover a lost link, and the
+// attempts it took, for a few policies against an AP that fails 40% of the associations
+TEST_CASE("Reconnect policies on a flaky AP", "[.][simulation]") {
+    struct Candidate {
+        const char* name;
+        WifiReconnectPolicy policy;
+        WifiReconnectStrategy strategy;
+    };
+    WifiReconnectPolicy fast;
+    fast.initial_delay_ms = 200;
+    fast.max_delay_ms = 5000;
+    std::vector<Candidate> candidates = {
+        { "default", WifiReconnectPolicy(), nullptr },
+        { "200 ms initial, 5 s cap", fast, nullptr },
+        { "fixed 2 s", WifiReconnectPolicy(), [](const WifiReconnectAttempt&, uint32_t) -> int64_t { return 2000; } },
+        { "immediate (clamped)", WifiReconnectPolicy(), [](const WifiReconnectAttempt&, uint32_t) -> int64_t { return 0; } },
+    };
+    const int runs = 200;
+
+    printf("%-26s %18s %18s %14s\n", "policy", "start p50/p95 ms", "recover p50/p95", "attempts avg");
+    for (auto& candidate : candidates) {
+        std::vector<int> start_ms, recover_ms;
+        int attempts = 0;
+        for (int seed = 1; seed <= runs; seed++) {
+            auto& station = ResetStation(seed);
+            auto ap = HomeAp();
+            ap.failure_probability = 0.4;
+            FakeWifiAddAp(ap);
+            station.SetAuth("home", "password123");
+            station.SetReconnectPolicy(candidate.policy);
+            station.SetReconnectStrategy(candidate.strategy);
+
+            station.StartAsync(nullptr);
+            REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 3600 * 1000));
+            start_ms.push_back((int)((FakeClockNow() - FAKE_CLOCK_BOOT_US) / 1000));
+            CHECK(station.GetConnectRecords().back().total_ms == start_ms.back());
+            attempts += station.GetConnectRecords().back().attempts;
+
+            FakeWifiDropLink(WIFI_REASON_BEACON_TIMEOUT);
+            REQUIRE(FakeClockRunUntil([&] { return !station.IsConnected(); }, 1000));
+            REQUIRE(FakeClockRunUntil([&] { return station.IsConnected(); }, 3600 * 1000));
+            recover_ms.push_back(station.GetReconnectStats().last_recover_time_ms);
+            attempts += station.GetConnectRecords().back().attempts;
+        }
+        printf("%-26s %8d/%-9d %8d/%-9d %14.2f\n", candidate.name,
+            Percentile(start_ms, 50), Percentile(start_ms, 95),
+            Percentile(recover_ms, 50), Percentile(recover_ms, 95), attempts / (2.0 * runs));
+    }
+    WifiStation::GetInstance().Stop();
+}
+
+// Not a check: prints the time to the IP with a full scan and with the cached AP for
+// APs on a few channels. The driver stops scanning on the first channel with a match.
+TEST_CASE("Cold scan against the cached AP", "[.][simulation]") {
+    printf("%-8s %10s %10s\n", "channel", "cold ms", "cached ms");
+    for (uint8_t channel : { 1, 6, 11, 13 }) {
+        auto& station = ResetStation();
+        auto ap = HomeAp();
+        ap.channel = channel;
+        FakeWifiAddAp(ap);
+        SsidManager::GetInstance().AddSsid("home", "password123");
+        int cold_ms = StartAndWait(station);
+        StopAndDrain(station);
+        int cached_ms = StartAndWait(station);
+        printf("%-8d %10d %10d\n", channel, cold_ms, cached_ms);
+    }
+    WifiStation::GetInstance().Stop();
+}
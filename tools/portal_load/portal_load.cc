@@ -0,0 +1,376 @@
+// Loads the configuration portal with N clients, each on its own thread and
+// connection, and reports the throughput, the latency percentiles, the failed
+// connections and resets, and the load seen by the device through /stats.
+//
+//   portal_load [-h host] [-p port] [-c clients] [-d seconds] [-k]
+//               [-P path:body] [-t content-type] [path ...]
+//
+// Paths default to "/" "/scan" "/status?job=0", taken in turn. -P adds a POST of
+// the body to the turn, @file reads it from a file; -t sets its Content-Type,
+// form-urlencoded by default. With -k a client keeps its connection for the next
+// request, otherwise it connects every time.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Request {
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+struct Options {
+    std::string host = "192.168.4.1";
+    int port = 80;
+    int clients = 4;
+    int seconds = 10;
+    bool keep_alive = false;
+    std::string content_type = "application/x-www-form-urlencoded";
+    std::vector<Request> requests;
+};
+
+struct Totals {
+    std::mutex mutex;
+    std::vector<double> latencies_ms;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t connect_failures = 0;
+    uint64_t resets = 0;
+    uint64_t timeouts = 0;
+    uint64_t http_errors = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+int Connect(const Options& options) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+enum class Outcome { Ok, Reset, Timeout, HttpError };
+
+// Reads one response, by Content-Length, chunked encoding, or until the server closes
+class ResponseReader {
+public:
+    explicit ResponseReader(int fd) : fd_(fd) {}
+
+    Outcome Read(size_t* body_bytes, bool* server_closes) {
+        std::string head;
+        size_t end;
+        while ((end = buffer_.find("\r\n\r\n")) == std::string::npos) {
+            Outcome outcome = Fill();
+            if (outcome != Outcome::Ok) {
+                return outcome;
+            }
+        }
+        head = buffer_.substr(0, end);
+        buffer_.erase(0, end + 4);
+        std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+
+        int status = 0;
+        sscanf(head.c_str(), "http/1.%*d %d", &status);
+        *server_closes = head.find("connection: close") != std::string::npos ||
+            (head.compare(0, 8, "http/1.0") == 0 && head.find("connection: keep-alive") == std::string::npos);
+        *body_bytes = 0;
+        size_t pos = head.find("content-length:");
+        if (pos != std::string::npos) {
+            size_t length = strtoul(head.c_str() + pos + 15, nullptr, 10);
+            Outcome outcome = Skip(length);
+            *body_bytes = length;
+            if (outcome != Outcome::Ok) {
+                return outcome;
+            }
+        } else if (head.find("transfer-encoding: chunked") != std::string::npos) {
+            while (true) {
+                while ((end = buffer_.find("\r\n")) == std::string::npos) {
+                    Outcome outcome = Fill();
+                    if (outcome != Outcome::Ok) {
+                        return outcome;
+                    }
+                }
+                size_t length = strtoul(buffer_.c_str(), nullptr, 16);
+                buffer_.erase(0, end + 2);
+                Outcome outcome = Skip(length + 2);
+                if (outcome != Outcome::Ok) {
+                    return outcome;
+                }
+                *body_bytes += length;
+                if (length == 0) {
+                    break;
+                }
+            }
+        } else {
+            *server_closes = true;
+            while (Fill() == Outcome::Ok) {
+            }
+            *body_bytes = buffer_.size();
+            buffer_.clear();
+        }
+        return status >= 200 && status < 400 ? Outcome::Ok : Outcome::HttpError;
+    }
+
+private:
+    int fd_;
+    std::string buffer_;
+
+    Outcome Fill() {
+        char data[4096];
+        ssize_t n = recv(fd_, data, sizeof(data), 0);
+        if (n > 0) {
+            buffer_.append(data, n);
+            return Outcome::Ok;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Outcome::Timeout;
+        }
+        // Closed before the response was complete
+        return Outcome::Reset;
+    }
+
+    Outcome Skip(size_t length) {
+        while (buffer_.size() < length) {
+            Outcome outcome = Fill();
+            if (outcome != Outcome::Ok) {
+                return outcome;
+            }
+        }
+        buffer_.erase(0, length);
+        return Outcome::Ok;
+    }
+};
+
+void RunClient(const Options& options, int index, Clock::time_point deadline, Totals& totals) {
+    std::vector<double> latencies;
+    uint64_t requests = 0, bytes = 0, connect_failures = 0, resets = 0, timeouts = 0, http_errors = 0;
+    int fd = -1;
+    std::unique_ptr<ResponseReader> reader;
+    size_t request_index = index;
+
+    while (Clock::now() < deadline) {
+        const Request& next = options.requests[request_index++ % options.requests.size()];
+        auto start = Clock::now();
+        if (fd < 0) {
+            fd = Connect(options);
+            if (fd < 0) {
+                connect_failures++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            reader = std::make_unique<ResponseReader>(fd);
+        }
+
+        std::string request = next.method + " " + next.path + " HTTP/1.1\r\nHost: " + options.host +
+            "\r\nAccept-Encoding: gzip\r\n" + (options.keep_alive ? "" : "Connection: close\r\n");
+        if (next.method == "POST") {
+            request += "Content-Type: " + options.content_type + "\r\nContent-Length: " +
+                std::to_string(next.body.size()) + "\r\n";
+        }
+        request += "\r\n" + next.body;
+        size_t body_bytes = 0;
+        bool server_closes = false;
+        Outcome outcome;
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+            outcome = errno == EAGAIN ? Outcome::Timeout : Outcome::Reset;
+        } else {
+            outcome = reader->Read(&body_bytes, &server_closes);
+        }
+
+        switch (outcome) {
+        case Outcome::Ok:
+            requests++;
+            bytes += body_bytes;
+            latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+            break;
+        case Outcome::HttpError:
+            http_errors++;
+            break;
+        case Outcome::Reset:
+            resets++;
+            break;
+        case Outcome::Timeout:
+            timeouts++;
+            break;
+        }
+        if (outcome == Outcome::Reset || outcome == Outcome::Timeout || server_closes || !options.keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    std::lock_guard<std::mutex> lock(totals.mutex);
+    totals.latencies_ms.insert(totals.latencies_ms.end(), latencies.begin(), latencies.end());
+    totals.requests += requests;
+    totals.bytes += bytes;
+    totals.connect_failures += connect_failures;
+    totals.resets += resets;
+    totals.timeouts += timeouts;
+    totals.http_errors += http_errors;
+}
+
+double Percentile(const std::vector<double>& sorted, int percent) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = (sorted.size() * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// The device's own view: open sockets, handler latency and the lowest free heap
+std::string FetchStats(const Options& options) {
+    int fd = Connect(options);
+    if (fd < 0) {
+        return "";
+    }
+    std::string request = "GET /stats HTTP/1.1\r\nHost: " + options.host + "\r\nConnection: close\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string response;
+    char data[1024];
+    ssize_t n;
+    while ((n = recv(fd, data, sizeof(data), 0)) > 0) {
+        response.append(data, n);
+    }
+    close(fd);
+    size_t body = response.find("\r\n\r\n");
+    return body == std::string::npos ? "" : response.substr(body + 4);
+}
+
+void Usage() {
+    fprintf(stderr, "usage: portal_load [-h host] [-p port] [-c clients] [-d seconds] [-k]\n"
+        "                   [-P path:body] [-t content-type] [path ...]\n");
+    exit(2);
+}
+
+// path:body or path:@file
+Request ParsePost(const std::string& arg) {
+    size_t colon = arg.find(':');
+    if (colon == std::string::npos || colon == 0) {
+        Usage();
+    }
+    Request request = { "POST", arg.substr(0, colon), arg.substr(colon + 1) };
+    if (!request.body.empty() && request.body[0] == '@') {
+        std::ifstream file(request.body.substr(1), std::ios::binary);
+        if (!file) {
+            fprintf(stderr, "cannot read %s\n", request.body.c_str() + 1);
+            exit(2);
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        request.body = contents.str();
+    }
+    return request;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:kP:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            break;
+        case 'c':
+            options.clients = atoi(optarg);
+            break;
+        case 'd':
+            options.seconds = atoi(optarg);
+            break;
+        case 'k':
+            options.keep_alive = true;
+            break;
+        case 'P':
+            options.requests.push_back(ParsePost(optarg));
+            break;
+        case 't':
+            options.content_type = optarg;
+            break;
+        default:
+            Usage();
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        options.requests.push_back({ "GET", argv[i], "" });
+    }
+    if (options.requests.empty()) {
+        for (auto path : { "/", "/scan", "/status?job=0" }) {
+            options.requests.push_back({ "GET", path, "" });
+        }
+    }
+    if (options.clients <= 0 || options.seconds <= 0) {
+        Usage();
+    }
+
+    std::string before = FetchStats(options);
+    printf("Device before: %s\n", before.empty() ? "no /stats" : before.c_str());
+
+    Totals totals;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::seconds(options.seconds);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.clients; i++) {
+        threads.emplace_back(RunClient, std::cref(options), i, deadline, std::ref(totals));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    auto& latencies = totals.latencies_ms;
+    std::sort(latencies.begin(), latencies.end());
+    printf("%d clients, %s, %.1f s\n", options.clients, options.keep_alive ? "keep-alive" : "new connection per request", elapsed);
+    printf("Requests:    %llu, %.1f/s, %.1f KB/s\n", (unsigned long long)totals.requests,
+        totals.requests / elapsed, totals.bytes / elapsed / 1024);
+    printf("Latency ms:  p50 %.1f, p95 %.1f, p99 %.1f, max %.1f\n", Percentile(latencies, 50),
+        Percentile(latencies, 95), Percentile(latencies, 99), latencies.empty() ? 0 : latencies.back());
+    printf("Failures:    %llu connect, %llu reset, %llu timeout, %llu HTTP error\n",
+        (unsigned long long)totals.connect_failures, (unsigned long long)totals.resets,
+        (unsigned long long)totals.timeouts, (unsigned long long)totals.http_errors);
+
+    // min_free_heap is the low-water mark since boot, the peak heap use
+    std::string after = FetchStats(options);
+    printf("Device after: %s\n", after.empty() ? "no /stats" : after.c_str());
+    return 0;
+}
@@ -1,8 +1,19 @@
 #include "wifi_configuration_ap.h"
+#include "ssid_manager.h"
+#include "wifi_station.h"
+#include "json_writer.h"
+#include "form_parser.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <esp_err.h>
 #include <esp_event.h>
 #include <esp_wifi.h>
@@ -10,15 +21,31 @@
 #include <esp_mac.h>
 #include <esp_netif.h>
 #include <lwip/ip_addr.h>
+#include <lwip/sockets.h>
+#include <esp_system.h>
 #include <nvs.h>
 #include <nvs_flash.h>
+#include <esp_timer.h>
 
 #define TAG "WifiConfigurationAp"
 
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
-
-extern const char index_html_start[] asm("_binary_wifi_configuration_ap_html_start");
+#define WIFI_GOT_IP_BIT    BIT2
+// Stop scanning when no page has asked for the AP list for this long
+#define SCAN_IDLE_TIMEOUT_MS 30000
+// Smaller RSSI changes are not pushed to the event streams
+#define SCAN_RSSI_CHANGE_THRESHOLD 3
+#define MAX_EVENT_CLIENTS 2
+#define MAX_FORM_SIZE 1024
+// Longest wait for the event streams to get the result before the web server stops
+#define HANDOVER_FLUSH_TIMEOUT_MS 5000
+#define DISCONNECT_WAIT_MS 1000
+
+extern const char index_html_start[] asm("_binary_wifi_configuration_ap_html_gz_start");
+extern const char index_html_end[] asm("_binary_wifi_configuration_ap_html_gz_end");
+extern const char index_plain_start[] asm("_binary_wifi_configuration_ap_html_start");
+extern const char index_plain_end[] asm("_binary_wifi_configuration_ap_html_end");
 
 WifiConfigurationAp& WifiConfigurationAp::GetInstance() {
     static WifiConfigurationAp instance;
@@ -28,13 +55,37 @@ WifiConfigurationAp& WifiConfigurationAp::GetInstance() {
 WifiConfigurationAp::WifiConfigurationAp()
 {
     event_group_ = xEventGroupCreate();
+    handover_flushed_ = xSemaphoreCreateBinary();
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            auto* self = static_cast<WifiConfigurationAp*>(arg);
+            if (self->event_client_count_ > 0 ||
+                esp_timer_get_time() - self->scan_request_time_ < SCAN_IDLE_TIMEOUT_MS * 1000LL) {
+                self->StartScan();
+            }
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_ap_scan",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &scan_timer_));
 }
 
 WifiConfigurationAp::~WifiConfigurationAp()
 {
+    dns_server_.Stop();
+    if (scan_timer_) {
+        esp_timer_stop(scan_timer_);
+        esp_timer_delete(scan_timer_);
+    }
     if (event_group_) {
         vEventGroupDelete(event_group_);
     }
+    if (handover_flushed_) {
+        vSemaphoreDelete(handover_flushed_);
+    }
     // Unregister event handlers if they were registered
     if (instance_any_id_) {
         esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id_);
@@ -63,8 +114,21 @@ void WifiConfigurationAp::Start()
                                                         this,
                                                         &instance_got_ip_));
 
+    // A network provisioned here replaces the one kept for fast wake
+    WifiStation::GetInstance().ClearFastWake();
+
     StartAccessPoint();
     StartWebServer();
+
+    // Resolve every name to the portal so that phones open it on their own
+    esp_ip4_addr_t address;
+    IP4_ADDR(&address, 192, 168, 4, 1);
+    dns_server_.Start(address);
+
+    // Have the AP list ready when the first page is opened
+    scan_request_time_ = esp_timer_get_time();
+    StartScan();
+    esp_timer_start_periodic(scan_timer_, scan_interval_ms_ * 1000LL);
 }
 
 std::string WifiConfigurationAp::GetSsid()
@@ -92,7 +156,10 @@ void WifiConfigurationAp::StartAccessPoint()
     ESP_ERROR_CHECK(esp_netif_init());
 
     // Create the default event loop
-    auto netif = esp_netif_create_default_wifi_ap();
+    ap_netif_ = esp_netif_create_default_wifi_ap();
+    auto netif = ap_netif_;
+    // The station interface gets an IP from the network being provisioned
+    esp_netif_create_default_wifi_sta();
 
     // Set the router IP address to 192.168.4.1
     esp_netif_ip_info_t ip_info;
@@ -125,20 +192,73 @@ void WifiConfigurationAp::StartAccessPoint()
 
 void WifiConfigurationAp::StartWebServer()
 {
+    // Connecting is handed over to the worker task
+    job_queue_ = xQueueCreate(1, sizeof(ProvisioningJob));
+    xTaskCreate([](void *arg) {
+        static_cast<WifiConfigurationAp *>(arg)->WorkerTask();
+        vTaskDelete(NULL);
+    }, "wifi_ap_worker", 4096, this, 5, NULL);
+
     // Start the web server
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.max_uri_handlers = 16;
+    // Two browsers open up to 6 connections each, drop the idle ones instead of refusing
+    // new ones. One socket less than the default leaves room for the DNS server.
+    config.lru_purge_enable = true;
+    config.max_open_sockets = 6;
+    config.global_user_ctx = this;
+    // Not allocated, httpd_stop() would free() it by default
+    config.global_user_ctx_free_fn = [](void *ctx) {};
+    config.open_fn = [](httpd_handle_t hd, int sockfd) -> esp_err_t {
+        auto *this_ = static_cast<WifiConfigurationAp *>(httpd_get_global_user_ctx(hd));
+        std::lock_guard<std::mutex> lock(this_->portal_stats_mutex_);
+        auto& stats = this_->portal_stats_;
+        stats.open_sockets++;
+        if (stats.open_sockets > stats.max_open_sockets) {
+            stats.max_open_sockets = stats.open_sockets;
+        }
+        return ESP_OK;
+    };
+    // Runs on the httpd task, also when the socket of an event stream is purged or reset
+    config.close_fn = [](httpd_handle_t hd, int sockfd) {
+        auto *this_ = static_cast<WifiConfigurationAp *>(httpd_get_global_user_ctx(hd));
+        auto& clients = this_->event_clients_;
+        for (auto it = clients.begin(); it != clients.end(); ++it) {
+            if (httpd_req_to_sockfd(*it) == sockfd) {
+                httpd_req_async_handler_complete(*it);
+                clients.erase(it);
+                this_->event_client_count_ = clients.size();
+                break;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(this_->portal_stats_mutex_);
+            this_->portal_stats_.open_sockets--;
+        }
+        close(sockfd);
+    };
     ESP_ERROR_CHECK(httpd_start(&server_, &config));
 
+    // The page only changes with the firmware, hash it once for the ETag
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char* p = index_html_start; p < index_html_end; p++) {
+        hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+    }
+    snprintf(index_etag_, sizeof(index_etag_), "\"%08lx%08lx\"",
+        (unsigned long)(hash >> 32), (unsigned long)(hash & 0xFFFFFFFF));
+    snprintf(index_plain_etag_, sizeof(index_plain_etag_), "\"%08lx%08lx-identity\"",
+        (unsigned long)(hash >> 32), (unsigned long)(hash & 0xFFFFFFFF));
+
     // Register the index.html file
     httpd_uri_t index_html = {
         .uri = "/",
         .method = HTTP_GET,
         .handler = [](httpd_req_t *req) -> esp_err_t {
-            httpd_resp_send(req, index_html_start, strlen(index_html_start));
-            return ESP_OK;
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            return this_->HandleTimed(req, &WifiConfigurationAp::SendIndex);
         },
-        .user_ctx = NULL
+        .user_ctx = this
     };
     ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &index_html));
 
@@ -147,163 +267,701 @@ void WifiConfigurationAp::StartWebServer()
         .uri = "/scan",
         .method = HTTP_GET,
         .handler = [](httpd_req_t *req) -> esp_err_t {
-            esp_wifi_scan_start(nullptr, true);
-            uint16_t ap_num = 0;
-            esp_wifi_scan_get_ap_num(&ap_num);
-            wifi_ap_record_t *ap_records = (wifi_ap_record_t *)malloc(ap_num * sizeof(wifi_ap_record_t));
-            esp_wifi_scan_get_ap_records(&ap_num, ap_records);
-
-            // Send the scan results as JSON
-            httpd_resp_set_type(req, "application/json");
-            httpd_resp_sendstr_chunk(req, "[");
-            for (int i = 0; i < ap_num; i++) {
-                ESP_LOGI(TAG, "SSID: %s, RSSI: %d, Authmode: %d",
-                    (char *)ap_records[i].ssid, ap_records[i].rssi, ap_records[i].authmode);
-                char buf[128];
-                snprintf(buf, sizeof(buf), "{\"ssid\":\"%s\",\"rssi\":%d,\"authmode\":%d}",
-                    (char *)ap_records[i].ssid, ap_records[i].rssi, ap_records[i].authmode);
-                httpd_resp_sendstr_chunk(req, buf);
-                if (i < ap_num - 1) {
-                    httpd_resp_sendstr_chunk(req, ",");
-                }
-            }
-            httpd_resp_sendstr_chunk(req, "]");
-            httpd_resp_sendstr_chunk(req, NULL);
-            free(ap_records);
-            return ESP_OK;
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            return this_->HandleTimed(req, &WifiConfigurationAp::SendScanResult);
         },
-        .user_ctx = NULL
+        .user_ctx = this
     };
     ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &scan));
 
-    // Register the form submission
+    // Register the stream of AP list changes
+    httpd_uri_t events = {
+        .uri = "/events",
+        .method = HTTP_GET,
+        .handler = [](httpd_req_t *req) -> esp_err_t {
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            return this_->HandleTimed(req, &WifiConfigurationAp::HandleEvents);
+        },
+        .user_ctx = this
+    };
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &events));
+
+    // Register the form submission, it only queues a job since connecting takes seconds
     httpd_uri_t form_submit = {
         .uri = "/submit",
         .method = HTTP_POST,
         .handler = [](httpd_req_t *req) -> esp_err_t {
-            char buf[128];
-            int ret = httpd_req_recv(req, buf, sizeof(buf));
-            if (ret <= 0) {
-                if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-                    httpd_resp_send_408(req);
-                }
-                return ESP_FAIL;
-            }
-            buf[ret] = '\0';
-            ESP_LOGI(TAG, "Received form data: %s", buf);
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            return this_->HandleTimed(req, &WifiConfigurationAp::HandleSubmit);
+        },
+        .user_ctx = this
+    };
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &form_submit));
+
+    // Register the progress of the submitted job
+    httpd_uri_t status = {
+        .uri = "/status",
+        .method = HTTP_GET,
+        .handler = [](httpd_req_t *req) -> esp_err_t {
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            return this_->HandleTimed(req, &WifiConfigurationAp::SendJobStatus);
+        },
+        .user_ctx = this
+    };
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &status));
+
+    // Register the load on the web server, read by tools/portal_load
+    httpd_uri_t stats = {
+        .uri = "/stats",
+        .method = HTTP_GET,
+        .handler = [](httpd_req_t *req) -> esp_err_t {
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            return this_->HandleTimed(req, &WifiConfigurationAp::SendPortalStats);
+        },
+        .user_ctx = this
+    };
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &stats));
 
-            std::string decoded = UrlDecode(buf);
-            ESP_LOGI(TAG, "Decoded form data: %s", decoded.c_str());
+    // Connectivity checks of Android, iOS/macOS, Windows and Firefox. Redirecting them
+    // instead of giving the expected answer makes the OS show the portal
+    static const char* const probe_uris[] = {
+        "/generate_204", "/gen_204", "/hotspot-detect.html", "/library/test/success.html",
+        "/ncsi.txt", "/connecttest.txt", "/redirect", "/canonical.html", "/success.txt",
+    };
+    for (auto uri : probe_uris) {
+        httpd_uri_t probe = {
+            .uri = uri,
+            .method = HTTP_GET,
+            .handler = [](httpd_req_t *req) -> esp_err_t {
+                return RedirectToPortal(req);
+            },
+            .user_ctx = NULL
+        };
+        ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &probe));
+    }
+    // Any other page also leads to the portal
+    httpd_register_err_handler(server_, HTTPD_404_NOT_FOUND, [](httpd_req_t *req, httpd_err_code_t err) -> esp_err_t {
+        return RedirectToPortal(req);
+    });
+
+    ESP_LOGI(TAG, "Web server started");
+}
 
-            // Parse the form data
-            char ssid[32], password[64];
-            if (sscanf(decoded.c_str(), "ssid=%32[^&]&password=%64s", ssid, password) != 2) {
-                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid form data");
-                return ESP_FAIL;
+esp_err_t WifiConfigurationAp::HandleTimed(httpd_req_t *req, esp_err_t (WifiConfigurationAp::*handler)(httpd_req_t *req))
+{
+    auto start_time = esp_timer_get_time();
+    esp_err_t ret = (this->*handler)(req);
+    int latency_ms = (int)((esp_timer_get_time() - start_time) / 1000);
+
+    std::lock_guard<std::mutex> lock(portal_stats_mutex_);
+    auto& stats = portal_stats_;
+    stats.requests++;
+    latency_total_ms_ += latency_ms;
+    stats.average_latency_ms = (int)(latency_total_ms_ / stats.requests);
+    if (latency_ms > stats.max_latency_ms) {
+        stats.max_latency_ms = latency_ms;
+    }
+    stats.min_free_heap = esp_get_minimum_free_heap_size();
+    return ret;
+}
+
+WifiPortalStats WifiConfigurationAp::GetPortalStats()
+{
+    std::lock_guard<std::mutex> lock(portal_stats_mutex_);
+    return portal_stats_;
+}
+
+esp_err_t WifiConfigurationAp::SendPortalStats(httpd_req_t *req)
+{
+    auto stats = GetPortalStats();
+    char response[192];
+    snprintf(response, sizeof(response),
+        "{\"requests\":%lu,\"open_sockets\":%d,\"max_open_sockets\":%d,\"average_latency_ms\":%d,"
+        "\"max_latency_ms\":%d,\"min_free_heap\":%lu,\"free_heap\":%lu}",
+        (unsigned long)stats.requests, stats.open_sockets, stats.max_open_sockets, stats.average_latency_ms,
+        stats.max_latency_ms, (unsigned long)stats.min_free_heap, (unsigned long)esp_get_free_heap_size());
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t WifiConfigurationAp::RedirectToPortal(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "302 Found");
+    httpd_resp_set_hdr(req, "Location", "http://192.168.4.1/");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    return httpd_resp_send(req, NULL, 0);
+}
+
+// Whether an Accept-Encoding value allows gzip, a weight of 0 refuses it
+static bool AcceptsGzip(const char* value)
+{
+    int gzip = -1, any = -1;
+    while (*value != '\0') {
+        value += strspn(value, " \t,");
+        size_t length = strcspn(value, ",");
+        size_t name = strcspn(value, " \t;,");
+        bool accepted = true;
+        auto* param = static_cast<const char*>(memchr(value, ';', length));
+        if (param != nullptr) {
+            param += 1 + strspn(param + 1, " \t");
+            if (strncasecmp(param, "q=", 2) == 0) {
+                accepted = strtod(param + 2, nullptr) > 0;
             }
+        }
+        if (name == 4 && strncasecmp(value, "gzip", 4) == 0) {
+            gzip = accepted;
+        } else if (name == 1 && value[0] == '*') {
+            any = accepted;
+        }
+        value += length;
+    }
+    // gzip named explicitly wins over *
+    return gzip >= 0 ? gzip : any > 0;
+}
 
-            // Get this object from the user context
-            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
-            if (!this_->ConnectToWifi(ssid, password)) {
-                char error[] = "Failed to connect to WiFi";
-                char location[128];
-                snprintf(location, sizeof(location), "/?error=%s&ssid=%s", error, ssid);
-                
-                httpd_resp_set_status(req, "302 Found");
-                httpd_resp_set_hdr(req, "Location", location);
-                httpd_resp_send(req, NULL, 0);
-                return ESP_OK;
+// Whether an If-None-Match list holds the ETag, each entry compared whole
+static bool MatchesEtag(const char* value, const char* etag)
+{
+    size_t etag_length = strlen(etag);
+    while (*value != '\0') {
+        value += strspn(value, " \t,");
+        size_t length = strcspn(value, " \t,");
+        const char* tag = value;
+        value += length;
+        if (length == 1 && tag[0] == '*') {
+            return true;
+        }
+        // Weak comparison, as for GET
+        if (length > 2 && strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+            length -= 2;
+        }
+        if (length == etag_length && memcmp(tag, etag, etag_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t WifiConfigurationAp::SendIndex(httpd_req_t *req)
+{
+    // A truncated header still names the codings that fit in the buffer
+    char accept_encoding[128];
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding, sizeof(accept_encoding));
+    bool gzip = (err == ESP_OK || err == ESP_ERR_HTTPD_RESULT_TRUNC) && AcceptsGzip(accept_encoding);
+    const char* etag = gzip ? index_etag_ : index_plain_etag_;
+
+    // Browsers revalidate with If-None-Match, answer with 304 when unchanged
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    char if_none_match[128];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        MatchesEtag(if_none_match, etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    httpd_resp_set_type(req, "text/html");
+    if (!gzip) {
+        return httpd_resp_send(req, index_plain_start, index_plain_end - index_plain_start);
+    }
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, index_html_start, index_html_end - index_html_start);
+}
+
+void WifiConfigurationAp::WorkerTask()
+{
+    ProvisioningJob job;
+    while (true) {
+        if (xQueueReceive(job_queue_, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        if (ConnectToWifi(job.ssid, job.password)) {
+            // Stays busy, the device restarts or hands the connection over
+            if (Save(job.ssid, job.password)) {
+                break;
             }
+        } else {
+            std::lock_guard<std::mutex> lock(job_mutex_);
+            job_busy_ = false;
+        }
+    }
 
-            // Set HTML response
-            httpd_resp_set_status(req, "200 OK");
-            httpd_resp_set_type(req, "text/html");
-            httpd_resp_send(req, "<h1>Done!</h1>", -1);
+    // Handed over, the web server that queued the jobs is stopped
+    vQueueDelete(job_queue_);
+    job_queue_ = nullptr;
+}
 
-            this_->Save(ssid, password);
-            return ESP_OK;
-        },
-        .user_ctx = this
+esp_err_t WifiConfigurationAp::HandleSubmit(httpd_req_t *req)
+{
+    if (req->content_len > MAX_FORM_SIZE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Form data too large");
+        return ESP_FAIL;
+    }
+
+    // The buffers hold the url-encoded values before they are decoded in place
+    char ssid[32 * 3 + 1], password[64 * 3 + 1];
+    FormField fields[] = {
+        { .name = "ssid", .value = ssid, .size = sizeof(ssid), .max_length = 32 },
+        { .name = "password", .value = password, .size = sizeof(password), .max_length = 64 },
     };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &form_submit));
+    char content_type[32];
+    bool json = httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) == ESP_OK &&
+        strncmp(content_type, "application/json", 16) == 0;
+    FormParser parser(json ? FormParser::Format::Json : FormParser::Format::UrlEncoded, fields, 2);
+
+    // The body may arrive in several TCP segments
+    char buf[128];
+    size_t remaining = req->content_len;
+    bool valid = true;
+    while (remaining > 0 && valid) {
+        int ret = httpd_req_recv(req, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+        if (ret <= 0) {
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                httpd_resp_send_408(req);
+            }
+            return ESP_FAIL;
+        }
+        remaining -= ret;
+        valid = parser.Feed(buf, ret);
+    }
+    if (!valid || !parser.Finish() || !fields[0].present || fields[0].length == 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid form data");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Received form data for SSID %s", ssid);
+
+    ProvisioningJob job;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex_);
+        if (job_busy_) {
+            httpd_resp_set_status(req, "503 Service Unavailable");
+            httpd_resp_send(req, "Busy", HTTPD_RESP_USE_STRLEN);
+            return ESP_OK;
+        }
+        job_busy_ = true;
+        job.id = ++job_id_;
+        job_phase_ = "queued";
+        job_ip_.clear();
+        job_error_.clear();
+    }
+    memcpy(job.ssid, ssid, sizeof(job.ssid));
+    memcpy(job.password, password, sizeof(job.password));
+    xQueueSend(job_queue_, &job, portMAX_DELAY);
+
+    // Answer at once, the page follows the progress through /status
+    char response[32];
+    snprintf(response, sizeof(response), "{\"job\":%d}", job.id);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
 
-    ESP_LOGI(TAG, "Web server started");
+void WifiConfigurationAp::SetJobPhase(const char* phase, const std::string& error)
+{
+    std::lock_guard<std::mutex> lock(job_mutex_);
+    job_phase_ = phase;
+    job_error_ = error;
 }
 
-std::string WifiConfigurationAp::UrlDecode(const std::string &url)
+esp_err_t WifiConfigurationAp::SendJobStatus(httpd_req_t *req)
 {
-    std::string decoded;
-    for (size_t i = 0; i < url.length(); ++i) {
-        if (url[i] == '%') {
-            char hex[3];
-            hex[0] = url[i + 1];
-            hex[1] = url[i + 2];
-            hex[2] = '\0';
-            char ch = static_cast<char>(std::stoi(hex, nullptr, 16));
-            decoded += ch;
-            i += 2;
-        } else if (url[i] == '+') {
-            decoded += ' ';
+    char query[32], value[12];
+    int job_id = 0;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "job", value, sizeof(value)) == ESP_OK) {
+        job_id = atoi(value);
+    }
+
+    char response[192];
+    {
+        std::lock_guard<std::mutex> lock(job_mutex_);
+        if (job_id != job_id_) {
+            // Only the last job is kept
+            snprintf(response, sizeof(response), "{\"job\":%d,\"phase\":\"unknown\"}", job_id);
         } else {
-            decoded += url[i];
+            snprintf(response, sizeof(response), "{\"job\":%d,\"phase\":\"%s\",\"ip\":\"%s\",\"error\":\"%s\",\"restart\":%s}",
+                job_id, job_phase_, job_ip_.c_str(), job_error_.c_str(), provisioned_callback_ ? "false" : "true");
         }
     }
-    return decoded;
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
 }
 
-bool WifiConfigurationAp::ConnectToWifi(const std::string &ssid, const std::string &password)
+
+void WifiConfigurationAp::StartScan()
+{
+    // Fails while a scan or a connection is in progress, the next tick tries again
+    esp_wifi_scan_start(nullptr, false);
+}
+
+static void WriteScanAp(JsonWriter& writer, const ScanAp& ap)
+{
+    writer.BeginObject();
+    writer.Key("ssid");
+    writer.String(ap.ssid.data(), ap.ssid.length());
+    writer.Key("rssi");
+    writer.Int(ap.rssi);
+    writer.Key("authmode");
+    writer.Int(ap.authmode);
+    writer.EndObject();
+}
+
+static bool AppendToString(void* ctx, const char* data, size_t length)
+{
+    static_cast<std::string*>(ctx)->append(data, length);
+    return true;
+}
+
+void WifiConfigurationAp::UpdateScanResult()
+{
+    uint16_t ap_num = 0;
+    esp_wifi_scan_get_ap_num(&ap_num);
+    wifi_ap_record_t *ap_records = (wifi_ap_record_t *)malloc(ap_num * sizeof(wifi_ap_record_t));
+    if (ap_records == nullptr) {
+        esp_wifi_clear_ap_list();
+        return;
+    }
+    esp_wifi_scan_get_ap_records(&ap_num, ap_records);
+
+    // One entry per SSID, with the strongest of its APs
+    std::vector<ScanAp> aps;
+    aps.reserve(ap_num);
+    for (int i = 0; i < ap_num; i++) {
+        const char* ssid = (const char *)ap_records[i].ssid;
+        ESP_LOGI(TAG, "SSID: %s, RSSI: %d, Authmode: %d", ssid, ap_records[i].rssi, ap_records[i].authmode);
+        std::string name(ssid, strnlen(ssid, sizeof(ap_records[i].ssid)));
+        auto it = std::find_if(aps.begin(), aps.end(), [&](const ScanAp& ap) { return ap.ssid == name; });
+        if (it == aps.end()) {
+            aps.push_back({std::move(name), ap_records[i].rssi, (uint8_t)ap_records[i].authmode});
+        } else if (ap_records[i].rssi > it->rssi) {
+            it->rssi = ap_records[i].rssi;
+            it->authmode = ap_records[i].authmode;
+        }
+    }
+    free(ap_records);
+
+    std::lock_guard<std::mutex> lock(scan_mutex_);
+
+    // Changes for the event stream, small RSSI changes are ignored and the
+    // last reported value is kept so that they do not add up unnoticed
+    std::string delta;
+    char buf[128];
+    JsonWriter delta_writer(buf, sizeof(buf), AppendToString, &delta);
+    delta_writer.BeginObject();
+    delta_writer.Key("added");
+    delta_writer.BeginArray();
+    for (auto& ap : aps) {
+        auto old = std::find_if(scan_aps_.begin(), scan_aps_.end(), [&](const ScanAp& item) { return item.ssid == ap.ssid; });
+        if (old == scan_aps_.end()) {
+            WriteScanAp(delta_writer, ap);
+        }
+    }
+    delta_writer.EndArray();
+    delta_writer.Key("changed");
+    delta_writer.BeginArray();
+    for (auto& ap : aps) {
+        auto old = std::find_if(scan_aps_.begin(), scan_aps_.end(), [&](const ScanAp& item) { return item.ssid == ap.ssid; });
+        if (old == scan_aps_.end()) {
+            continue;
+        }
+        if (abs(ap.rssi - old->rssi) < SCAN_RSSI_CHANGE_THRESHOLD && ap.authmode == old->authmode) {
+            ap.rssi = old->rssi;
+        } else {
+            WriteScanAp(delta_writer, ap);
+        }
+    }
+    delta_writer.EndArray();
+    delta_writer.Key("removed");
+    delta_writer.BeginArray();
+    for (auto& old : scan_aps_) {
+        if (std::find_if(aps.begin(), aps.end(), [&](const ScanAp& ap) { return ap.ssid == old.ssid; }) == aps.end()) {
+            delta_writer.String(old.ssid.data(), old.ssid.length());
+        }
+    }
+    delta_writer.EndArray();
+    delta_writer.EndObject();
+    delta_writer.Flush();
+
+    // Serialize once, every /scan request is served from this string
+    std::string json;
+    json.reserve(aps.size() * 64 + 2);
+    JsonWriter writer(buf, sizeof(buf), AppendToString, &json);
+    writer.BeginArray();
+    for (auto& ap : aps) {
+        WriteScanAp(writer, ap);
+    }
+    writer.EndArray();
+    writer.Flush();
+
+    scan_aps_ = std::move(aps);
+    scan_json_ = std::make_shared<const std::string>(std::move(json));
+    scan_time_ = esp_timer_get_time();
+
+    if (event_client_count_ > 0) {
+        // An empty delta still goes out, it tells closed streams apart
+        PushEvent("event: delta\ndata: " + delta + "\n\n");
+    }
+}
+
+esp_err_t WifiConfigurationAp::SendScanResult(httpd_req_t *req)
+{
+    auto now = esp_timer_get_time();
+    scan_request_time_ = now;
+
+    // Shares the serialized list instead of copying it, and sends it without holding the
+    // lock so that a slow client cannot stall the scan updates on the event task
+    std::shared_ptr<const std::string> json;
+    int64_t scan_time;
+    {
+        std::lock_guard<std::mutex> lock(scan_mutex_);
+        json = scan_json_;
+        scan_time = scan_time_;
+    }
+    if (scan_time == 0 || now - scan_time > scan_interval_ms_ * 1000LL * 2) {
+        // The portal was idle, refresh now instead of waiting for the timer
+        StartScan();
+    }
+
+    // Send the scan results as JSON, in chunks of up to one TCP segment
+    httpd_resp_set_type(req, "application/json");
+    JsonWriter writer(send_buffer_, sizeof(send_buffer_), [](void* ctx, const char* data, size_t length) {
+        return httpd_resp_send_chunk(static_cast<httpd_req_t *>(ctx), data, length) == ESP_OK;
+    }, req);
+    writer.BeginObject();
+    writer.Key("age");
+    writer.Int(scan_time == 0 ? -1 : (int)((now - scan_time) / 1000));
+    writer.Key("aps");
+    if (json == nullptr || json->empty()) {
+        writer.Raw("[]", 2);
+    } else {
+        writer.Raw(json->data(), json->length());
+    }
+    writer.EndObject();
+    if (!writer.Flush()) {
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+esp_err_t WifiConfigurationAp::HandleEvents(httpd_req_t *req)
 {
-    // auto esp_netif = esp_netif_create_default_wifi_sta();
+    // Each stream holds a socket, the page polls /scan when it is refused
+    if (event_clients_.size() >= MAX_EVENT_CLIENTS) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, NULL, 0);
+    }
 
+    auto now = esp_timer_get_time();
+    scan_request_time_ = now;
+    std::string message = "event: list\ndata: {\"aps\":";
+    {
+        std::lock_guard<std::mutex> lock(scan_mutex_);
+        message += scan_json_ == nullptr || scan_json_->empty() ? "[]" : *scan_json_;
+        if (scan_time_ == 0 || now - scan_time_ > scan_interval_ms_ * 1000LL * 2) {
+            StartScan();
+        }
+    }
+    message += "}\n\n";
+
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    if (httpd_resp_send_chunk(req, message.data(), message.length()) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    // Keep the request open, later events are sent from PushEvent
+    httpd_req_t *async_req;
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    event_clients_.push_back(async_req);
+    event_client_count_ = event_clients_.size();
+    return ESP_OK;
+}
+
+void WifiConfigurationAp::PushEvent(std::string &&message)
+{
+    // Sent from the httpd task, which owns the list of streams
+    struct Event {
+        WifiConfigurationAp* self;
+        std::string message;
+    };
+    auto event = new Event{this, std::move(message)};
+    if (httpd_queue_work(server_, [](void *arg) {
+        auto event = static_cast<Event*>(arg);
+        auto& clients = event->self->event_clients_;
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (httpd_resp_send_chunk(*it, event->message.data(), event->message.length()) != ESP_OK) {
+                ESP_LOGI(TAG, "Event stream closed");
+                httpd_req_async_handler_complete(*it);
+                it = clients.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        event->self->event_client_count_ = clients.size();
+        delete event;
+    }, event) != ESP_OK) {
+        delete event;
+    }
+}
+
+bool WifiConfigurationAp::ConnectToWifi(const std::string &ssid, const std::string &password)
+{
     wifi_config_t wifi_config;
     bzero(&wifi_config, sizeof(wifi_config));
-    strcpy((char *)wifi_config.sta.ssid, ssid.c_str());
-    strcpy((char *)wifi_config.sta.password, password.c_str());
+    strncpy((char *)wifi_config.sta.ssid, ssid.c_str(), sizeof(wifi_config.sta.ssid));
+    strncpy((char *)wifi_config.sta.password, password.c_str(), sizeof(wifi_config.sta.password));
     wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
     wifi_config.sta.failure_retry_cnt = 1;
-    
+
+    // Do not let a background scan of the AP list delay the connection
+    esp_wifi_scan_stop();
+    if (sta_connecting_) {
+        // The previous attempt timed out, its disconnect event must arrive before the bits
+        // are cleared or it would fail this attempt
+        xEventGroupClearBits(event_group_, WIFI_FAIL_BIT);
+        esp_wifi_disconnect();
+        xEventGroupWaitBits(event_group_, WIFI_FAIL_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(DISCONNECT_WAIT_MS));
+    }
+    xEventGroupClearBits(event_group_, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT | WIFI_GOT_IP_BIT);
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    // Scanning, authentication, association and the 4-way handshake until STA_CONNECTED
+    SetJobPhase("connecting");
+    sta_connecting_ = true;
+    associated_time_ = 0;
+    got_ip_time_ = 0;
+    attempt_time_ = esp_timer_get_time();
     auto ret = esp_wifi_connect();
     if (ret != ESP_OK) {
+        sta_connecting_ = false;
         ESP_LOGE(TAG, "Failed to connect to WiFi: %d", ret);
+        SetJobPhase("failed", "Failed to start the connection");
         return false;
     }
     ESP_LOGI(TAG, "Connecting to WiFi %s", ssid.c_str());
 
-    // Wait for the connection to complete for 5 seconds
-    EventBits_t bits = xEventGroupWaitBits(event_group_, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    // Wait for the connection to complete for 10 seconds
+    EventBits_t bits = xEventGroupWaitBits(event_group_, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(10000));
     if (bits & WIFI_CONNECTED_BIT) {
+        SetJobPhase("dhcp");
+        bits = xEventGroupWaitBits(event_group_, WIFI_GOT_IP_BIT | WIFI_FAIL_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(10000));
+    }
+    if (bits & WIFI_GOT_IP_BIT) {
         ESP_LOGI(TAG, "Connected to WiFi %s", ssid.c_str());
+        SetJobPhase("success");
         return true;
+    }
+
+    std::string error;
+    if (bits & WIFI_FAIL_BIT) {
+        switch (disconnect_reason_) {
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_MIC_FAILURE:
+            error = "Wrong password";
+            break;
+        case WIFI_REASON_NO_AP_FOUND:
+            error = "Network not found";
+            break;
+        default:
+            error = "Connection failed (reason " + std::to_string(disconnect_reason_) + ")";
+            break;
+        }
     } else {
-        ESP_LOGE(TAG, "Failed to connect to WiFi %s", ssid.c_str());
-        return false;
+        error = (bits & WIFI_CONNECTED_BIT) ? "No IP address from DHCP" : "Connection timed out";
     }
+    ESP_LOGE(TAG, "Failed to connect to WiFi %s: %s", ssid.c_str(), error.c_str());
+    esp_wifi_disconnect();
+    SetJobPhase("failed", error);
+    return false;
 }
 
-void WifiConfigurationAp::Save(const std::string &ssid, const std::string &password)
+bool WifiConfigurationAp::Save(const std::string &ssid, const std::string &password)
 {
-    // Open the NVS flash
-    nvs_handle_t nvs_handle;
-    ESP_ERROR_CHECK(nvs_open("wifi", NVS_READWRITE, &nvs_handle));
-
-    // Write the SSID and password to the NVS flash
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "ssid", ssid.c_str()));
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "password", password.c_str()));
-
-    // Commit the changes
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-
-    // Close the NVS flash
-    nvs_close(nvs_handle);
+    SsidManager::GetInstance().AddSsid(ssid, password);
 
     ESP_LOGI(TAG, "WiFi configuration saved");
+    if (provisioned_callback_ && HandOver()) {
+        return true;
+    }
+
     // Use xTaskCreate to create a new task that restarts the ESP32
     xTaskCreate([](void *ctx) {
         ESP_LOGI(TAG, "Restarting the ESP32 in 3 second");
         vTaskDelay(pdMS_TO_TICKS(3000));
         esp_restart();
     }, "restart_task", 4096, NULL, 5, NULL);
+    return false;
+}
+
+bool WifiConfigurationAp::HandOver()
+{
+    auto start_time = esp_timer_get_time();
+
+    // Stop scanning and following the station, WifiStation takes over from here
+    esp_timer_stop(scan_timer_);
+    esp_wifi_scan_stop();
+    esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id_);
+    esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip_);
+    instance_any_id_ = nullptr;
+    instance_got_ip_ = nullptr;
+    if (!WifiStation::GetInstance().AdoptConnection(attempt_time_, associated_time_, got_ip_time_)) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Connection handed over in %d ms", (int)((esp_timer_get_time() - start_time) / 1000));
+    provisioned_callback_();
+
+    // Tell the open pages the result and close their streams from the httpd task, which
+    // owns them, before the AP goes away
+    std::string ip;
+    {
+        std::lock_guard<std::mutex> lock(job_mutex_);
+        ip = job_ip_;
+    }
+    auto event = new std::string("event: done\ndata: {\"ip\":\"" + ip + "\"}\n\n");
+    xSemaphoreTake(handover_flushed_, 0);
+    if (httpd_queue_work(server_, [](void *arg) {
+        auto& this_ = WifiConfigurationAp::GetInstance();
+        auto event = static_cast<std::string*>(arg);
+        for (auto req : this_.event_clients_) {
+            httpd_resp_send_chunk(req, event->data(), event->length());
+            httpd_req_async_handler_complete(req);
+        }
+        this_.event_clients_.clear();
+        this_.event_client_count_ = 0;
+        delete event;
+        xSemaphoreGive(this_.handover_flushed_);
+    }, event) == ESP_OK) {
+        if (xSemaphoreTake(handover_flushed_, pdMS_TO_TICKS(HANDOVER_FLUSH_TIMEOUT_MS)) != pdTRUE) {
+            ESP_LOGW(TAG, "Event streams not closed in time");
+        }
+    } else {
+        delete event;
+    }
+
+    dns_server_.Stop();
+    httpd_stop(server_);
+    server_ = NULL;
+    // The driver must stop using the AP interface before it is destroyed
+    esp_err_t ret = esp_wifi_set_mode(WIFI_MODE_STA);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to leave AP mode: %d", ret);
+        return true;
+    }
+    // The AP ran without power save, continue in the mode the station wants
+    esp_wifi_set_ps(WifiStation::GetInstance().GetPowerSaveStats().mode);
+    esp_netif_destroy_default_wifi(ap_netif_);
+    ap_netif_ = nullptr;
+    ESP_LOGI(TAG, "Access Point stopped");
+    return true;
 }
 
 void WifiConfigurationAp::WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
@@ -315,11 +973,17 @@ void WifiConfigurationAp::WifiEventHandler(void* arg, esp_event_base_t event_bas
     } else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) {
         wifi_event_ap_stadisconnected_t* event = (wifi_event_ap_stadisconnected_t*) event_data;
         ESP_LOGI(TAG, "Station " MACSTR " left, AID=%d", MAC2STR(event->mac), event->aid);
+    } else if (event_id == WIFI_EVENT_SCAN_DONE) {
+        self->UpdateScanResult();
     } else if (event_id == WIFI_EVENT_STA_CONNECTED) {
+        self->associated_time_ = esp_timer_get_time();
         xEventGroupSetBits(self->event_group_, WIFI_CONNECTED_BIT);
     } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        self->disconnect_reason_ = event->reason;
+        self->sta_connecting_ = false;
         xEventGroupSetBits(self->event_group_, WIFI_FAIL_BIT);
-    } 
+    }
 }
 
 void WifiConfigurationAp::IpEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
@@ -328,6 +992,13 @@ void WifiConfigurationAp::IpEventHandler(void* arg, esp_event_base_t event_base,
     if (event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
-        xEventGroupSetBits(self->event_group_, WIFI_CONNECTED_BIT);
+        char ip[16];
+        esp_ip4addr_ntoa(&event->ip_info.ip, ip, sizeof(ip));
+        {
+            std::lock_guard<std::mutex> lock(self->job_mutex_);
+            self->job_ip_ = ip;
+        }
+        self->got_ip_time_ = esp_timer_get_time();
+        xEventGroupSetBits(self->event_group_, WIFI_GOT_IP_BIT);
     }
 }
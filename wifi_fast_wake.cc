@@ -0,0 +1,26 @@
+#include "wifi_fast_wake.h"
+
+#include <cstddef>
+#include <cstring>
+#include <esp_rom_crc.h>
+
+static uint32_t FastWakeStateCrc(const WifiFastWakeState& state) {
+    auto* data = reinterpret_cast<const uint8_t*>(&state);
+    size_t offset = offsetof(WifiFastWakeState, crc) + sizeof(state.crc);
+    return esp_rom_crc32_le(0, data + offset, sizeof(state) - offset);
+}
+
+void WifiFastWakeState::Seal() {
+    magic = WIFI_FAST_WAKE_MAGIC;
+    crc = FastWakeStateCrc(*this);
+}
+
+bool WifiFastWakeState::IsValid() const {
+    return magic == WIFI_FAST_WAKE_MAGIC && crc == FastWakeStateCrc(*this) &&
+        memchr(ssid, '\0', sizeof(ssid)) != nullptr && memchr(password, '\0', sizeof(password)) != nullptr;
+}
+
+bool WifiFastWakeState::IsLeaseFresh(int64_t now, int lease_reuse_s) const {
+    // The RTC clock keeps running in deep sleep, but starts from 0 after a power cycle
+    return ip.addr != 0 && lease_time > 0 && now >= lease_time && now - lease_time < lease_reuse_s;
+}
@@ -0,0 +1,112 @@
+#include "wifi_policy.h"
+
+#include <algorithm>
+
+WifiDisconnectClass ClassifyDisconnectReason(uint16_t reason) {
+    switch (reason) {
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_MIC_FAILURE:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+    case WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY:
+    case WIFI_REASON_NO_AP_FOUND_IN_AUTHMODE_THRESHOLD:
+        return WifiDisconnectClass::FailFast;
+    case WIFI_REASON_BEACON_TIMEOUT:
+    case WIFI_REASON_AUTH_EXPIRE:
+    case WIFI_REASON_ASSOC_EXPIRE:
+    case WIFI_REASON_ASSOC_LEAVE:
+    case WIFI_REASON_AP_TSF_RESET:
+    case WIFI_REASON_ROAMING:
+    case WIFI_REASON_SA_QUERY_TIMEOUT:
+        return WifiDisconnectClass::RetryNow;
+    default:
+        return WifiDisconnectClass::RetryWithBackoff;
+    }
+}
+
+int64_t GetReconnectDelayMs(const WifiReconnectPolicy& policy, int attempt, uint32_t random) {
+    // Out of range settings are clamped, so a bad policy can neither go negative nor shrink
+    int64_t max_delay_ms = std::max(policy.max_delay_ms, 0);
+    int64_t multiplier = std::max(policy.multiplier, 1);
+    int jitter_percent = std::clamp(policy.jitter_percent, 0, 100);
+
+    // Exponential backoff up to the cap, then spread by the jitter
+    int64_t delay_ms = std::clamp<int64_t>(policy.initial_delay_ms, 0, max_delay_ms);
+    for (int i = 1; i < attempt && multiplier > 1 && delay_ms > 0 && delay_ms < max_delay_ms; i++) {
+        delay_ms *= multiplier;
+    }
+    if (delay_ms > max_delay_ms) {
+        delay_ms = max_delay_ms;
+    }
+    int64_t jitter_ms = delay_ms * jitter_percent / 100;
+    if (jitter_ms > 0) {
+        delay_ms += (int64_t)(random % (2 * jitter_ms + 1)) - jitter_ms;
+    }
+    return delay_ms;
+}
+
+int64_t GetDefaultReconnectDelayMs(const WifiReconnectPolicy& policy, const WifiReconnectAttempt& attempt, uint32_t random) {
+    if (attempt.disconnect_class == WifiDisconnectClass::RetryNow && attempt.attempt == 1) {
+        return 0;
+    }
+    return GetReconnectDelayMs(policy, attempt.attempt, random);
+}
+
+int64_t ClampReconnectDelayMs(int64_t delay_ms, int attempt) {
+    if (attempt > 1 && delay_ms < WIFI_MIN_RECONNECT_DELAY_MS) {
+        return WIFI_MIN_RECONNECT_DELAY_MS;
+    }
+    return delay_ms;
+}
+
+int SelectNetwork(const std::vector<SsidItem>& networks, const wifi_ap_record_t* records, int count, int* network_index) {
+    int best = -1;
+    int best_ap = -1;
+    for (int i = 0; i < count; i++) {
+        auto& ap = records[i];
+        for (size_t j = 0; j < networks.size(); j++) {
+            auto& item = networks[j];
+            if (item.ssid != (const char*)ap.ssid) {
+                continue;
+            }
+            if (best < 0 || item.priority > networks[best].priority ||
+                (item.priority == networks[best].priority && ap.rssi > records[best_ap].rssi)) {
+                best = j;
+                best_ap = i;
+            }
+        }
+    }
+    if (best >= 0) {
+        *network_index = best;
+    }
+    return best_ap;
+}
+
+WifiPhaseStats GetPhaseStats(std::vector<int>& values) {
+    WifiPhaseStats stats;
+    if (values.empty()) {
+        return stats;
+    }
+    std::sort(values.begin(), values.end());
+    int sum = 0;
+    for (auto value : values) {
+        sum += value;
+    }
+    stats.count = values.size();
+    stats.min_ms = values.front();
+    stats.avg_ms = sum / stats.count;
+    // Nearest rank
+    stats.p95_ms = values[(stats.count * 95 + 99) / 100 - 1];
+    return stats;
+}
+
+wifi_ps_type_t GetWantedPowerSaveMode(const WifiPowerSavePolicy& policy, WifiActivity activity, int traffic_rate) {
+    if (activity == WifiActivity::Streaming || traffic_rate >= policy.high_traffic) {
+        return WIFI_PS_NONE;
+    }
+    if (activity == WifiActivity::Interactive || traffic_rate >= policy.low_traffic) {
+        return WIFI_PS_MIN_MODEM;
+    }
+    return WIFI_PS_MAX_MODEM;
+}
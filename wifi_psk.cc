@@ -0,0 +1,41 @@
+#include "wifi_psk.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <mbedtls/pkcs5.h>
+
+#define TAG "wifi_psk"
+#define PSK_ITERATIONS 4096
+#define PMK_LENGTH 32
+
+std::string WifiDerivePsk(const std::string &ssid, const std::string &password) {
+    // WPA passphrases are 8..63 characters, 64 characters are already a PSK
+    if (ssid.empty() || ssid.length() > 32 || password.length() < 8 || password.length() > 63) {
+        return "";
+    }
+
+    auto start_time = esp_timer_get_time();
+    unsigned char pmk[PMK_LENGTH];
+    int ret = mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1,
+        (const unsigned char *)password.data(), password.length(),
+        (const unsigned char *)ssid.data(), ssid.length(),
+        PSK_ITERATIONS, sizeof(pmk), pmk);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to derive PSK: %d", ret);
+        return "";
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    std::string psk;
+    psk.reserve(PMK_LENGTH * 2);
+    for (int i = 0; i < PMK_LENGTH; i++) {
+        psk += hex[pmk[i] >> 4];
+        psk += hex[pmk[i] & 0x0F];
+    }
+    ESP_LOGI(TAG, "PSK derived in %d ms", (int)((esp_timer_get_time() - start_time) / 1000));
+    return psk;
+}
+
+bool WifiPskSupported(wifi_auth_mode_t authmode) {
+    return authmode == WIFI_AUTH_WPA_PSK || authmode == WIFI_AUTH_WPA2_PSK || authmode == WIFI_AUTH_WPA_WPA2_PSK;
+}
@@ -1,19 +1,56 @@
 #include "wifi_station.h"
+#include "wifi_psk.h"
+#include "wifi_fast_wake.h"
 #include <cstring>
+#include <algorithm>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
 #include <esp_log.h>
 #include <esp_wifi.h>
-#include <nvs.h>
-#include "nvs_flash.h"
+#include <esp_mac.h>
 #include <esp_netif.h>
 #include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <esp_attr.h>
+#include <lwip/etharp.h>
+#include <ctime>
 
 #define TAG "wifi"
 #define WIFI_EVENT_CONNECTED BIT0
 #define WIFI_EVENT_FAILED BIT1
-#define MAX_RECONNECT_COUNT 5
+#define LINK_SAMPLE_INTERVAL_MS 1000
+#define MAX_CONNECT_RECORDS 16
+// Wait for an answer to the ARP probe for a reused address
+#define ADDRESS_PROBE_MS 300
+
+// Survives deep sleep, see EnableFastWake()
+static RTC_NOINIT_ATTR WifiFastWakeState fast_wake_state;
+
+// An ARP probe for an address we want to reuse, run on the TCP/IP task
+struct ArpCheck {
+    struct netif* netif;
+    ip4_addr_t ip;
+    bool answered;
+};
+
+// The interface has no address yet, so the request goes out as an RFC 5227 probe with
+// sender IP 0.0.0.0 and does not touch other hosts' caches. It leaves a pending entry,
+// which a reply from a host that has the address completes.
+static esp_err_t SendArpProbe(void* ctx) {
+    auto* check = static_cast<ArpCheck*>(ctx);
+    return etharp_query(check->netif, &check->ip, NULL) == ERR_OK ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t FindArpEntry(void* ctx) {
+    auto* check = static_cast<ArpCheck*>(ctx);
+    struct eth_addr* eth;
+    const ip4_addr_t* ip;
+    check->answered = etharp_find_addr(check->netif, &check->ip, &eth, &ip) >= 0;
+    return ESP_OK;
+}
 
 WifiStation& WifiStation::GetInstance() {
     static WifiStation instance;
@@ -24,125 +61,939 @@ WifiStation::WifiStation() {
     // Create the event group
     event_group_ = xEventGroupCreate();
 
-    // Get ssid and password from NVS
-    nvs_handle_t nvs_handle;
-    auto ret = nvs_open("wifi", NVS_READONLY, &nvs_handle);
-    if (ret == ESP_OK) {
-        char ssid[32], password[64];
-        size_t length = sizeof(ssid);
-        if (nvs_get_str(nvs_handle, "ssid", ssid, &length) == ESP_OK) {
-            ssid_ = std::string(ssid);
-        }
-        length = sizeof(password);
-        if (nvs_get_str(nvs_handle, "password", password, &length) == ESP_OK) {
-            password_ = std::string(password);
-        }
-        nvs_close(nvs_handle);
-    }
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            auto* this_ = static_cast<WifiStation*>(arg);
+            this_->CompleteStart(this_->networks_.empty() ? WifiStationResult::Failed : WifiStationResult::Timeout);
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_start_timeout",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &start_timer_));
+
+    esp_timer_create_args_t reconnect_timer_args = {
+        .callback = [](void* arg) {
+            static_cast<WifiStation*>(arg)->Connect();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_reconnect",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &reconnect_timer_));
+
+    esp_timer_create_args_t link_timer_args = {
+        .callback = [](void* arg) {
+            auto* this_ = static_cast<WifiStation*>(arg);
+            this_->UpdateLinkInfo(true, nullptr);
+            this_->EvaluatePowerSave();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_link_sample",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&link_timer_args, &link_timer_));
+
+    esp_timer_create_args_t address_timer_args = {
+        .callback = [](void* arg) {
+            static_cast<WifiStation*>(arg)->CheckReusedAddress();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_address_check",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&address_timer_args, &address_timer_));
 }
 
 WifiStation::~WifiStation() {
+    esp_timer_delete(start_timer_);
+    esp_timer_delete(reconnect_timer_);
+    esp_timer_delete(link_timer_);
+    esp_timer_delete(address_timer_);
     vEventGroupDelete(event_group_);
 }
 
 void WifiStation::SetAuth(const std::string &&ssid, const std::string &&password) {
-    ssid_ = ssid;
-    password_ = password;
+    auth_network_ = SsidItem();
+    auth_network_.ssid = ssid;
+    auth_network_.password = password;
 }
 
 void WifiStation::Start() {
-    if (ssid_.empty()) {
+    if (auth_network_.ssid.empty() && !LoadFastWakeState() && SsidManager::GetInstance().GetSsidList().empty()) {
         return;
     }
 
+    if (!StartAsync(nullptr)) {
+        return;
+    }
+
+    // Wait for the WiFi stack to start
+    auto bits = xEventGroupWaitBits(event_group_, WIFI_EVENT_CONNECTED | WIFI_EVENT_FAILED, pdFALSE, pdFALSE, portMAX_DELAY);
+    if (bits & WIFI_EVENT_FAILED) {
+        ESP_LOGE(TAG, "WifiStation failed");
+        Stop();
+        SetState(WifiState::Failed);
+    }
+}
+
+bool WifiStation::StartAsync(std::function<void(WifiStationResult result)> callback, int timeout_ms) {
+    if (instance_any_id_ != nullptr || start_pending_) {
+        ESP_LOGW(TAG, "Already started");
+        return false;
+    }
+
+    // After a deep sleep the network comes from RTC memory, without reading NVS
+    esp_netif_ip_info_t fast_wake_ip = {};
+    fast_wake_ = LoadFastWakeState(&fast_wake_ip);
+    if (fast_wake_) {
+        networks_ = { fast_wake_network_ };
+    } else if (!auth_network_.ssid.empty()) {
+        networks_ = { auth_network_ };
+    } else {
+        networks_ = SsidManager::GetInstance().GetSsidList();
+    }
+    xEventGroupClearBits(event_group_, WIFI_EVENT_CONNECTED | WIFI_EVENT_FAILED);
+    if (networks_.empty()) {
+        // Reported from the timer task like any other outcome, not from within this call
+        ESP_LOGW(TAG, "No network to connect to");
+        xEventGroupSetBits(event_group_, WIFI_EVENT_FAILED);
+        start_callback_ = std::move(callback);
+        start_pending_ = true;
+        esp_timer_stop(start_timer_);
+        ESP_ERROR_CHECK(esp_timer_start_once(start_timer_, 0));
+        return true;
+    }
+
+    reconnect_count_ = 0;
+    connected_once_ = false;
+    disconnected_time_ = 0;
+    start_callback_ = std::move(callback);
+    start_pending_ = true;
+    SetState(WifiState::Idle);
+
     // Initialize the TCP/IP stack
     ESP_ERROR_CHECK(esp_netif_init());
 
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &WifiStation::WifiEventHandler,
                                                         this,
-                                                        &instance_any_id));
+                                                        &instance_any_id_));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
                                                         IP_EVENT_STA_GOT_IP,
                                                         &WifiStation::IpEventHandler,
                                                         this,
-                                                        &instance_got_ip));
+                                                        &instance_got_ip_));
 
-    // Create the default event loop
-    esp_netif_create_default_wifi_sta();
+    // Create the station interface once, a restart or WifiConfigurationAp may have made it already
+    sta_netif_ = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    if (sta_netif_ == nullptr) {
+        sta_netif_ = esp_netif_create_default_wifi_sta();
+    }
+    static_ip_ = fast_wake_ip.ip.addr != 0;
+    if (static_ip_) {
+        // The lease is still fresh, skip DHCP. The address is set after the association,
+        // once a probe found no other host using it
+        reused_ip_info_ = fast_wake_ip;
+        esp_netif_dhcpc_stop(sta_netif_);
+        esp_netif_ip_info_t none = {};
+        esp_netif_set_ip_info(sta_netif_, &none);
+        esp_netif_dns_info_t dns = {};
+        dns.ip.u_addr.ip4 = fast_wake_state.dns;
+        dns.ip.type = ESP_IPADDR_TYPE_V4;
+        esp_netif_set_dns_info(sta_netif_, ESP_NETIF_DNS_MAIN, &dns);
+    }
 
     // Initialize the WiFi stack in station mode
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
 
-    ESP_LOGI(TAG, "Connecting to WiFi ssid=%s password=%s", ssid_.c_str(), password_.c_str());
-    wifi_config_t wifi_config;
-    bzero(&wifi_config, sizeof(wifi_config));
-    strcpy((char *)wifi_config.sta.ssid, ssid_.c_str());
-    strcpy((char *)wifi_config.sta.password, password_.c_str());
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    if (networks_.size() == 1) {
+        network_ = networks_[0];
+        ESP_LOGI(TAG, "Connecting to WiFi ssid=%s password=%s", network_.ssid.c_str(), network_.password.c_str());
+        use_cached_ap_ = network_.channel != 0;
+        ApplyStationConfig();
+    } else {
+        // Pick the best of the known networks from a single scan
+        network_ = SsidItem();
+        ESP_LOGI(TAG, "Scanning for %d known networks", (int)networks_.size());
+    }
 
     // Start the WiFi stack
+    start_time_ = esp_timer_get_time();
+    if (timeout_ms > 0) {
+        ESP_ERROR_CHECK(esp_timer_start_once(start_timer_, (uint64_t)timeout_ms * 1000));
+    }
     ESP_ERROR_CHECK(esp_wifi_start());
 
-    // Wait for the WiFi stack to start
-    auto bits = xEventGroupWaitBits(event_group_, WIFI_EVENT_CONNECTED | WIFI_EVENT_FAILED, pdFALSE, pdFALSE, portMAX_DELAY);
-    if (bits & WIFI_EVENT_FAILED) {
-        ESP_LOGE(TAG, "WifiStation failed");
-        // Reset the WiFi stack
-        ESP_ERROR_CHECK(esp_wifi_stop());
-        ESP_ERROR_CHECK(esp_wifi_deinit());
-        
-        // 取消注册事件处理程序
-        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
+    // The driver starts in WIFI_PS_MIN_MODEM, apply a mode set before the start
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    if (ps_mode_ != WIFI_PS_MIN_MODEM && esp_wifi_set_ps(ps_mode_) != ESP_OK) {
+        ps_mode_ = WIFI_PS_MIN_MODEM;
+    }
+    ps_mode_time_ = start_time_;
+    return true;
+}
+
+void WifiStation::EnableFastWake(int lease_reuse_s) {
+    fast_wake_enabled_ = true;
+    lease_reuse_s_ = lease_reuse_s;
+}
+
+bool WifiStation::LoadFastWakeState(esp_netif_ip_info_t* ip_info) {
+    // Only a wake from deep sleep resumes the last connection, any other reset starts afresh
+    if (!fast_wake_enabled_ || esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(fast_wake_mutex_);
+    auto& state = fast_wake_state;
+    if (!state.IsValid()) {
+        return false;
+    }
+    // The network must still be the one to connect to, with the same password
+    if (!auth_network_.ssid.empty()) {
+        if (auth_network_.ssid != state.ssid || auth_network_.password != state.password) {
+            return false;
+        }
+    } else if (state.networks_generation != SsidManager::GetGeneration()) {
+        ESP_LOGI(TAG, "Stored networks changed, no fast wake");
+        return false;
+    }
+
+    auto& network = fast_wake_network_;
+    network = SsidItem();
+    network.ssid = state.ssid;
+    network.password = state.password;
+    if (state.psk[0] != '\0') {
+        network.psk.assign(state.psk, sizeof(state.psk));
+    }
+    memcpy(network.bssid, state.bssid, sizeof(network.bssid));
+    network.channel = state.channel;
+    network.authmode = (wifi_auth_mode_t)state.authmode;
+
+    if (ip_info != nullptr && state.IsLeaseFresh(time(nullptr), lease_reuse_s_)) {
+        ip_info->ip = state.ip;
+        ip_info->netmask = state.netmask;
+        ip_info->gw = state.gw;
+    }
+    return true;
+}
+
+void WifiStation::SaveFastWakeState(const esp_netif_ip_info_t* ip_info) {
+    if (!fast_wake_enabled_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(fast_wake_mutex_);
+    auto& state = fast_wake_state;
+    bool same_lease = state.IsValid() && state.ip.addr == ip_info->ip.addr;
+    int64_t lease_time = static_ip_ && same_lease ? state.lease_time : time(nullptr);
+
+    memset(&state, 0, sizeof(state));
+    if (auth_network_.ssid.empty()) {
+        state.networks_generation = SsidManager::GetGeneration();
+    }
+    strncpy(state.ssid, network_.ssid.c_str(), sizeof(state.ssid) - 1);
+    strncpy(state.password, network_.password.c_str(), sizeof(state.password) - 1);
+    if (network_.psk.length() == sizeof(state.psk)) {
+        memcpy(state.psk, network_.psk.data(), sizeof(state.psk));
+    }
+    memcpy(state.bssid, network_.bssid, sizeof(state.bssid));
+    state.channel = network_.channel;
+    state.authmode = network_.authmode;
+    state.ip = ip_info->ip;
+    state.netmask = ip_info->netmask;
+    state.gw = ip_info->gw;
+    esp_netif_dns_info_t dns;
+    if (esp_netif_get_dns_info(sta_netif_, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK) {
+        state.dns = dns.ip.u_addr.ip4;
+    }
+    // Only a lease from DHCP restarts the reuse period
+    state.lease_time = lease_time;
+    state.Seal();
+}
+
+void WifiStation::SaveFastWakePsk(const std::string& ssid, const std::string& psk) {
+    std::lock_guard<std::mutex> lock(fast_wake_mutex_);
+    auto& state = fast_wake_state;
+    if (!fast_wake_enabled_ || !state.IsValid() || ssid != state.ssid || psk.length() != sizeof(state.psk)) {
+        return;
+    }
+    memcpy(state.psk, psk.data(), sizeof(state.psk));
+    state.Seal();
+}
+
+void WifiStation::ClearFastWake() {
+    std::lock_guard<std::mutex> lock(fast_wake_mutex_);
+    fast_wake_state.magic = 0;
+}
+
+void WifiStation::ProbeReusedAddress() {
+    ArpCheck check = { static_cast<struct netif*>(esp_netif_get_netif_impl(sta_netif_)), { reused_ip_info_.ip.addr }, false };
+    esp_netif_tcpip_exec(SendArpProbe, &check);
+    esp_timer_stop(address_timer_);
+    esp_timer_start_once(address_timer_, ADDRESS_PROBE_MS * 1000);
+}
+
+void WifiStation::CheckReusedAddress() {
+    if (!static_ip_ || state_ != WifiState::ObtainingIp) {
+        return;
+    }
+    ArpCheck check = { static_cast<struct netif*>(esp_netif_get_netif_impl(sta_netif_)), { reused_ip_info_.ip.addr }, false };
+    esp_netif_tcpip_exec(FindArpEntry, &check);
+    if (!check.answered) {
+        // Nobody answered for the address, esp_netif reports the IP as soon as it is set
+        esp_netif_set_ip_info(sta_netif_, &reused_ip_info_);
         return;
     }
 
-    ESP_LOGI(TAG, "Connected to %s rssi=%d channel=%d", ssid_.c_str(), GetRssi(), GetChannel());
+    // The lease went to another host while we slept
+    ESP_LOGW(TAG, "Address " IPSTR " is used by another host, asking DHCP", IP2STR(&reused_ip_info_.ip));
+    static_ip_ = false;
+    {
+        std::lock_guard<std::mutex> lock(fast_wake_mutex_);
+        if (fast_wake_state.IsValid()) {
+            fast_wake_state.lease_time = 0;
+            fast_wake_state.Seal();
+        }
+    }
+    esp_netif_dhcpc_start(sta_netif_);
 }
 
-int8_t WifiStation::GetRssi() {
-    // Get station info
+bool WifiStation::AdoptConnection(int64_t attempt_time, int64_t associated_time, int64_t got_ip_time) {
+    if (instance_any_id_ != nullptr || start_pending_) {
+        // Already started, a second registration of the handlers would handle every event twice
+        ESP_LOGW(TAG, "Already started, not adopting the connection");
+        return false;
+    }
+    esp_netif_ip_info_t ip_info = {};
+    auto netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
     wifi_ap_record_t ap_info;
-    ESP_ERROR_CHECK(esp_wifi_sta_get_ap_info(&ap_info));
-    return ap_info.rssi;
+    if (netif == nullptr || esp_netif_get_ip_info(netif, &ip_info) != ESP_OK || ip_info.ip.addr == 0 ||
+        esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        ESP_LOGW(TAG, "No connection to adopt");
+        return false;
+    }
+
+    if (!auth_network_.ssid.empty()) {
+        networks_ = { auth_network_ };
+    } else {
+        networks_ = SsidManager::GetInstance().GetSsidList();
+    }
+    std::string ssid((const char*)ap_info.ssid, strnlen((const char*)ap_info.ssid, sizeof(ap_info.ssid)));
+    auto it = std::find_if(networks_.begin(), networks_.end(), [&](const SsidItem& item) { return item.ssid == ssid; });
+    if (it == networks_.end()) {
+        network_ = SsidItem();
+        network_.ssid = ssid;
+        networks_.push_back(network_);
+    } else {
+        network_ = *it;
+    }
+    sta_netif_ = netif;
+    memcpy(network_.bssid, ap_info.bssid, sizeof(network_.bssid));
+    network_.channel = ap_info.primary;
+    network_.authmode = ap_info.authmode;
+
+    xEventGroupClearBits(event_group_, WIFI_EVENT_FAILED);
+    reconnect_count_ = 0;
+    connected_once_ = true;
+    disconnected_time_ = 0;
+    use_cached_ap_ = false;
+    start_pending_ = false;
+    auto now = esp_timer_get_time();
+    start_time_ = attempt_time != 0 ? attempt_time : now;
+    scan_start_time_ = 0;
+    scan_done_time_ = 0;
+    attempt_time_ = start_time_;
+    associated_time_ = associated_time;
+
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &WifiStation::WifiEventHandler,
+                                                        this,
+                                                        &instance_any_id_));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                        IP_EVENT_STA_GOT_IP,
+                                                        &WifiStation::IpEventHandler,
+                                                        this,
+                                                        &instance_got_ip_));
+
+    ESP_LOGI(TAG, "Adopted the connection to %s, IP " IPSTR, ssid.c_str(), IP2STR(&ip_info.ip));
+    // As if the station had connected itself: the AP is cached for the next start
+    SsidManager::GetInstance().UpdateConnectedAp(ssid, ap_info);
+    AddConnectRecord(got_ip_time != 0 ? got_ip_time : now);
+    UpdateLinkInfo(true, &ip_info.ip);
+    esp_timer_stop(link_timer_);
+    esp_timer_start_periodic(link_timer_, LINK_SAMPLE_INTERVAL_MS * 1000);
+    xEventGroupSetBits(event_group_, WIFI_EVENT_CONNECTED);
+    SetState(WifiState::Connected);
+
+    // The AP runs without power save, WifiConfigurationAp applies the mode of the station
+    // from GetPowerSaveStats() when it stops the AP
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    ps_mode_time_ = now;
+    return true;
+}
+
+void WifiStation::Stop() {
+    if (instance_any_id_ == nullptr) {
+        return;
+    }
+    start_pending_ = false;
+    scan_pending_ = false;
+    esp_timer_stop(start_timer_);
+
+    // Reset the WiFi stack
+    ESP_ERROR_CHECK(esp_wifi_stop());
+    ESP_ERROR_CHECK(esp_wifi_deinit());
+
+    // 取消注册事件处理程序
+    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id_));
+    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip_));
+    instance_any_id_ = nullptr;
+    instance_got_ip_ = nullptr;
+    esp_timer_stop(reconnect_timer_);
+    esp_timer_stop(link_timer_);
+    esp_timer_stop(address_timer_);
+    UpdateLinkInfo(false, nullptr);
+    {
+        // The time in each mode only counts while the driver runs
+        std::lock_guard<std::mutex> lock(power_mutex_);
+        SwitchPowerSaveMode(ps_mode_, esp_timer_get_time());
+        ps_mode_time_ = 0;
+    }
+    SetState(WifiState::Idle);
+}
+
+void WifiStation::CompleteStart(WifiStationResult result) {
+    // Only the first outcome of a start is reported
+    if (!start_pending_.exchange(false)) {
+        return;
+    }
+    esp_timer_stop(start_timer_);
+
+    int elapsed_ms = (int)((esp_timer_get_time() - start_time_) / 1000);
+    if (result == WifiStationResult::Connected) {
+        ESP_LOGI(TAG, "Connected to %s rssi=%d channel=%d in %d ms", network_.ssid.c_str(), GetRssi(), GetChannel(), elapsed_ms);
+
+        if (network_.psk.empty() && WifiPskSupported(network_.authmode)) {
+            // Derive the PSK once in the background so the next boots can skip PBKDF2. PBKDF2
+            // takes most of a second, too long for the timer or event task.
+            auto* item = new SsidItem(network_);
+            BaseType_t created = xTaskCreate([](void* arg) {
+                auto* item = static_cast<SsidItem*>(arg);
+                auto psk = WifiDerivePsk(item->ssid, item->password);
+                if (!psk.empty()) {
+                    SsidManager::GetInstance().UpdatePsk(item->ssid, psk);
+                    WifiStation::GetInstance().SaveFastWakePsk(item->ssid, psk);
+                }
+                delete item;
+                vTaskDelete(NULL);
+            }, "wifi_psk", 4096, item, 1, NULL);
+            if (created != pdPASS) {
+                // The PSK stays empty, the next connection tries again
+                ESP_LOGW(TAG, "No memory to derive the PSK of %s", item->ssid.c_str());
+                delete item;
+            }
+        }
+    } else if (result == WifiStationResult::Timeout) {
+        ESP_LOGW(TAG, "No connection to %s after %d ms", network_.ssid.c_str(), elapsed_ms);
+    }
+
+    auto callback = std::move(start_callback_);
+    start_callback_ = nullptr;
+    if (callback) {
+        callback(result);
+    }
 }
 
-uint8_t WifiStation::GetChannel() {
-    // Get station info
+void WifiStation::ScheduleReconnect(uint16_t reason) {
+    auto& policy = reconnect_policy_;
+    if (!connected_once_ && reconnect_count_ >= policy.max_attempts) {
+        if (!(xEventGroupGetBits(event_group_) & WIFI_EVENT_FAILED)) {
+            xEventGroupSetBits(event_group_, WIFI_EVENT_FAILED);
+            ESP_LOGI(TAG, "WiFi connection failed");
+            CompleteStart(WifiStationResult::Failed);
+            // Also when retrying in the background, which goes on to Backoff
+            SetState(WifiState::Failed);
+        }
+        if (!policy.background_retry) {
+            SetState(WifiState::Failed);
+            return;
+        }
+    }
+
+    reconnect_count_++;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        reconnect_stats_.attempts++;
+    }
+    WifiReconnectAttempt attempt;
+    attempt.attempt = reconnect_count_;
+    attempt.reason = reason;
+    attempt.disconnect_class = reason != 0 ? ClassifyDisconnectReason(reason) : WifiDisconnectClass::RetryWithBackoff;
+    attempt.connected_once = connected_once_;
+    int64_t down_since = disconnected_time_ != 0 ? disconnected_time_ : start_time_;
+    attempt.down_ms = (int)((esp_timer_get_time() - down_since) / 1000);
+
+    uint32_t random = esp_random();
+    int64_t delay_ms = reconnect_strategy_ ? reconnect_strategy_(attempt, random) : -1;
+    if (delay_ms < 0) {
+        delay_ms = GetDefaultReconnectDelayMs(policy, attempt, random);
+    }
+    delay_ms = ClampReconnectDelayMs(delay_ms, attempt.attempt);
+
+    // Even an immediate attempt goes through the timer, never back into the driver from its own event
+    if (delay_ms == 0) {
+        ESP_LOGI(TAG, "Reconnecting WiFi now (attempt %d)", reconnect_count_);
+    } else {
+        ESP_LOGI(TAG, "Reconnecting WiFi in %d ms (attempt %d)", (int)delay_ms, reconnect_count_);
+        SetState(WifiState::Backoff);
+    }
+    esp_timer_stop(reconnect_timer_);
+    esp_timer_start_once(reconnect_timer_, delay_ms * 1000);
+}
+
+void WifiStation::Connect() {
+    attempt_time_ = esp_timer_get_time();
+    associated_time_ = 0;
+    if (networks_.size() > 1) {
+        // The device may have moved, look for the best known network again
+        scan_start_time_ = attempt_time_;
+        scan_done_time_ = 0;
+        SetState(WifiState::Scanning);
+        scan_pending_ = true;
+        if (esp_wifi_scan_start(nullptr, false) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to start the scan");
+            scan_pending_ = false;
+            ScheduleReconnect();
+        }
+    } else {
+        scan_start_time_ = 0;
+        SetState(WifiState::Connecting);
+        esp_wifi_connect();
+    }
+}
+
+void WifiStation::AddConnectRecord(int64_t now) {
+    WifiConnectRecord record;
+    if (scan_start_time_ != 0 && scan_done_time_ != 0) {
+        record.scan_ms = (int)((scan_done_time_ - scan_start_time_) / 1000);
+    }
+    if (associated_time_ != 0) {
+        int64_t connect_start = scan_done_time_ > attempt_time_ ? scan_done_time_ : attempt_time_;
+        record.connect_ms = (int)((associated_time_ - connect_start) / 1000);
+        record.dhcp_ms = (int)((now - associated_time_) / 1000);
+    }
+    int64_t cycle_start = disconnected_time_ != 0 ? disconnected_time_ : start_time_;
+    record.total_ms = (int)((now - cycle_start) / 1000);
+    record.attempts = reconnect_count_ + 1;
+    ESP_LOGI(TAG, "Connect phases: scan=%d connect=%d dhcp=%d total=%d ms",
+        record.scan_ms, record.connect_ms, record.dhcp_ms, record.total_ms);
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    if (connect_records_.size() < MAX_CONNECT_RECORDS) {
+        connect_records_.push_back(record);
+    } else {
+        connect_records_[connect_record_index_] = record;
+    }
+    connect_record_index_ = (connect_record_index_ + 1) % MAX_CONNECT_RECORDS;
+}
+
+std::vector<WifiConnectRecord> WifiStation::GetConnectRecords() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    if (connect_records_.size() < MAX_CONNECT_RECORDS) {
+        return connect_records_;
+    }
+    std::vector<WifiConnectRecord> records(connect_records_.begin() + connect_record_index_, connect_records_.end());
+    records.insert(records.end(), connect_records_.begin(), connect_records_.begin() + connect_record_index_);
+    return records;
+}
+
+WifiConnectStats WifiStation::GetConnectStats() {
+    std::vector<int> scan, connect, dhcp, total;
+    for (auto& record : GetConnectRecords()) {
+        if (record.scan_ms >= 0) {
+            scan.push_back(record.scan_ms);
+        }
+        if (record.connect_ms >= 0) {
+            connect.push_back(record.connect_ms);
+            dhcp.push_back(record.dhcp_ms);
+        }
+        total.push_back(record.total_ms);
+    }
+
+    WifiConnectStats stats;
+    stats.scan = GetPhaseStats(scan);
+    stats.connect = GetPhaseStats(connect);
+    stats.dhcp = GetPhaseStats(dhcp);
+    stats.total = GetPhaseStats(total);
+    return stats;
+}
+
+WifiReconnectStats WifiStation::GetReconnectStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return reconnect_stats_;
+}
+
+std::map<uint16_t, uint32_t> WifiStation::GetDisconnectReasons() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return disconnect_reasons_;
+}
+
+void WifiStation::SelectNetworkFromScan() {
+    uint16_t ap_num = 0;
+    esp_wifi_scan_get_ap_num(&ap_num);
+    std::vector<wifi_ap_record_t> ap_records(ap_num);
+    esp_wifi_scan_get_ap_records(&ap_num, ap_records.data());
+
+    int network_index;
+    int ap_index = SelectNetwork(networks_, ap_records.data(), ap_num, &network_index);
+    if (ap_index < 0) {
+        ESP_LOGW(TAG, "No known network found in %d APs", ap_num);
+        ScheduleReconnect();
+        return;
+    }
+
+    auto* best_ap = &ap_records[ap_index];
+    network_ = networks_[network_index];
+    memcpy(network_.bssid, best_ap->bssid, sizeof(network_.bssid));
+    network_.channel = best_ap->primary;
+    network_.authmode = best_ap->authmode;
+    ESP_LOGI(TAG, "Connecting to WiFi ssid=%s rssi=%d priority=%d", network_.ssid.c_str(), best_ap->rssi, network_.priority);
+    use_cached_ap_ = true;
+    ApplyStationConfig();
+    SetState(WifiState::Connecting);
+    esp_wifi_connect();
+}
+
+void WifiStation::ApplyStationConfig() {
+    wifi_config_t wifi_config;
+    bzero(&wifi_config, sizeof(wifi_config));
+    strncpy((char *)wifi_config.sta.ssid, network_.ssid.c_str(), sizeof(wifi_config.sta.ssid));
+    strncpy((char *)wifi_config.sta.password, network_.password.c_str(), sizeof(wifi_config.sta.password));
+    if (power_policy_enabled_) {
+        wifi_config.sta.listen_interval = power_policy_.listen_interval;
+    }
+    if (use_cached_ap_) {
+        // Go straight to the known AP instead of scanning all channels
+        ESP_LOGI(TAG, "Using AP " MACSTR " channel=%d", MAC2STR(network_.bssid), network_.channel);
+        memcpy(wifi_config.sta.bssid, network_.bssid, sizeof(network_.bssid));
+        wifi_config.sta.bssid_set = true;
+        wifi_config.sta.channel = network_.channel;
+        if (network_.psk.length() == sizeof(wifi_config.sta.password) && WifiPskSupported(network_.authmode)) {
+            // A 64 hex character password is taken as the PSK itself
+            memcpy(wifi_config.sta.password, network_.psk.data(), sizeof(wifi_config.sta.password));
+        }
+    }
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+}
+
+void WifiStation::UpdateLinkInfo(bool connected, const esp_ip4_addr_t* ip) {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    auto& info = link_info_;
+    if (!connected) {
+        info = WifiLinkInfo();
+        PublishLinkInfo();
+        return;
+    }
+
     wifi_ap_record_t ap_info;
-    ESP_ERROR_CHECK(esp_wifi_sta_get_ap_info(&ap_info));
-    return ap_info.primary;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return;
+    }
+    if (!info.connected) {
+        info.connected = true;
+        info.connected_time = esp_timer_get_time();
+        rssi_filter_ = ap_info.rssi * 8;
+    }
+    if (ip != nullptr) {
+        info.ip = *ip;
+    }
+    // Smooth with a weight of 1/8 per sample, kept in 1/8 dBm
+    rssi_filter_ += ap_info.rssi - rssi_filter_ / 8;
+    info.rssi = ap_info.rssi;
+    info.rssi_average = rssi_filter_ / 8;
+    info.channel = ap_info.primary;
+    memcpy(info.bssid, ap_info.bssid, sizeof(info.bssid));
+    PublishLinkInfo();
 }
 
-bool WifiStation::IsConnected() {
-    return xEventGroupGetBits(event_group_) & WIFI_EVENT_CONNECTED;
+void WifiStation::PublishLinkInfo() {
+    uint32_t words[LINK_INFO_WORDS] = {};
+    memcpy(words, &link_info_, sizeof(link_info_));
+
+    // Readers use copy 1 while copy 0 is written and copy 0 while copy 1 is written,
+    // so they never wait for the writer. The fence keeps the stores of a copy after the
+    // increment that sends readers to the other one.
+    for (int copy = 0; copy < 2; copy++) {
+        link_sequence_.fetch_add(1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < LINK_INFO_WORDS; i++) {
+            link_copies_[copy][i].store(words[i], std::memory_order_relaxed);
+        }
+    }
+}
+
+WifiLinkInfo WifiStation::GetLinkInfo() const {
+    uint32_t words[LINK_INFO_WORDS];
+    uint32_t sequence;
+    do {
+        sequence = link_sequence_.load(std::memory_order_acquire);
+        auto& copy = link_copies_[sequence & 1];
+        for (size_t i = 0; i < LINK_INFO_WORDS; i++) {
+            words[i] = copy[i].load(std::memory_order_relaxed);
+        }
+        // Keeps the loads of the copy before the second read of the sequence
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while (sequence != link_sequence_.load(std::memory_order_relaxed));
+
+    WifiLinkInfo info;
+    memcpy(&info, words, sizeof(info));
+    return info;
+}
+
+int WifiStation::GetLinkUptime() const {
+    auto info = GetLinkInfo();
+    if (!info.connected) {
+        return 0;
+    }
+    return (int)((esp_timer_get_time() - info.connected_time) / 1000);
+}
+
+std::string WifiStation::GetIpAddress() const {
+    auto info = GetLinkInfo();
+    if (info.ip.addr == 0) {
+        return "";
+    }
+    char ip_address[16];
+    esp_ip4addr_ntoa(&info.ip, ip_address, sizeof(ip_address));
+    return std::string(ip_address);
+}
+
+const char* WifiStation::GetStateName(WifiState state) {
+    static const char* const names[] = {
+        "idle", "scanning", "connecting", "obtaining ip", "connected", "backoff", "failed"
+    };
+    return names[(int)state];
+}
+
+int WifiStation::Subscribe(std::function<void(WifiState old_state, WifiState new_state)> callback) {
+    std::lock_guard<std::mutex> lock(subscribers_mutex_);
+    int id = ++next_subscriber_id_;
+    subscribers_[id] = std::move(callback);
+    return id;
+}
+
+void WifiStation::Unsubscribe(int id) {
+    std::lock_guard<std::mutex> lock(subscribers_mutex_);
+    subscribers_.erase(id);
+}
+
+void WifiStation::SetState(WifiState state) {
+    std::lock_guard<std::recursive_mutex> state_lock(state_mutex_);
+    auto old_state = state_.exchange(state);
+    if (old_state == state) {
+        return;
+    }
+    ESP_LOGI(TAG, "State %s -> %s", GetStateName(old_state), GetStateName(state));
+    pending_transitions_.emplace_back(old_state, state);
+    if (delivering_) {
+        // Changed by a subscriber, the loop below delivers it after the current change
+        return;
+    }
+
+    delivering_ = true;
+    while (!pending_transitions_.empty()) {
+        auto [from, to] = pending_transitions_.front();
+        pending_transitions_.pop_front();
+
+        // Call without the subscribers lock so that subscribers may unsubscribe themselves
+        std::vector<std::function<void(WifiState old_state, WifiState new_state)>> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(subscribers_mutex_);
+            for (auto& [id, callback] : subscribers_) {
+                callbacks.push_back(callback);
+            }
+        }
+        for (auto& callback : callbacks) {
+            callback(from, to);
+        }
+    }
+    delivering_ = false;
 }
 
 void WifiStation::SetPowerSaveMode(bool enabled) {
-    ESP_ERROR_CHECK(esp_wifi_set_ps(enabled ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE));
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    power_policy_enabled_ = false;
+    auto mode = enabled ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE;
+    if (instance_any_id_ == nullptr) {
+        // No driver to tell yet, the next start applies it
+        ps_mode_ = mode;
+        return;
+    }
+    SwitchPowerSaveMode(mode, esp_timer_get_time());
+}
+
+void WifiStation::SetPowerSavePolicy(const WifiPowerSavePolicy& policy) {
+    {
+        std::lock_guard<std::mutex> lock(power_mutex_);
+        power_policy_ = policy;
+        power_policy_enabled_ = true;
+        deeper_mode_time_ = 0;
+    }
+    EvaluatePowerSave();
+}
+
+void WifiStation::SetActivity(WifiActivity activity) {
+    {
+        std::lock_guard<std::mutex> lock(power_mutex_);
+        activity_ = activity;
+    }
+    EvaluatePowerSave();
+}
+
+static const char* const ps_mode_names[] = { "none", "min modem", "max modem" };
+
+void WifiStation::SwitchPowerSaveMode(wifi_ps_type_t mode, int64_t now) {
+    if (ps_mode_time_ != 0) {
+        power_stats_.time_ms[ps_mode_] += (now - ps_mode_time_) / 1000;
+    }
+    ps_mode_time_ = now;
+    if (mode == ps_mode_) {
+        return;
+    }
+    if (esp_wifi_set_ps(mode) != ESP_OK) {
+        return;
+    }
+    ESP_LOGI(TAG, "Power save %s -> %s", ps_mode_names[ps_mode_], ps_mode_names[mode]);
+    ps_mode_ = mode;
+    power_stats_.switches++;
+}
+
+void WifiStation::EvaluatePowerSave() {
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    if (!power_policy_enabled_ || instance_any_id_ == nullptr) {
+        return;
+    }
+
+    auto now = esp_timer_get_time();
+    int rate = 0;
+    if (traffic_time_ != 0 && now > traffic_time_) {
+        rate = (int)(traffic_bytes_.exchange(0) * 1000000LL / (now - traffic_time_));
+    } else {
+        traffic_bytes_ = 0;
+    }
+    traffic_time_ = now;
+
+    wifi_ps_type_t mode = GetWantedPowerSaveMode(power_policy_, activity_, rate);
+
+    // Wake up at once, but only sleep deeper after the hold time
+    if (mode > ps_mode_) {
+        if (deeper_mode_time_ == 0) {
+            deeper_mode_time_ = now;
+        }
+        if (now - deeper_mode_time_ < (int64_t)power_policy_.hold_time_ms * 1000) {
+            return;
+        }
+    }
+    deeper_mode_time_ = 0;
+    SwitchPowerSaveMode(mode, now);
+}
+
+WifiPowerSaveStats WifiStation::GetPowerSaveStats() {
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    auto stats = power_stats_;
+    stats.mode = ps_mode_;
+    if (ps_mode_time_ != 0) {
+        stats.time_ms[ps_mode_] += (esp_timer_get_time() - ps_mode_time_) / 1000;
+    }
+    return stats;
 }
 
 // Static event handler functions
 void WifiStation::WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     auto* this_ = static_cast<WifiStation*>(arg);
     if (event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        this_->Connect();
+    } else if (event_id == WIFI_EVENT_SCAN_DONE) {
+        if (!this_->scan_pending_.exchange(false)) {
+            // Started by the application or WifiConfigurationAp, leave the records to them
+            return;
+        }
+        this_->scan_done_time_ = esp_timer_get_time();
+        this_->SelectNetworkFromScan();
+    } else if (event_id == WIFI_EVENT_STA_CONNECTED) {
+        this_->associated_time_ = esp_timer_get_time();
+        this_->SetState(WifiState::ObtainingIp);
+        if (this_->static_ip_) {
+            this_->ProbeReusedAddress();
+        }
     } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        auto* event = static_cast<wifi_event_sta_disconnected_t*>(event_data);
         xEventGroupClearBits(this_->event_group_, WIFI_EVENT_CONNECTED);
-        if (this_->reconnect_count_ < MAX_RECONNECT_COUNT) {
+        esp_timer_stop(this_->link_timer_);
+        this_->UpdateLinkInfo(false, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(this_->stats_mutex_);
+            this_->disconnect_reasons_[event->reason]++;
+        }
+        this_->last_disconnect_reason_ = event->reason;
+        ESP_LOGI(TAG, "Disconnected, reason=%d", event->reason);
+        if (this_->disconnected_time_ == 0 && this_->connected_once_) {
+            // Until the first connection the times count from the start
+            this_->disconnected_time_ = esp_timer_get_time();
+        }
+        if (this_->static_ip_) {
+            // The network may have changed while sleeping, ask DHCP from now on
+            esp_timer_stop(this_->address_timer_);
+            this_->static_ip_ = false;
+            esp_netif_dhcpc_start(this_->sta_netif_);
+        }
+        if (this_->fast_wake_ && !this_->connected_once_) {
+            // The network kept for the wake is gone, go on with the known networks
+            this_->fast_wake_ = false;
+            auto networks = this_->auth_network_.ssid.empty() ? SsidManager::GetInstance().GetSsidList()
+                                                               : std::vector<SsidItem>{ this_->auth_network_ };
+            if (!networks.empty()) {
+                ESP_LOGW(TAG, "Fast wake network not reachable, trying %d known networks", (int)networks.size());
+                this_->networks_ = std::move(networks);
+                if (this_->networks_.size() == 1) {
+                    this_->network_ = this_->networks_[0];
+                    this_->use_cached_ap_ = this_->network_.channel != 0;
+                    this_->ApplyStationConfig();
+                } else {
+                    this_->network_ = SsidItem();
+                    this_->use_cached_ap_ = false;
+                }
+                this_->Connect();
+                return;
+            }
+        }
+        if (this_->use_cached_ap_) {
+            // The cached AP is gone or has moved, fall back to a full scan with the passphrase
+            ESP_LOGW(TAG, "Cached AP not reachable, scanning all channels");
+            this_->use_cached_ap_ = false;
+            this_->ApplyStationConfig();
+            this_->attempt_time_ = esp_timer_get_time();
+            this_->scan_start_time_ = 0;
+            this_->SetState(WifiState::Connecting);
             esp_wifi_connect();
-            this_->reconnect_count_++;
-            ESP_LOGI(TAG, "Reconnecting WiFi (attempt %d)", this_->reconnect_count_);
-        } else {
-            xEventGroupSetBits(this_->event_group_, WIFI_EVENT_FAILED);
-            ESP_LOGI(TAG, "WiFi connection failed");
+            return;
+        }
+
+        if (ClassifyDisconnectReason(event->reason) == WifiDisconnectClass::FailFast && !this_->connected_once_) {
+            // Report the failure now instead of after all attempts
+            ESP_LOGE(TAG, "Authentication with %s failed", this_->network_.ssid.c_str());
+            this_->reconnect_count_ = std::max(this_->reconnect_count_, this_->reconnect_policy_.max_attempts);
         }
+        // The strategy decides the delay, by default only the first attempt after losing the link skips the backoff
+        this_->ScheduleReconnect(event->reason);
     }
 }
 
@@ -150,9 +1001,53 @@ void WifiStation::IpEventHandler(void* arg, esp_event_base_t event_base, int32_t
     auto* this_ = static_cast<WifiStation*>(arg);
     auto* event = static_cast<ip_event_got_ip_t*>(event_data);
 
-    char ip_address[16];
-    esp_ip4addr_ntoa(&event->ip_info.ip, ip_address, sizeof(ip_address));
-    this_->ip_address_ = ip_address;
-    ESP_LOGI(TAG, "Got IP: %s", this_->ip_address_.c_str());
+    ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+    if (this_->state_ == WifiState::Connected) {
+        // A new address on the same link, after a DHCP renewal
+        this_->UpdateLinkInfo(true, &event->ip_info.ip);
+        this_->SaveFastWakeState(&event->ip_info);
+        return;
+    }
+    if (this_->wake_to_ip_ms_ == 0) {
+        // esp_timer starts with the application, after the ROM and the bootloader
+        this_->wake_to_ip_ms_ = (int)(esp_timer_get_time() / 1000);
+        ESP_LOGI(TAG, "IP %d ms after boot%s", this_->wake_to_ip_ms_.load(), this_->fast_wake_ ? " (fast wake)" : "");
+    }
+    this_->UpdateLinkInfo(true, &event->ip_info.ip);
+    esp_timer_stop(this_->link_timer_);
+    esp_timer_start_periodic(this_->link_timer_, LINK_SAMPLE_INTERVAL_MS * 1000);
+    this_->AddConnectRecord(esp_timer_get_time());
+
+    if (this_->connected_once_ && this_->disconnected_time_ != 0) {
+        std::lock_guard<std::mutex> lock(this_->stats_mutex_);
+        auto& stats = this_->reconnect_stats_;
+        stats.recoveries++;
+        stats.last_recover_time_ms = (int)((esp_timer_get_time() - this_->disconnected_time_) / 1000);
+        if (stats.last_recover_time_ms > stats.max_recover_time_ms) {
+            stats.max_recover_time_ms = stats.last_recover_time_ms;
+        }
+        ESP_LOGI(TAG, "Recovered after %d ms and %d attempts", stats.last_recover_time_ms, this_->reconnect_count_);
+    }
+    this_->connected_once_ = true;
+    this_->disconnected_time_ = 0;
+    this_->reconnect_count_ = 0;
+
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        auto& network = this_->network_;
+        memcpy(network.bssid, ap_info.bssid, sizeof(network.bssid));
+        network.channel = ap_info.primary;
+        network.authmode = ap_info.authmode;
+        // A fast wake to the same AP has nothing new for NVS, do not write it on every wake
+        bool same_ap = this_->fast_wake_ && this_->fast_wake_network_.channel == ap_info.primary &&
+            memcmp(this_->fast_wake_network_.bssid, ap_info.bssid, sizeof(ap_info.bssid)) == 0;
+        if (!same_ap) {
+            SsidManager::GetInstance().UpdateConnectedAp(network.ssid, ap_info);
+        }
+    }
+    this_->SaveFastWakeState(&event->ip_info);
+    xEventGroupClearBits(this_->event_group_, WIFI_EVENT_FAILED);
     xEventGroupSetBits(this_->event_group_, WIFI_EVENT_CONNECTED);
+    this_->SetState(WifiState::Connected);
+    this_->CompleteStart(WifiStationResult::Connected);
 }